@@ -0,0 +1,726 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/** Prints an error to stderr with an "ERROR: " prefix, and newline suffix.
+ *
+ * @param message The error to print
+ */
+void formatError(const std::string &message)
+{
+    std::cerr << "ERROR: " << message << std::endl;
+}
+
+/** Everything the generator can emit.  B_COND and EIGHT_BYTE only exist in the token form; the
+ *  `asm` form turns b.cond into b and drops .8byte, since asm supports neither. */
+enum Kind
+{
+    ADD,
+    SUB,
+    MUL,
+    SMULH,
+    UMULH,
+    SDIV,
+    UDIV,
+    CMP,
+    BR,
+    BLR,
+    LDUR,
+    STUR,
+    LDR,
+    B,
+    B_COND,
+    EIGHT_BYTE,
+    KIND_COUNT
+};
+
+const char *const KIND_NAMES[KIND_COUNT] = {"add", "sub", "mul", "smulh", "umulh", "sdiv", "udiv", "cmp",
+                                            "br", "blr", "ldur", "stur", "ldr", "b", "b.cond", ".8byte"};
+
+const char *const CONDITIONS[] = {"eq", "ne", "hs", "lo", "hi", "ls", "ge", "lt", "gt", "le"};
+
+struct GeneratorOptions
+{
+    uint64_t instructions = 100000;
+    uint64_t seed = 1;
+
+    // On average, one label is defined every labelEvery items
+    uint64_t labelEvery = 16;
+
+    // Probability that a branch targets a label that is defined later
+    double forward = 0.5;
+
+    unsigned weights[KIND_COUNT] = {4, 4, 2, 1, 1, 1, 1, 3, 1, 1, 3, 3, 2, 2, 3, 1};
+};
+
+/** xorshift64*: fast, and the sequence depends only on the seed, which the generator relies on */
+class Random
+{
+public:
+    explicit Random(uint64_t seed) : state(seed * 2 + 1) {}
+
+    uint64_t next()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 2685821657736338717ull;
+    }
+
+    uint64_t below(uint64_t n) { return next() % n; }
+
+private:
+    uint64_t state;
+};
+
+/** Appends to a buffer that is written out to a file in large blocks */
+class Writer
+{
+public:
+    explicit Writer(FILE *fp) : fp(fp) {}
+    ~Writer() { flush(); }
+
+    Writer &operator<<(const char *s)
+    {
+        buffer += s;
+        check();
+        return *this;
+    }
+
+    Writer &operator<<(int64_t value)
+    {
+        char digits[24];
+        snprintf(digits, sizeof(digits), "%lld", static_cast<long long>(value));
+        return *this << digits;
+    }
+
+    Writer &reg(unsigned r)
+    {
+        if (r == 31)
+        {
+            return *this << "xzr";
+        }
+        return *this << "x" << static_cast<int64_t>(r);
+    }
+
+    void flush()
+    {
+        fwrite(buffer.data(), 1, buffer.size(), fp);
+        buffer.clear();
+    }
+
+private:
+    void check()
+    {
+        if (buffer.size() > (1 << 20))
+        {
+            flush();
+        }
+    }
+
+    FILE *fp;
+    std::string buffer;
+};
+
+/** One generated line.  The generator draws items from a seeded RNG, so two generators with the
+ *  same options produce the same items; emitting makes a second pass once label addresses are known.
+ */
+struct Item
+{
+    Kind kind;
+    bool defineLabel; // a label is defined just before this item
+    unsigned regs[3];
+    int64_t imm;
+    uint64_t target; // label id, for b / b.cond / .8byte with useLabel
+    bool useLabel;
+    unsigned cond;
+};
+
+class Generator
+{
+public:
+    explicit Generator(const GeneratorOptions &options) : options(options), random(options.seed)
+    {
+        for (unsigned weight : options.weights)
+        {
+            totalWeight += weight;
+        }
+    }
+
+    Item next()
+    {
+        Item item = {};
+        item.defineLabel = labels == 0 || random.below(options.labelEvery) == 0;
+        if (item.defineLabel)
+        {
+            labels++;
+        }
+
+        uint64_t pick = random.below(totalWeight);
+        unsigned kind = 0;
+        while (pick >= options.weights[kind])
+        {
+            pick -= options.weights[kind];
+            kind++;
+        }
+        item.kind = static_cast<Kind>(kind);
+        for (unsigned &r : item.regs)
+        {
+            r = random.below(31);
+        }
+        if (random.below(8) == 0)
+        {
+            item.regs[2] = 31; // xzr, in the positions where it is allowed
+        }
+        item.cond = random.below(sizeof(CONDITIONS) / sizeof(CONDITIONS[0]));
+
+        // Keep branches within +-1MB (b.cond's reach) by targeting nearby labels
+        uint64_t window = std::max<uint64_t>(1, 50000 / options.labelEvery);
+        uint64_t distance = random.below(window);
+        bool forward = random.below(1000) < options.forward * 1000;
+        item.target = forward ? labels + distance : (labels - 1 >= distance ? labels - 1 - distance : 0);
+        item.useLabel = random.below(2) == 0;
+
+        switch (item.kind)
+        {
+        case LDUR:
+        case STUR:
+            item.imm = static_cast<int64_t>(random.below(512)) - 256;
+            break;
+        case LDR:
+            item.imm = (static_cast<int64_t>(random.below(512)) - 256) * 4;
+            break;
+        default:
+            item.imm = static_cast<int64_t>(random.next() >> 1);
+            break;
+        }
+        return item;
+    }
+
+private:
+    GeneratorOptions options;
+    Random random;
+    uint64_t totalWeight = 0;
+    uint64_t labels = 0;
+};
+
+/** Computes the address of every label in the asm form, where branches must be written as offsets.
+ *  The token form refers to labels by name and needs no layout. */
+static std::vector<int64_t> computeAsmLayout(const GeneratorOptions &options)
+{
+    std::vector<int64_t> addresses;
+    Generator generator(options);
+    int64_t current = 0;
+    for (uint64_t i = 0; i < options.instructions; i++)
+    {
+        Item item = generator.next();
+        if (item.defineLabel)
+        {
+            addresses.push_back(current);
+        }
+        current += item.kind == EIGHT_BYTE ? 0 : 4;
+    }
+    return addresses;
+}
+
+static void emitToken(Writer &out, const char *type, const char *lexeme)
+{
+    out << type << " " << lexeme << "\n";
+}
+
+static void emitRegToken(Writer &out, unsigned r)
+{
+    out << (r == 31 ? "ZREG " : "REG ");
+    out.reg(r) << "\n";
+}
+
+static void emitIntToken(Writer &out, int64_t value)
+{
+    out << "INT " << value << "\n";
+}
+
+/** Line counts of a generated program */
+struct ProgramSize
+{
+    uint64_t labels = 0;
+    uint64_t asmLines = 0;   // lines in the asm source form
+    uint64_t tokenLines = 0; // NEWLINE-terminated lines in the token form
+};
+
+/** Writes the program in asm's source form and in the token form asm-tokenizer reads. */
+ProgramSize generate(const GeneratorOptions &options, FILE *asmFile, FILE *tokenFile)
+{
+    std::vector<int64_t> asmAddress = computeAsmLayout(options);
+    uint64_t labels = asmAddress.size();
+    ProgramSize size;
+    size.labels = labels;
+
+    Writer src(asmFile);
+    Writer tok(tokenFile);
+    Generator generator(options);
+    uint64_t label = 0;
+    int64_t asmCurrent = 0;
+    char name[32];
+    for (uint64_t i = 0; i < options.instructions; i++)
+    {
+        Item item = generator.next();
+        if (item.defineLabel)
+        {
+            snprintf(name, sizeof(name), "L%llu:", static_cast<unsigned long long>(label++));
+            emitToken(tok, "LABEL", name);
+            tok << "NEWLINE\n";
+        }
+        uint64_t target = std::min(item.target, labels - 1);
+        snprintf(name, sizeof(name), "L%llu", static_cast<unsigned long long>(target));
+        const unsigned *r = item.regs;
+
+        switch (item.kind)
+        {
+        case ADD:
+        case SUB:
+        case MUL:
+        case SMULH:
+        case UMULH:
+        case SDIV:
+        case UDIV:
+            src << KIND_NAMES[item.kind] << " ";
+            src.reg(r[0]) << ", ";
+            src.reg(r[1]) << ", ";
+            src.reg(r[2]) << "\n";
+            emitToken(tok, "ID", KIND_NAMES[item.kind]);
+            emitRegToken(tok, r[0]);
+            emitToken(tok, "COMMA", ",");
+            emitRegToken(tok, r[1]);
+            emitToken(tok, "COMMA", ",");
+            emitRegToken(tok, r[2]);
+            break;
+        case CMP:
+            src << "cmp ";
+            src.reg(r[0]) << ", ";
+            src.reg(r[2]) << "\n";
+            emitToken(tok, "ID", "cmp");
+            emitRegToken(tok, r[0]);
+            emitToken(tok, "COMMA", ",");
+            emitRegToken(tok, r[2]);
+            break;
+        case BR:
+        case BLR:
+            src << KIND_NAMES[item.kind] << " ";
+            src.reg(r[0]) << "\n";
+            emitToken(tok, "ID", KIND_NAMES[item.kind]);
+            emitRegToken(tok, r[0]);
+            break;
+        case LDUR:
+        case STUR:
+            src << KIND_NAMES[item.kind] << " ";
+            src.reg(r[0]) << ", [";
+            src.reg(r[1]) << ", " << item.imm << "]\n";
+            emitToken(tok, "ID", KIND_NAMES[item.kind]);
+            emitRegToken(tok, r[0]);
+            emitToken(tok, "COMMA", ",");
+            emitToken(tok, "LBRACK", "[");
+            emitRegToken(tok, r[1]);
+            emitToken(tok, "COMMA", ",");
+            emitIntToken(tok, item.imm);
+            emitToken(tok, "RBRACK", "]");
+            break;
+        case LDR:
+            src << "ldr ";
+            src.reg(r[0]) << ", " << item.imm << "\n";
+            emitToken(tok, "ID", "ldr");
+            emitRegToken(tok, r[0]);
+            emitToken(tok, "COMMA", ",");
+            emitIntToken(tok, item.imm);
+            break;
+        case B:
+        case B_COND:
+            src << "b " << asmAddress[target] - asmCurrent << "\n";
+            emitToken(tok, "ID", "b");
+            if (item.kind == B_COND)
+            {
+                char cond[8];
+                snprintf(cond, sizeof(cond), ".%s", CONDITIONS[item.cond]);
+                emitToken(tok, "DOTID", cond);
+            }
+            emitToken(tok, "ID", name);
+            break;
+        case EIGHT_BYTE:
+            emitToken(tok, "DOTID", ".8byte");
+            if (item.useLabel)
+            {
+                emitToken(tok, "ID", name);
+            }
+            else
+            {
+                emitIntToken(tok, item.imm);
+            }
+            break;
+        case KIND_COUNT:
+            break;
+        }
+        tok << "NEWLINE\n";
+        asmCurrent += item.kind == EIGHT_BYTE ? 0 : 4;
+        size.asmLines += item.kind == EIGHT_BYTE ? 0 : 1;
+        size.tokenLines += item.defineLabel ? 2 : 1;
+    }
+    return size;
+}
+
+/** Resource usage of one run of a tool */
+struct RunResult
+{
+    bool ok = false;
+    double wall = 0;
+    double cpu = 0;
+    long peakRssKb = 0;
+    uint64_t allocations = 0;
+    std::vector<std::pair<std::string, double>> phases;
+};
+
+/** Reads the phase wall times and allocation count from the JSON stats line a tool prints with
+ *  ASM_STATS set (see stats.h).  Only the fields used here are parsed, relying on the fixed layout
+ *  `"phases":{"NAME":{"wall":W,"cpu":C},...}` and `"allocations":N`.
+ */
+static void parseStats(const std::string &json, RunResult &result)
+{
+    size_t pos = json.find("\"phases\":{");
+    size_t end = json.find("},\"counters\"");
+    if (pos == std::string::npos || end == std::string::npos)
+    {
+        return;
+    }
+    pos += 10;
+    while (pos < end && json[pos] == '"')
+    {
+        size_t nameEnd = json.find('"', pos + 1);
+        std::string name = json.substr(pos + 1, nameEnd - pos - 1);
+        size_t wall = json.find("\"wall\":", nameEnd);
+        result.phases.emplace_back(name, std::strtod(json.c_str() + wall + 7, nullptr));
+        pos = json.find('}', wall) + 1;
+        if (pos < end && json[pos] == ',')
+        {
+            pos++;
+        }
+    }
+    size_t allocations = json.find("\"allocations\":");
+    if (allocations != std::string::npos)
+    {
+        result.allocations = std::strtoull(json.c_str() + allocations + 14, nullptr, 10);
+    }
+}
+
+/** Runs a tool with ASM_STATS set, stdout discarded and stderr captured in errPath, then collects
+ *  its resource usage and the phase times it reported. */
+RunResult runTool(const std::vector<std::string> &argv, const std::string &errPath)
+{
+    RunResult result;
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int out = open("/dev/null", O_WRONLY);
+        int err = open(errPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(out, STDOUT_FILENO);
+        dup2(err, STDERR_FILENO);
+        setenv("ASM_STATS", "1", 1);
+        std::vector<char *> args;
+        for (const std::string &arg : argv)
+        {
+            args.push_back(const_cast<char *>(arg.c_str()));
+        }
+        args.push_back(nullptr);
+        execv(args[0], args.data());
+        _exit(127);
+    }
+    if (pid < 0)
+    {
+        return result;
+    }
+
+    int status = 0;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    result.wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec +
+                 usage.ru_stime.tv_usec / 1e6;
+    result.peakRssKb = usage.ru_maxrss;
+    result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    std::ifstream err(errPath);
+    std::string line;
+    while (std::getline(err, line))
+    {
+        if (line.starts_with("{\"tool\":"))
+        {
+            parseStats(line, result);
+        }
+    }
+    return result;
+}
+
+static uint64_t fileSize(const std::string &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+static void report(const std::string &tool, uint64_t instructions, uint64_t lines, uint64_t bytes,
+                   const RunResult &run)
+{
+    std::cout << std::left << std::setw(14) << tool << std::right << std::setw(10) << instructions;
+    if (!run.ok)
+    {
+        std::cout << "  FAILED (see stderr capture)" << std::endl;
+        return;
+    }
+    std::cout << std::fixed << std::setprecision(3) << std::setw(10) << run.wall << std::setw(10) << run.cpu
+              << std::setprecision(0) << std::setw(14) << lines / run.wall << std::setprecision(1)
+              << std::setw(10) << bytes / run.wall / 1e6 << std::setw(10) << run.peakRssKb / 1024.0 << "  ";
+    std::cout << std::setprecision(3);
+    for (const auto &phase : run.phases)
+    {
+        std::cout << phase.first << "=" << phase.second << " ";
+    }
+    std::cout << "allocs=" << run.allocations << std::endl;
+}
+
+static void usage()
+{
+    std::cerr << "Usage:" << std::endl
+              << "\tasm-bench gen [options] PREFIX" << std::endl
+              << "\tasm-bench run [options]" << std::endl
+              << std::endl
+              << "gen writes PREFIX.arm (asm source) and PREFIX.tok (asm-tokenizer tokens)." << std::endl
+              << "run generates a program of each size and times ./asm and ./asm-tokenizer on it, the latter"
+              << std::endl
+              << "on both the text and the binary token format (asm-tok-bin)." << std::endl
+              << std::endl
+              << "Options:" << std::endl
+              << "\t-n N              instructions to generate (gen; default 100000)" << std::endl
+              << "\t--sizes A,B,...   instruction counts to benchmark (run; default 1000,10000,100000,1000000)"
+              << std::endl
+              << "\t--seed S          RNG seed (default 1)" << std::endl
+              << "\t--label-every K   define a label every K items on average (default 16)" << std::endl
+              << "\t--forward P       fraction of branches that are forward references (default 0.5)"
+              << std::endl
+              << "\t--mix NAME=W,...  relative weight of each mnemonic; names: add sub mul smulh umulh sdiv"
+              << std::endl
+              << "\t                  udiv cmp br blr ldur stur ldr b b.cond .8byte" << std::endl
+              << "\t--asm PATH        asm binary (run; default ./asm)" << std::endl
+              << "\t--tokenizer PATH  asm-tokenizer binary (run; default ./asm-tokenizer)" << std::endl
+              << "\t-j N              pass -j N to asm (run)" << std::endl
+              << "\t--dir DIR         where run writes generated programs (default /tmp)" << std::endl;
+}
+
+static bool parseMix(const std::string &spec, GeneratorOptions &options)
+{
+    std::istringstream in(spec);
+    std::string entry;
+    while (std::getline(in, entry, ','))
+    {
+        size_t eq = entry.find('=');
+        if (eq == std::string::npos)
+        {
+            return false;
+        }
+        std::string name = entry.substr(0, eq);
+        unsigned kind = 0;
+        while (kind < KIND_COUNT && name != KIND_NAMES[kind])
+        {
+            kind++;
+        }
+        if (kind == KIND_COUNT)
+        {
+            return false;
+        }
+        options.weights[kind] = std::stoul(entry.substr(eq + 1));
+    }
+    unsigned total = 0;
+    for (unsigned weight : options.weights)
+    {
+        total += weight;
+    }
+    return total > 0;
+}
+
+/** Entrypoint for the benchmark.  `gen` writes a random valid program in both input forms; `run`
+ *  generates programs of increasing size and reports throughput, peak RSS and the per-phase times
+ *  and allocation counts the assemblers print when ASM_STATS is set.
+ *
+ * @return 0 on success, non-0 on error
+ */
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || (std::string(argv[1]) != "gen" && std::string(argv[1]) != "run"))
+    {
+        usage();
+        return 1;
+    }
+    std::string mode = argv[1];
+
+    GeneratorOptions options;
+    std::vector<uint64_t> sizes = {1000, 10000, 100000, 1000000};
+    std::string asmPath = "./asm";
+    std::string tokenizerPath = "./asm-tokenizer";
+    std::string dir = "/tmp";
+    std::string jobs;
+    std::string prefix;
+    try
+    {
+        for (int i = 2; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            bool hasValue = i + 1 < argc;
+            if (arg == "-n" && hasValue)
+            {
+                options.instructions = std::stoull(argv[++i]);
+            }
+            else if (arg == "--sizes" && hasValue)
+            {
+                sizes.clear();
+                std::istringstream in(argv[++i]);
+                std::string size;
+                while (std::getline(in, size, ','))
+                {
+                    sizes.push_back(std::stoull(size));
+                }
+            }
+            else if (arg == "--seed" && hasValue)
+            {
+                options.seed = std::stoull(argv[++i]);
+            }
+            else if (arg == "--label-every" && hasValue)
+            {
+                options.labelEvery = std::max<uint64_t>(1, std::stoull(argv[++i]));
+            }
+            else if (arg == "--forward" && hasValue)
+            {
+                options.forward = std::stod(argv[++i]);
+            }
+            else if (arg == "--mix" && hasValue)
+            {
+                if (!parseMix(argv[++i], options))
+                {
+                    formatError("Invalid --mix '" + std::string(argv[i]) + "'");
+                    return 1;
+                }
+            }
+            else if (arg == "--asm" && hasValue)
+            {
+                asmPath = argv[++i];
+            }
+            else if (arg == "--tokenizer" && hasValue)
+            {
+                tokenizerPath = argv[++i];
+            }
+            else if (arg == "--dir" && hasValue)
+            {
+                dir = argv[++i];
+            }
+            else if (arg == "-j" && hasValue)
+            {
+                jobs = argv[++i];
+            }
+            else if (mode == "gen" && prefix.empty() && arg[0] != '-')
+            {
+                prefix = arg;
+            }
+            else
+            {
+                usage();
+                return 1;
+            }
+        }
+    }
+    catch (std::exception &)
+    {
+        usage();
+        return 1;
+    }
+
+    if (mode == "gen")
+    {
+        if (prefix.empty())
+        {
+            usage();
+            return 1;
+        }
+        FILE *asmFile = fopen((prefix + ".arm").c_str(), "wb");
+        FILE *tokenFile = fopen((prefix + ".tok").c_str(), "wb");
+        if (asmFile == nullptr || tokenFile == nullptr)
+        {
+            formatError("Unable to write '" + prefix + ".arm' / '" + prefix + ".tok'");
+            return 1;
+        }
+        generate(options, asmFile, tokenFile);
+        fclose(asmFile);
+        fclose(tokenFile);
+        return 0;
+    }
+
+    std::cout << std::left << std::setw(14) << "tool" << std::right << std::setw(10) << "instrs" << std::setw(10)
+              << "wall_s" << std::setw(10) << "cpu_s" << std::setw(14) << "lines/s" << std::setw(10) << "MB/s"
+              << std::setw(10) << "rss_MB" << "  phases (s)" << std::endl;
+    for (uint64_t instructions : sizes)
+    {
+        options.instructions = instructions;
+        std::string base = dir + "/asm-bench-" + std::to_string(getpid()) + "-" + std::to_string(instructions);
+        std::string sourcePath = base + ".arm";
+        std::string tokenPath = base + ".tok";
+        std::string binaryPath = base + ".btok";
+        std::string errPath = base + ".err";
+
+        auto start = std::chrono::steady_clock::now();
+        FILE *asmFile = fopen(sourcePath.c_str(), "wb");
+        FILE *tokenFile = fopen(tokenPath.c_str(), "wb");
+        if (asmFile == nullptr || tokenFile == nullptr)
+        {
+            formatError("Unable to write to '" + dir + "'");
+            return 1;
+        }
+        ProgramSize size = generate(options, asmFile, tokenFile);
+        fclose(asmFile);
+        fclose(tokenFile);
+        double generateTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "# " << instructions << " instructions, " << size.labels << " labels, generated in "
+                  << std::fixed << std::setprecision(3) << generateTime << " s" << std::endl;
+
+        std::vector<std::string> asmArgs = {asmPath};
+        if (!jobs.empty())
+        {
+            asmArgs.push_back("-j");
+            asmArgs.push_back(jobs);
+        }
+        asmArgs.push_back(sourcePath);
+        report("asm", instructions, size.asmLines, fileSize(sourcePath), runTool(asmArgs, errPath));
+        report("asm-tokenizer", instructions, size.tokenLines, fileSize(tokenPath),
+               runTool({tokenizerPath, tokenPath}, errPath));
+
+        // The same tokens in the binary format, converted by the tokenizer (not timed)
+        if (runTool({tokenizerPath, "--write-tokens", binaryPath, tokenPath}, errPath).ok)
+        {
+            report("asm-tok-bin", instructions, size.tokenLines, fileSize(binaryPath),
+                   runTool({tokenizerPath, binaryPath}, errPath));
+        }
+
+        unlink(sourcePath.c_str());
+        unlink(tokenPath.c_str());
+        unlink(binaryPath.c_str());
+        unlink(errPath.c_str());
+    }
+    return 0;
+}
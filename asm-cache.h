@@ -0,0 +1,161 @@
+#ifndef ASM_CACHE_H
+#define ASM_CACHE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** On-disk cache of machine code, used by `asm --cache` (per line) and `asm-tokenizer --cache` (per
+ *  label-delimited block).  Entries are addressed by their content: the key is everything the
+ *  encoded bytes depend on, and it is stored in full and compared on lookup, so a hit can never
+ *  return bytes that differ from a clean build.
+ *
+ *  The file is rewritten when the cache is destroyed: entries used or added by this run first, then
+ *  older entries until the file reaches MAX_BYTES.  Lookups and inserts may come from any thread.
+ *  Hit and miss counts are reported by the tools as the `cache_hits` and `cache_misses` stats.
+ */
+class AssemblyCache
+{
+public:
+    static const uint64_t MAX_BYTES = 256ull << 20;
+
+    explicit AssemblyCache(const std::string &path) : path(path)
+    {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        uint64_t left = in ? static_cast<uint64_t>(in.tellg()) : 0;
+        in.seekg(0);
+        std::string magic(MAGIC.size(), '\0');
+        if (!in.read(magic.data(), magic.size()) || magic != MAGIC)
+        {
+            return; // missing, or written by another version: start empty
+        }
+        left -= MAGIC.size();
+        uint32_t lengths[2];
+        while (in.read(reinterpret_cast<char *>(lengths), sizeof(lengths)))
+        {
+            left -= sizeof(lengths);
+            if (uint64_t(lengths[0]) + lengths[1] > left)
+            {
+                break; // truncated tail, or garbage lengths that must not be allocated
+            }
+            left -= uint64_t(lengths[0]) + lengths[1];
+            std::string key(lengths[0], '\0');
+            std::string value(lengths[1], '\0');
+            if (!in.read(key.data(), key.size()) || !in.read(value.data(), value.size()))
+            {
+                break; // truncated tail
+            }
+            entries.emplace(std::move(key), Entry{std::move(value), false});
+        }
+    }
+
+    ~AssemblyCache()
+    {
+        save();
+    }
+
+    /** Copies the cached bytes for key into value and returns true, or counts a miss */
+    bool find(const std::string &key, std::string &value)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto entry = entries.find(key);
+        if (entry == entries.end())
+        {
+            misses++;
+            return false;
+        }
+        hits++;
+        entry->second.used = true;
+        value = entry->second.value;
+        return true;
+    }
+
+    void insert(const std::string &key, const std::string &value)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries[key] = Entry{value, true};
+    }
+
+    uint64_t hitCount()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return hits;
+    }
+
+    uint64_t missCount()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return misses;
+    }
+
+private:
+    static inline const std::string MAGIC = "ASMCACHE1\n";
+
+    struct Entry
+    {
+        std::string value;
+        bool used; // looked up or inserted by this run
+    };
+
+    /** Writes the cache to a temporary file of its own and renames it into place, so that builds
+     *  sharing a cache each replace it whole */
+    void save()
+    {
+        std::string temporary = path + ".XXXXXX";
+        int fd = mkstemp(temporary.data());
+        if (fd < 0)
+        {
+            return;
+        }
+        fchmod(fd, 0644);
+        close(fd);
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        out.write(MAGIC.data(), MAGIC.size());
+        uint64_t bytes = MAGIC.size();
+        for (bool used : {true, false})
+        {
+            for (const auto &[key, entry] : entries)
+            {
+                if (entry.used != used)
+                {
+                    continue;
+                }
+                uint64_t size = sizeof(uint32_t) * 2 + key.size() + entry.value.size();
+                if (!used && bytes + size > MAX_BYTES)
+                {
+                    continue;
+                }
+                uint32_t lengths[2] = {static_cast<uint32_t>(key.size()), static_cast<uint32_t>(entry.value.size())};
+                out.write(reinterpret_cast<const char *>(lengths), sizeof(lengths));
+                out.write(key.data(), key.size());
+                out.write(entry.value.data(), entry.value.size());
+                bytes += size;
+            }
+        }
+        out.close();
+        if (out)
+        {
+            std::rename(temporary.c_str(), path.c_str());
+        }
+        else
+        {
+            std::remove(temporary.c_str());
+        }
+    }
+
+    std::string path;
+    std::unordered_map<std::string, Entry> entries;
+    std::mutex mutex;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+#endif
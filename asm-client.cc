@@ -0,0 +1,162 @@
+#include <climits>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/** Prints an error to stderr with an "ERROR: " prefix, and newline suffix.
+ *
+ * @param message The error to print
+ */
+void formatError(const std::string &message)
+{
+    std::cerr << "ERROR: " << message << std::endl;
+}
+
+/** Socket used when ASM_SOCKET is not set */
+const char *const DEFAULT_SOCKET = "/tmp/asm.sock";
+
+static bool writeAll(int fd, const std::string &data)
+{
+    size_t written = 0;
+    while (written < data.size())
+    {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n <= 0)
+        {
+            return false;
+        }
+        written += n;
+    }
+    return true;
+}
+
+/** Reads everything until the daemon closes the connection */
+static std::string readAll(int fd)
+{
+    std::string data;
+    char buffer[65536];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        data.append(buffer, n);
+    }
+    return data;
+}
+
+/** Entrypoint for the client.  A drop-in replacement for `asm [FILE]` that hands the work to a
+ *  running `asm --daemon` (at $ASM_SOCKET, or /tmp/asm.sock) instead of starting an assembler.
+ *  Machine code goes to stdout (or to OUT with -o), errors to stderr, and the exit status is the
+ *  one `asm` would have returned.
+ *
+ * @return 0 on success, non-0 on error
+ */
+int main(int argc, char *argv[])
+{
+    std::string input = "-";
+    std::string outputPath;
+    int files = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-o" && i + 1 < argc)
+        {
+            outputPath = argv[++i];
+        }
+        else
+        {
+            input = arg;
+            files++;
+        }
+    }
+    if (files > 1)
+    {
+        std::cerr << "Usage:" << std::endl
+                  << "\tasm-client [-o $OUT] [$FILE]" << std::endl
+                  << std::endl
+                  << "If $FILE is unspecified or if $FILE is `-`, read the assembly from standard "
+                  << "in. Otherwise, the daemon reads the assembly from $FILE." << std::endl
+                  << "The daemon socket is $ASM_SOCKET, or " << DEFAULT_SOCKET << " if unset." << std::endl;
+        return 1;
+    }
+
+    // The daemon has its own working directory, so it must be given absolute paths
+    auto absolute = [](const std::string &path) -> std::string
+    {
+        if (path.empty() || path[0] == '/')
+        {
+            return path;
+        }
+        char cwd[PATH_MAX];
+        return getcwd(cwd, sizeof(cwd)) ? std::string(cwd) + "/" + path : path;
+    };
+
+    std::string request;
+    if (input == "-")
+    {
+        std::ostringstream source;
+        source << std::cin.rdbuf();
+        request = "SOURCE " + std::to_string(source.str().size()) + "\n" + source.str();
+    }
+    else
+    {
+        // Report a missing file the way asm does, with the path as given
+        if (access(input.c_str(), R_OK) != 0)
+        {
+            formatError("file '" + input + "' not found!");
+            return 1;
+        }
+        request = "PATH " + absolute(input) + "\n";
+    }
+    if (!outputPath.empty())
+    {
+        request += "OUTPUT " + absolute(outputPath) + "\n";
+    }
+    request += "END\n";
+
+    const char *socketPath = std::getenv("ASM_SOCKET");
+    if (socketPath == nullptr)
+    {
+        socketPath = DEFAULT_SOCKET;
+    }
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    std::string(socketPath).copy(address.sun_path, sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        formatError(std::string("unable to connect to the asm daemon at '") + socketPath + "'");
+        return 1;
+    }
+    if (!writeAll(fd, request))
+    {
+        formatError("lost connection to the asm daemon");
+        return 1;
+    }
+    shutdown(fd, SHUT_WR);
+
+    std::string response = readAll(fd);
+    close(fd);
+
+    int status = 1;
+    size_t outputLength = 0;
+    size_t errorLength = 0;
+    size_t headerEnd = response.find('\n');
+    std::istringstream header(response.substr(0, headerEnd));
+    if (headerEnd == std::string::npos || !(header >> status >> outputLength >> errorLength) ||
+        response.size() - headerEnd - 1 != outputLength + errorLength)
+    {
+        formatError("malformed response from the asm daemon");
+        return 1;
+    }
+
+    std::cout.write(response.data() + headerEnd + 1, outputLength);
+    std::cout.flush();
+    std::cerr.write(response.data() + headerEnd + 1 + outputLength, errorLength);
+    return status;
+}
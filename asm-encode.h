@@ -0,0 +1,830 @@
+#ifndef ASM_ENCODE_H
+#define ASM_ENCODE_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/** The parser and encoder behind the assembler library, written as constexpr so that the same code
+ *  assembles at runtime (asm-lib.h) and at compile time (arm64::assemble<"...">()).  Everything in
+ *  namespace detail is an implementation detail of those two, except that asm and asm-tokenizer
+ *  also encode through detail::encodeFields after parsing lines their own way.
+ */
+namespace arm64
+{
+
+enum class Error : uint8_t
+{
+    None,
+    Syntax,             // The line could not be split into a mnemonic and operands
+    UnknownInstruction, // Mnemonic is not supported
+    UnknownDirective,   // Directive other than `.8byte`
+    BadRegister,        // Not x0-x30, or xzr/sp where it is not allowed
+    BadImmediate,       // Not an integer, or does not fit in 64 bits
+    MissingOperand,
+    ExtraOperand,
+    ImmediateRange,     // Immediate outside the range the encoding can hold
+    ImmediateAlignment, // Branch or literal offset not a multiple of 4
+    LabelSyntax,        // A label must be alone on its line
+    DuplicateLabel,
+    UndefinedLabel,
+    OutputTooSmall      // Result::words holds the number of words needed
+};
+
+struct Result
+{
+    Error error = Error::None;
+
+    // On success, the number of words written.  For OutputTooSmall, the number of words needed.
+    size_t words = 0;
+
+    // 1-based line of the first error, or 0 on success
+    size_t line = 0;
+
+    constexpr explicit operator bool() const { return error == Error::None; }
+};
+
+namespace detail
+{
+
+constexpr uint32_t imm_mod_two(int64_t imm, uint32_t mod)
+{
+    int64_t m = static_cast<int64_t>(mod);
+    int64_t r = imm % m;
+    if (r < 0)
+        r += m;
+    return static_cast<uint32_t>(r);
+}
+
+constexpr uint32_t enc_r3_arith(uint32_t base, int rd, int rn, int rm)
+{
+    return base + static_cast<uint32_t>(rm) * 65536u // 2^16
+           + static_cast<uint32_t>(rn) * 32u         // 2^5
+           + static_cast<uint32_t>(rd);
+}
+
+enum class Kind : uint8_t
+{
+    Arith,     // rd, rn, rm
+    Compare,   // rn, rm
+    BranchReg, // rn
+    Memory,    // rt, [rn, imm9]
+    Literal,   // rt, imm19 * 4
+    MoveWide,  // rd, imm16 [, lsl 0/16/32/48]
+    Branch,    // imm26 * 4 or label
+    CondBranch // imm19 * 4 or label
+};
+
+struct InstructionInfo
+{
+    std::string_view name;
+    Kind kind;
+    uint32_t base;
+};
+
+/** Operand patterns follow `asm`: 'r' is a register (sp allowed), 'z' a register where xzr is allowed,
+ *  'i' an immediate, 'l' an immediate or a label. */
+constexpr const char *operandPattern(Kind kind)
+{
+    switch (kind)
+    {
+    case Kind::Arith:
+        return "rrz";
+    case Kind::Compare:
+        return "rz";
+    case Kind::BranchReg:
+        return "r";
+    case Kind::Memory:
+        return "rri";
+    case Kind::Literal:
+        return "ri";
+    case Kind::MoveWide:
+        return "zi";
+    case Kind::Branch:
+    case Kind::CondBranch:
+        return "l";
+    }
+    return "";
+}
+
+inline constexpr InstructionInfo INSTRUCTIONS[] = {
+    {"add", Kind::Arith, 0x8B206000u},
+    {"sub", Kind::Arith, 0xCB206000u},
+    {"mul", Kind::Arith, 0x9B007C00u},
+    {"smulh", Kind::Arith, 0x9B407C00u},
+    {"umulh", Kind::Arith, 0x9BC07C00u},
+    {"sdiv", Kind::Arith, 0x9AC00C00u},
+    {"udiv", Kind::Arith, 0x9AC00800u},
+    {"cmp", Kind::Compare, 0xEB206000u},
+    {"br", Kind::BranchReg, 0xD61F0000u},
+    {"blr", Kind::BranchReg, 0xD63F0000u},
+    {"ldur", Kind::Memory, 0xF8400000u},
+    {"stur", Kind::Memory, 0xF8000000u},
+    {"ldr", Kind::Literal, 0x58000000u},
+    {"movz", Kind::MoveWide, 0xD2800000u},
+    {"movk", Kind::MoveWide, 0xF2800000u},
+    {"movn", Kind::MoveWide, 0x92800000u},
+    {"b", Kind::Branch, 0x14000000u},
+};
+
+inline constexpr std::string_view CONDITIONS[16] = {
+    "eq", "ne", "hs", "lo", "", "", "", "", "hi", "ls", "ge", "lt", "gt", "le", "", ""};
+
+/** Finds the instruction for a mnemonic.  For `b.cond`, sets cond and returns a CondBranch entry. */
+constexpr bool lookupInstruction(std::string_view name, InstructionInfo &info)
+{
+    if (name.size() > 2 && name[0] == 'b' && name[1] == '.')
+    {
+        std::string_view suffix = name.substr(2);
+        for (uint32_t cond = 0; cond < 16; cond++)
+        {
+            if (!CONDITIONS[cond].empty() && CONDITIONS[cond] == suffix)
+            {
+                info = {name, Kind::CondBranch, 0x54000000u + cond};
+                return true;
+            }
+        }
+        return false;
+    }
+    for (const InstructionInfo &candidate : INSTRUCTIONS)
+    {
+        if (candidate.name == name)
+        {
+            info = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+constexpr bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+constexpr bool isIdentifierStart(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+constexpr bool isIdentifierChar(char c)
+{
+    return isIdentifierStart(c) || (c >= '0' && c <= '9');
+}
+
+constexpr bool isIdentifier(std::string_view s)
+{
+    if (s.empty() || !isIdentifierStart(s[0]))
+    {
+        return false;
+    }
+    for (char c : s)
+    {
+        if (!isIdentifierChar(c))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** Removes the comment and surrounding whitespace from a line. */
+constexpr std::string_view stripLine(std::string_view line)
+{
+    for (size_t i = 0; i < line.size(); i++)
+    {
+        if (line[i] == ';' || (line[i] == '/' && i + 1 < line.size() && line[i + 1] == '/'))
+        {
+            line = line.substr(0, i);
+            break;
+        }
+    }
+    while (!line.empty() && isSpace(line.front()))
+    {
+        line.remove_prefix(1);
+    }
+    while (!line.empty() && isSpace(line.back()))
+    {
+        line.remove_suffix(1);
+    }
+    return line;
+}
+
+/** If the (stripped) line is a label definition, sets name and returns true.  A `:` anywhere else on
+ *  the line is a label that is not alone on its line. */
+constexpr bool splitLabel(std::string_view line, std::string_view &name, Error &error)
+{
+    size_t colon = line.find(':');
+    if (colon == std::string_view::npos)
+    {
+        return false;
+    }
+    name = line.substr(0, colon);
+    while (!name.empty() && isSpace(name.back()))
+    {
+        name.remove_suffix(1);
+    }
+    if (colon + 1 != line.size())
+    {
+        error = Error::LabelSyntax;
+    }
+    else if (!isIdentifier(name))
+    {
+        error = Error::Syntax;
+    }
+    return true;
+}
+
+/** Parses an integer with an optional `#`, sign and `0x` prefix.  Hexadecimal values may use all 64
+ *  bits; decimal values must fit in an int64_t. */
+constexpr Error parseImmediate(std::string_view s, int64_t &value)
+{
+    if (!s.empty() && s[0] == '#')
+    {
+        s.remove_prefix(1);
+    }
+    bool negative = !s.empty() && s[0] == '-';
+    if (negative)
+    {
+        s.remove_prefix(1);
+    }
+    uint64_t base = 10;
+    if (s.size() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+    {
+        base = 16;
+        s.remove_prefix(2);
+    }
+    if (s.empty())
+    {
+        return Error::BadImmediate;
+    }
+    uint64_t result = 0;
+    for (char c : s)
+    {
+        uint64_t digit;
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (base == 16 && c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else if (base == 16 && c >= 'A' && c <= 'F')
+            digit = c - 'A' + 10;
+        else
+            return Error::BadImmediate;
+        if (result > (UINT64_MAX - digit) / base)
+        {
+            return Error::BadImmediate;
+        }
+        result = result * base + digit;
+    }
+    if (base == 10 && result > (negative ? uint64_t(1) << 63 : uint64_t(INT64_MAX)))
+    {
+        return Error::BadImmediate;
+    }
+    value = static_cast<int64_t>(negative ? 0 - result : result);
+    return Error::None;
+}
+
+/** Parses x0-x30, xzr or sp.  Returns false if s does not name a register at all. */
+constexpr bool parseRegister(std::string_view s, int &reg, bool &isZero, bool &isSp)
+{
+    isZero = s == "xzr";
+    isSp = s == "sp";
+    if (isZero || isSp)
+    {
+        reg = 31;
+        return true;
+    }
+    if (s.size() < 2 || s.size() > 3 || s[0] != 'x')
+    {
+        return false;
+    }
+    reg = 0;
+    for (char c : s.substr(1))
+    {
+        if (c < '0' || c > '9')
+        {
+            return false;
+        }
+        reg = reg * 10 + (c - '0');
+    }
+    return true;
+}
+
+struct Operand
+{
+    std::string_view text;
+    bool bracketed = false;
+};
+
+/** Splits "rd, [rn, imm]" style operand lists.  At most one bracketed group is allowed and it
+ *  must be last. */
+constexpr Error splitOperands(std::string_view s, Operand (&operands)[4], size_t &count)
+{
+    count = 0;
+    bool inBracket = false;
+    bool closedBracket = false;
+    while (!s.empty())
+    {
+        while (!s.empty() && isSpace(s.front()))
+        {
+            s.remove_prefix(1);
+        }
+        if (closedBracket)
+        {
+            return Error::Syntax;
+        }
+        if (!inBracket && !s.empty() && s.front() == '[')
+        {
+            inBracket = true;
+            s.remove_prefix(1);
+            while (!s.empty() && isSpace(s.front()))
+            {
+                s.remove_prefix(1);
+            }
+        }
+        size_t end = 0;
+        while (end < s.size() && s[end] != ',' && s[end] != ']' && s[end] != '[')
+        {
+            end++;
+        }
+        std::string_view text = s.substr(0, end);
+        while (!text.empty() && isSpace(text.back()))
+        {
+            text.remove_suffix(1);
+        }
+        if (text.empty() || count == 4)
+        {
+            return Error::Syntax;
+        }
+        operands[count++] = {text, inBracket};
+        s.remove_prefix(end);
+        if (!s.empty() && s.front() == ']')
+        {
+            if (!inBracket)
+            {
+                return Error::Syntax;
+            }
+            inBracket = false;
+            closedBracket = true;
+            s.remove_prefix(1);
+            while (!s.empty() && isSpace(s.front()))
+            {
+                s.remove_prefix(1);
+            }
+        }
+        if (!s.empty())
+        {
+            if (s.front() != ',')
+            {
+                return Error::Syntax;
+            }
+            s.remove_prefix(1);
+            if (s.empty())
+            {
+                return Error::Syntax;
+            }
+        }
+    }
+    return inBracket ? Error::Syntax : Error::None;
+}
+
+/** Encodes an instruction from its operand values: registers as numbers (xzr and sp are 31),
+ *  immediates as given, and branch and literal targets as byte offsets.  asm and asm-tokenizer
+ *  encode through this too, so the three assemblers cannot disagree on an encoding.
+ *
+ * @param[out] word The instruction word
+ * @param[out] rejected On error, the index in values of the operand that does not fit
+ */
+constexpr Error encodeFields(const InstructionInfo &info, const int64_t (&values)[3], uint32_t &word, size_t &rejected)
+{
+    uint32_t enc = 0;
+    switch (info.kind)
+    {
+    case Kind::Arith:
+        enc = enc_r3_arith(info.base, values[0], values[1], values[2]);
+        break;
+    case Kind::Compare:
+        enc = enc_r3_arith(info.base, 31, values[0], values[1]);
+        break;
+    case Kind::BranchReg:
+        enc = info.base + static_cast<uint32_t>(values[0]) * 32u;
+        break;
+    case Kind::Memory:
+        if (values[2] < -256 || values[2] > 255)
+        {
+            rejected = 2;
+            return Error::ImmediateRange;
+        }
+        enc = info.base + imm_mod_two(values[2], 512u) * 4096u + static_cast<uint32_t>(values[1]) * 32u +
+              static_cast<uint32_t>(values[0]);
+        break;
+    case Kind::Literal:
+    case Kind::CondBranch:
+    {
+        rejected = info.kind == Kind::Literal ? 1 : 0;
+        int64_t imm = values[rejected];
+        if ((imm % 4) != 0)
+        {
+            return Error::ImmediateAlignment;
+        }
+        if (imm / 4 < -262144 || imm / 4 > 262143)
+        {
+            return Error::ImmediateRange;
+        }
+        enc = info.base + imm_mod_two(imm / 4, 524288u) * 32u;
+        if (info.kind == Kind::Literal)
+        {
+            enc += static_cast<uint32_t>(values[0]);
+        }
+        break;
+    }
+    case Kind::MoveWide:
+        rejected = values[1] < 0 || values[1] > 65535 ? 1 : 2;
+        if (rejected == 1 || (values[2] != 0 && values[2] != 16 && values[2] != 32 && values[2] != 48))
+        {
+            return Error::ImmediateRange;
+        }
+        enc = info.base + static_cast<uint32_t>(values[2] / 16) * 2097152u // 2^21
+              + static_cast<uint32_t>(values[1]) * 32u + static_cast<uint32_t>(values[0]);
+        break;
+    case Kind::Branch:
+        rejected = 0;
+        if ((values[0] % 4) != 0)
+        {
+            return Error::ImmediateAlignment;
+        }
+        if (values[0] / 4 < -33554432 || values[0] / 4 > 33554431)
+        {
+            return Error::ImmediateRange;
+        }
+        enc = info.base + imm_mod_two(values[0] / 4, 67108864u);
+        break;
+    }
+    word = enc;
+    return Error::None;
+}
+
+/** Encodes one instruction line (label and directive lines are handled by the caller).
+ *
+ * @param[out] word The instruction word
+ * @param line The stripped line
+ * @param current The address of the instruction
+ * @param resolve Called as resolve(name, address); sets address and returns true if the label is defined
+ */
+template <typename Resolve>
+constexpr Error encodeInstruction(uint32_t &word, std::string_view line, int64_t current, Resolve resolve)
+{
+    size_t nameEnd = 0;
+    while (nameEnd < line.size() && !isSpace(line[nameEnd]))
+    {
+        nameEnd++;
+    }
+    InstructionInfo info;
+    if (!lookupInstruction(line.substr(0, nameEnd), info))
+    {
+        return Error::UnknownInstruction;
+    }
+
+    Operand operands[4];
+    size_t count = 0;
+    Error error = splitOperands(line.substr(nameEnd), operands, count);
+    if (error != Error::None)
+    {
+        return error;
+    }
+
+    const char *pattern = operandPattern(info.kind);
+    int64_t values[3] = {0, 0, 0};
+    size_t index = 0;
+    for (; pattern[index] != '\0'; index++)
+    {
+        if (index >= count)
+        {
+            if (info.kind == Kind::Memory && index == 2)
+            {
+                break; // [rn] is [rn, 0]
+            }
+            return Error::MissingOperand;
+        }
+        const Operand &operand = operands[index];
+        if (operand.bracketed != (info.kind == Kind::Memory && index > 0))
+        {
+            return Error::Syntax;
+        }
+        char c = pattern[index];
+        int reg = 0;
+        bool isZero = false;
+        bool isSp = false;
+        bool isReg = parseRegister(operand.text, reg, isZero, isSp);
+        if (c == 'r' || c == 'z')
+        {
+            if (!isReg || (reg > 30 && !isZero && !isSp) || (isZero && c != 'z') || (isSp && c != 'r'))
+            {
+                return Error::BadRegister;
+            }
+            values[index] = reg;
+        }
+        else if (isReg)
+        {
+            return Error::BadImmediate;
+        }
+        else if (c == 'l' && isIdentifier(operand.text))
+        {
+            int64_t address = 0;
+            if (!resolve(operand.text, address))
+            {
+                return Error::UndefinedLabel;
+            }
+            values[index] = address - current;
+        }
+        else
+        {
+            error = parseImmediate(operand.text, values[index]);
+            if (error != Error::None)
+            {
+                return error;
+            }
+        }
+    }
+    if (info.kind == Kind::MoveWide && count == 3)
+    {
+        std::string_view shift = operands[2].text;
+        if (operands[2].bracketed || shift.size() < 4 || shift.substr(0, 3) != "lsl" || !isSpace(shift[3]))
+        {
+            return Error::Syntax;
+        }
+        error = parseImmediate(stripLine(shift.substr(3)), values[2]);
+        if (error != Error::None)
+        {
+            return error;
+        }
+    }
+    else if (count > index)
+    {
+        return Error::ExtraOperand;
+    }
+
+    size_t rejected = 0;
+    return encodeFields(info, values, word, rejected);
+}
+
+/** Calls fn(line, lineNumber) for each line of src, stopping early if fn returns false. */
+template <typename Fn>
+constexpr void forEachLine(std::string_view src, Fn fn)
+{
+    size_t lineNumber = 0;
+    while (!src.empty())
+    {
+        size_t end = src.find('\n');
+        std::string_view line = src.substr(0, end);
+        src.remove_prefix(end == std::string_view::npos ? src.size() : end + 1);
+        if (!fn(stripLine(line), ++lineNumber))
+        {
+            return;
+        }
+    }
+}
+
+constexpr bool isEightByte(std::string_view line)
+{
+    return line.size() > 6 && line.substr(0, 6) == ".8byte" && isSpace(line[6]);
+}
+
+/** First pass: assigns an address to every label, calling define(name, address), which returns
+ *  false for a duplicate.  On success, Result::words is the size of the program in words. */
+template <typename Define>
+constexpr Result layout(std::string_view src, Define define)
+{
+    Result result;
+    int64_t current = 0;
+    forEachLine(src, [&](std::string_view line, size_t lineNumber)
+    {
+        std::string_view name;
+        Error error = Error::None;
+        if (line.empty())
+        {
+            return true;
+        }
+        if (splitLabel(line, name, error))
+        {
+            if (error == Error::None && !define(name, current))
+            {
+                error = Error::DuplicateLabel;
+            }
+        }
+        else if (line[0] == '.')
+        {
+            if (isEightByte(line))
+                current += 8;
+            else
+                error = Error::UnknownDirective;
+        }
+        else
+        {
+            current += 4;
+        }
+        if (error != Error::None)
+        {
+            result = {error, 0, lineNumber};
+            return false;
+        }
+        return true;
+    });
+    if (result)
+    {
+        result.words = static_cast<size_t>(current / 4);
+    }
+    return result;
+}
+
+/** Second pass: encodes src into out, which must hold the number of words layout returned.
+ *  Labels are looked up with resolve(name, address) as in encodeInstruction. */
+template <typename Resolve>
+constexpr Result encode(std::string_view src, uint32_t *out, Resolve resolve)
+{
+    Result result;
+    int64_t current = 0;
+    forEachLine(src, [&](std::string_view line, size_t lineNumber)
+    {
+        std::string_view name;
+        Error error = Error::None;
+        if (line.empty() || splitLabel(line, name, error))
+        {
+            return true;
+        }
+        if (line[0] == '.')
+        {
+            std::string_view operand = stripLine(line.substr(6));
+            int64_t value = 0;
+            if (isIdentifier(operand))
+            {
+                if (!resolve(operand, value))
+                    error = Error::UndefinedLabel;
+            }
+            else
+            {
+                error = parseImmediate(operand, value);
+            }
+            if (error == Error::None)
+            {
+                out[current / 4] = static_cast<uint32_t>(value);
+                out[current / 4 + 1] = static_cast<uint32_t>(static_cast<uint64_t>(value) >> 32);
+                current += 8;
+            }
+        }
+        else
+        {
+            error = encodeInstruction(out[current / 4], line, current, resolve);
+            current += 4;
+        }
+        if (error != Error::None)
+        {
+            result = {error, 0, lineNumber};
+            return false;
+        }
+        return true;
+    });
+    if (result)
+    {
+        result.words = static_cast<size_t>(current / 4);
+    }
+    return result;
+}
+
+/** Finds a label by scanning the source.  Quadratic, but allocation-free, which is what compile
+ *  time assembly of short stubs needs.
+ *
+ * @return The number of definitions of the label (the address is that of the first)
+ */
+constexpr size_t findLabel(std::string_view src, std::string_view wanted, int64_t &address)
+{
+    size_t count = 0;
+    layout(src, [&](std::string_view name, int64_t current)
+    {
+        if (name == wanted && count++ == 0)
+        {
+            address = current;
+        }
+        return true;
+    });
+    return count;
+}
+
+// Not constexpr: reaching one of these while assembling at compile time is a compile error that
+// names the problem.
+void error_syntax();
+void error_unknown_instruction();
+void error_unknown_directive();
+void error_bad_register();
+void error_bad_immediate();
+void error_missing_operand();
+void error_extra_operand();
+void error_immediate_out_of_range();
+void error_immediate_not_multiple_of_4();
+void error_label_not_alone_on_line();
+void error_duplicate_label();
+void error_undefined_label();
+
+constexpr void compileTimeError(Error error)
+{
+    switch (error)
+    {
+    case Error::None:
+    case Error::OutputTooSmall:
+        break;
+    case Error::Syntax:
+        error_syntax();
+        break;
+    case Error::UnknownInstruction:
+        error_unknown_instruction();
+        break;
+    case Error::UnknownDirective:
+        error_unknown_directive();
+        break;
+    case Error::BadRegister:
+        error_bad_register();
+        break;
+    case Error::BadImmediate:
+        error_bad_immediate();
+        break;
+    case Error::MissingOperand:
+        error_missing_operand();
+        break;
+    case Error::ExtraOperand:
+        error_extra_operand();
+        break;
+    case Error::ImmediateRange:
+        error_immediate_out_of_range();
+        break;
+    case Error::ImmediateAlignment:
+        error_immediate_not_multiple_of_4();
+        break;
+    case Error::LabelSyntax:
+        error_label_not_alone_on_line();
+        break;
+    case Error::DuplicateLabel:
+        error_duplicate_label();
+        break;
+    case Error::UndefinedLabel:
+        error_undefined_label();
+        break;
+    }
+}
+
+/** A string literal usable as a template argument */
+template <size_t N>
+struct FixedString
+{
+    char data[N] = {};
+
+    constexpr FixedString(const char (&s)[N])
+    {
+        for (size_t i = 0; i < N; i++)
+        {
+            data[i] = s[i];
+        }
+    }
+
+    constexpr std::string_view view() const { return std::string_view(data, N - 1); }
+};
+
+template <FixedString Source>
+constexpr size_t programWords()
+{
+    constexpr std::string_view src = Source.view();
+    Result result = layout(src, [&](std::string_view name, int64_t)
+    {
+        int64_t address = 0;
+        return findLabel(src, name, address) == 1;
+    });
+    compileTimeError(result.error);
+    return result.words;
+}
+
+} // namespace detail
+
+/** Assembles a program at compile time:
+ *
+ *      constexpr auto stub = arm64::assemble<"loop:\n sub x0, x0, x1\n cmp x0, xzr\n b.ne loop">();
+ *      // stub is a std::array<uint32_t, 3>
+ *
+ *  Accepts exactly what the runtime arm64::assemble accepts; any error it would report (an ldur
+ *  offset outside -256..255, an undefined label, ...) is a compile error instead.
+ */
+template <detail::FixedString Source>
+consteval std::array<uint32_t, detail::programWords<Source>()> assemble()
+{
+    constexpr std::string_view src = Source.view();
+    std::array<uint32_t, detail::programWords<Source>()> code = {};
+    Result result = detail::encode(src, code.data(), [&](std::string_view name, int64_t &address)
+    {
+        return detail::findLabel(src, name, address) > 0;
+    });
+    detail::compileTimeError(result.error);
+    return code;
+}
+
+} // namespace arm64
+
+#endif
@@ -0,0 +1,319 @@
+#ifndef ASM_INPUT_H
+#define ASM_INPUT_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__SSE2__)
+#include <immintrin.h>
+#define ASM_INPUT_SIMD 1
+#endif
+
+/** Line and word input shared by asm and dfa.  A regular file is mapped and read in place; anything
+ *  else (standard in, a pipe) is read in large blocks into one reused buffer.  Lines and words are
+ *  handed out as string_views into that memory, so nothing is copied per line.
+ *
+ *  The scans for newlines, comment markers and whitespace compare 32 bytes at a time with AVX2 when
+ *  the CPU has it, else 16 at a time with SSE2 (every x86-64 has it), and a byte at a time elsewhere
+ *  and for the last few bytes.  Whitespace is what isspace() accepts in the C locale, as for
+ *  `operator>>` and regex `\s`.
+ */
+namespace input
+{
+
+inline bool isSpace(char c)
+{
+    return c == ' ' || static_cast<unsigned char>(c - '\t') <= '\r' - '\t';
+}
+
+// What a scan looks for.  Each matcher gives a bitmask of the matching bytes of a 16-byte (and,
+// compiled for AVX2, a 32-byte) block, and matches single bytes for the tail.
+struct Byte
+{
+    char c;
+    bool match(char b) const { return b == c; }
+#ifdef ASM_INPUT_SIMD
+    unsigned mask(__m128i v) const { return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c))); }
+    __attribute__((target("avx2"))) unsigned mask(__m256i v) const
+    {
+        return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)));
+    }
+#endif
+};
+
+// Whitespace, or with `invert`, anything else.  '\t' to '\r' are found as the bytes whose distance
+// above '\t' is at most 4: min(c - '\t', 4) == c - '\t', unsigned.
+template <bool invert>
+struct Space
+{
+    bool match(char c) const { return isSpace(c) != invert; }
+#ifdef ASM_INPUT_SIMD
+    unsigned mask(__m128i v) const
+    {
+        __m128i control = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+        __m128i space = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                     _mm_cmpeq_epi8(_mm_min_epu8(control, _mm_set1_epi8('\r' - '\t')), control));
+        unsigned bits = _mm_movemask_epi8(space);
+        return invert ? ~bits & 0xFFFFu : bits;
+    }
+    __attribute__((target("avx2"))) unsigned mask(__m256i v) const
+    {
+        __m256i control = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+        __m256i space =
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                            _mm256_cmpeq_epi8(_mm256_min_epu8(control, _mm256_set1_epi8('\r' - '\t')), control));
+        unsigned bits = _mm256_movemask_epi8(space);
+        return invert ? ~bits : bits;
+    }
+#endif
+};
+
+/** The offset of the first byte of [data, data + size) that `matcher` matches, or size */
+template <typename Matcher>
+size_t findSse2(const char *data, size_t size, Matcher matcher)
+{
+    size_t i = 0;
+#ifdef ASM_INPUT_SIMD
+    for (; i + 16 <= size; i += 16)
+    {
+        unsigned bits = matcher.mask(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i)));
+        if (bits != 0)
+        {
+            return i + __builtin_ctz(bits);
+        }
+    }
+#endif
+    for (; i < size && !matcher.match(data[i]); i++)
+    {
+    }
+    return i;
+}
+
+#ifdef ASM_INPUT_SIMD
+template <typename Matcher>
+__attribute__((target("avx2"))) size_t findAvx2(const char *data, size_t size, Matcher matcher)
+{
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        unsigned bits = matcher.mask(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i)));
+        if (bits != 0)
+        {
+            return i + __builtin_ctz(bits);
+        }
+    }
+    return i + findSse2(data + i, size - i, matcher);
+}
+
+inline const bool HAS_AVX2 = []
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+}();
+#endif
+
+template <typename Matcher>
+size_t find(const char *data, size_t size, Matcher matcher)
+{
+#ifdef ASM_INPUT_SIMD
+    if (HAS_AVX2)
+    {
+        return findAvx2(data, size, matcher);
+    }
+#endif
+    return findSse2(data, size, matcher);
+}
+
+/** The offset of the first `c` in text, or text.size() */
+inline size_t findByte(std::string_view text, char c)
+{
+    return find(text.data(), text.size(), Byte{c});
+}
+
+/** The offset of the first byte of text that is not whitespace, or text.size() */
+inline size_t skipSpace(std::string_view text)
+{
+    return find(text.data(), text.size(), Space<true>{});
+}
+
+/** Reads lines and words from a file, standard in, or memory */
+class Reader
+{
+public:
+    /** Reads the file at `path`, or standard in if it is "-".  Check ok() for whether it opened. */
+    explicit Reader(const std::string &path)
+    {
+        fd = path == "-" ? STDIN_FILENO : open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0)
+        {
+            opened = false;
+            return;
+        }
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        {
+            void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED)
+            {
+                madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+                mapping = static_cast<const char *>(mapped);
+                data = mapping;
+                size = st.st_size;
+                end = true;
+            }
+        }
+        if (mapping == nullptr)
+        {
+            buffer.resize(BLOCK);
+            data = buffer.data();
+        }
+    }
+
+    /** Reads `length` bytes of memory, which must outlive the reader */
+    Reader(const char *text, size_t length) : data(text), size(length), end(true) {}
+
+    ~Reader()
+    {
+        if (mapping != nullptr)
+        {
+            munmap(const_cast<char *>(mapping), size);
+        }
+        if (fd > STDIN_FILENO)
+        {
+            close(fd);
+        }
+    }
+
+    Reader(const Reader &) = delete;
+    Reader &operator=(const Reader &) = delete;
+
+    bool ok() const { return opened; }
+
+    /** Whether the views handed out stay valid for the reader's lifetime (memory and mapped files),
+     *  rather than until the next read */
+    bool stable() const { return buffer.empty(); }
+
+    /** Bytes consumed so far */
+    uint64_t bytes() const { return consumed + pos; }
+
+    /** The rest of the current line, without its '\n', as std::getline would give it
+     *
+     * @return false at the end of the input
+     */
+    bool nextLine(std::string_view &line)
+    {
+        if (atEnd())
+        {
+            return false;
+        }
+        size_t length = scan(Byte{'\n'});
+        line = std::string_view(data + pos, length);
+        pos += std::min(length + 1, size - pos);
+        return true;
+    }
+
+    /** The next whitespace-separated word, as `operator>>` would give it, leaving the whitespace
+     *  after it unread
+     *
+     * @return false if only whitespace is left
+     */
+    bool nextWord(std::string_view &word)
+    {
+        for (;;)
+        {
+            if (atEnd())
+            {
+                return false;
+            }
+            pos += scan(Space<true>{});
+            if (pos < size)
+            {
+                break;
+            }
+        }
+        size_t length = scan(Space<false>{});
+        word = std::string_view(data + pos, length);
+        pos += length;
+        return true;
+    }
+
+private:
+    static constexpr size_t BLOCK = 1 << 20;
+
+    bool atEnd()
+    {
+        return pos == size && (end || !fill());
+    }
+
+    /** The length from pos to the first byte `matcher` matches, or to the end of the input, reading
+     *  more as needed.  Reading may move the unread bytes, and so pos, but keeps them contiguous. */
+    template <typename Matcher>
+    size_t scan(Matcher matcher)
+    {
+        size_t scanned = 0;
+        for (;;)
+        {
+            scanned += find(data + pos + scanned, size - pos - scanned, matcher);
+            if (pos + scanned < size || end || !fill())
+            {
+                return scanned;
+            }
+        }
+    }
+
+    /** Moves the unread bytes to the front of the buffer, growing it if they fill it, and reads more
+     *  after them.  Returns false at the end of the input. */
+    bool fill()
+    {
+        if (end)
+        {
+            return false;
+        }
+        consumed += pos;
+        memmove(buffer.data(), buffer.data() + pos, size - pos);
+        size -= pos;
+        pos = 0;
+        if (size == buffer.size())
+        {
+            buffer.resize(buffer.size() * 2);
+        }
+        data = buffer.data();
+        ssize_t n;
+        do
+        {
+            n = read(fd, buffer.data() + size, buffer.size() - size);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0)
+        {
+            end = true;
+            return false;
+        }
+        size += n;
+        return true;
+    }
+
+    int fd = -1;
+    const char *mapping = nullptr;
+    std::vector<char> buffer;
+    const char *data = nullptr;
+    size_t size = 0;
+    size_t pos = 0;
+    uint64_t consumed = 0; // Bytes dropped from the front of the buffer
+    bool end = false;      // Whether data + size is the end of the input
+    bool opened = true;
+};
+
+} // namespace input
+
+#endif
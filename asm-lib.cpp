@@ -0,0 +1,166 @@
+#include "asm-lib.h"
+
+namespace arm64
+{
+
+const char *errorMessage(Error error)
+{
+    switch (error)
+    {
+    case Error::None:
+        return "no error";
+    case Error::Syntax:
+        return "unable to parse line";
+    case Error::UnknownInstruction:
+        return "unknown instruction";
+    case Error::UnknownDirective:
+        return "unknown directive";
+    case Error::BadRegister:
+        return "invalid register";
+    case Error::BadImmediate:
+        return "invalid immediate";
+    case Error::MissingOperand:
+        return "missing operand";
+    case Error::ExtraOperand:
+        return "extraneous operand";
+    case Error::ImmediateRange:
+        return "immediate out of range";
+    case Error::ImmediateAlignment:
+        return "immediate must be a multiple of 4 bytes";
+    case Error::LabelSyntax:
+        return "label must be alone on its line";
+    case Error::DuplicateLabel:
+        return "duplicate label";
+    case Error::UndefinedLabel:
+        return "undefined label";
+    case Error::OutputTooSmall:
+        return "output buffer too small";
+    }
+    return "unknown error";
+}
+
+static uint64_t hashName(std::string_view name)
+{
+    uint64_t hash = 14695981039346656037ull; // FNV-1a
+    for (char c : name)
+    {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+void Context::reserve(size_t labels)
+{
+    // The symbols of the last call point into its source, which may be gone; their slots are stale
+    // by generation anyway, so drop them rather than rehash them
+    symbols.clear();
+    symbols.reserve(labels);
+    size_t slotCount = 16;
+    while (slotCount < 2 * labels)
+    {
+        slotCount *= 2;
+    }
+    if (slotCount > slots.size())
+    {
+        rehash(slotCount);
+    }
+}
+
+void Context::rehash(size_t slotCount)
+{
+    slots.assign(slotCount, Slot{0, 0});
+    for (uint32_t i = 0; i < symbols.size(); i++)
+    {
+        size_t mask = slots.size() - 1;
+        size_t slot = hashName(symbols[i].name) & mask;
+        while (slots[slot].generation == generation)
+        {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = {i, generation};
+    }
+}
+
+const Context::Symbol *Context::find(std::string_view name) const
+{
+    if (slots.empty())
+    {
+        return nullptr;
+    }
+    size_t mask = slots.size() - 1;
+    for (size_t slot = hashName(name) & mask; slots[slot].generation == generation; slot = (slot + 1) & mask)
+    {
+        const Symbol &symbol = symbols[slots[slot].symbol];
+        if (symbol.name == name)
+        {
+            return &symbol;
+        }
+    }
+    return nullptr;
+}
+
+bool Context::define(std::string_view name, int64_t address)
+{
+    if (find(name) != nullptr)
+    {
+        return false;
+    }
+    if (2 * (symbols.size() + 1) > slots.size())
+    {
+        symbols.push_back({name, address});
+        rehash(slots.empty() ? 16 : 2 * slots.size());
+        return true;
+    }
+    size_t mask = slots.size() - 1;
+    size_t slot = hashName(name) & mask;
+    while (slots[slot].generation == generation)
+    {
+        slot = (slot + 1) & mask;
+    }
+    slots[slot] = {static_cast<uint32_t>(symbols.size()), generation};
+    symbols.push_back({name, address});
+    return true;
+}
+
+Result assemble(std::string_view src, std::span<uint32_t> out, Context &context)
+{
+    context.symbols.clear();
+    if (++context.generation == 0)
+    {
+        // Generation counter wrapped: old slots could look live again
+        context.slots.assign(context.slots.size(), Context::Slot{0, 0});
+        context.generation = 1;
+    }
+
+    Result result = detail::layout(src, [&](std::string_view name, int64_t address)
+    {
+        return context.define(name, address);
+    });
+    if (!result)
+    {
+        return result;
+    }
+    if (result.words > out.size())
+    {
+        return {Error::OutputTooSmall, result.words, 0};
+    }
+
+    return detail::encode(src, out.data(), [&](std::string_view name, int64_t &address)
+    {
+        const Context::Symbol *symbol = context.find(name);
+        if (symbol == nullptr)
+        {
+            return false;
+        }
+        address = symbol->address;
+        return true;
+    });
+}
+
+Result assemble(std::string_view src, std::span<uint32_t> out)
+{
+    static thread_local Context context;
+    return assemble(src, out, context);
+}
+
+} // namespace arm64
@@ -0,0 +1,75 @@
+#ifndef ASM_LIB_H
+#define ASM_LIB_H
+
+#include "asm-encode.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <vector>
+
+/** Embeddable ARM64 assembler.  Accepts the same instructions as `asm` plus the labels, `b.cond`
+ *  branches and `.8byte` directives understood by `asm-tokenizer`, directly from source text:
+ *
+ *      loop:
+ *          sub x0, x0, x1      // comments with `//` or `;`
+ *          cmp x0, xzr
+ *          b.ne loop
+ *          .8byte loop
+ *
+ *  Instructions are written to the caller's buffer as native 32-bit words; `.8byte` occupies two
+ *  words, low half first.  On a little-endian host the buffer is byte-for-byte what the command line
+ *  tools print.
+ */
+namespace arm64
+{
+
+/** Returns a short human readable description of an error code. */
+const char *errorMessage(Error error);
+
+/** Scratch state reused across calls to assemble.  Once a context has seen a program with as many
+ *  labels as the current one, assembling allocates nothing.  A context must not be shared between
+ *  threads that assemble concurrently.
+ */
+class Context
+{
+public:
+    /** Pre-sizes the symbol table so that programs with up to `labels` labels never allocate. */
+    void reserve(size_t labels);
+
+private:
+    struct Symbol
+    {
+        std::string_view name; // Points into the source of the current call
+        int64_t address;
+    };
+
+    struct Slot
+    {
+        uint32_t symbol;
+        uint32_t generation; // Slots from earlier calls are treated as empty
+    };
+
+    const Symbol *find(std::string_view name) const;
+    bool define(std::string_view name, int64_t address);
+    void rehash(size_t slotCount);
+
+    std::vector<Symbol> symbols;
+    std::vector<Slot> slots;
+    uint32_t generation = 0;
+
+    friend Result assemble(std::string_view src, std::span<uint32_t> out, Context &context);
+};
+
+/** Assembles `src` into `out`.  Nothing is written past out.size(), and on error the contents of
+ *  `out` are unspecified.  `src` is only read during the call.
+ */
+Result assemble(std::string_view src, std::span<uint32_t> out, Context &context);
+
+/** As above, using a context private to the calling thread. */
+Result assemble(std::string_view src, std::span<uint32_t> out);
+
+} // namespace arm64
+
+#endif
@@ -0,0 +1,179 @@
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "asm-object.h"
+#include "asm-symbols.h"
+
+/** Links object files written by `asm-tokenizer --object` into one program.  Objects are laid out
+ *  in the order given, each at the next multiple of its alignment (zero-filled), every relocation
+ *  is patched with the final address of its label, and the machine code is written to stdout.  The
+ *  label listing on stderr is the one the assembler prints, with final addresses, so linking the
+ *  objects of several files gives the same output as assembling the files concatenated (when each
+ *  file's size is a multiple of 4).
+ */
+
+void formatError(const std::string &message)
+{
+    throw std::runtime_error(message);
+}
+
+/** Condition names by their encoding, for error messages about b.cond */
+const char *const CONDITIONS[16] = {"eq", "ne", "hs", "lo", "mi", "pl", "vs", "vc",
+                                    "hi", "ls", "ge", "lt", "gt", "le", "al", "nv"};
+
+/** Patches the branch word at `code` to jump `offset` bytes, in the imm26 (b) or imm19 (b.cond)
+ *  field.  Errors match the assembler's for a branch it encodes itself.
+ */
+void patchBranch(char *code, object::RelocationKind kind, int64_t offset)
+{
+    uint32_t word;
+    memcpy(&word, code, sizeof(word));
+    bool conditional = kind == object::BRANCH19;
+    std::string name = conditional ? std::string("b.") + CONDITIONS[word & 0xF] : "b";
+    int64_t limit = conditional ? int64_t(1) << 18 : int64_t(1) << 25;
+    if (offset % 4 != 0)
+    {
+        formatError(name + " immediate must be a multiple of 4 bytes: " + std::to_string(offset));
+    }
+    if (offset / 4 < -limit || offset / 4 >= limit)
+    {
+        formatError(name + " immediate out of range : " + std::to_string(offset));
+    }
+    uint32_t imm = static_cast<uint32_t>(offset / 4);
+    if (conditional)
+    {
+        word = (word & 0xFF00001Fu) | ((imm & 0x7FFFFu) << 5);
+    }
+    else
+    {
+        word = (word & 0xFC000000u) | (imm & 0x3FFFFFFu);
+    }
+    memcpy(code, &word, sizeof(word));
+}
+
+void _main(int argc, char *argv[])
+{
+    std::vector<std::string> paths;
+    std::string symbolMapPath;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--symbol-map" && i + 1 < argc)
+        {
+            symbolMapPath = argv[++i];
+        }
+        else
+        {
+            paths.push_back(arg);
+        }
+    }
+    if (paths.empty())
+    {
+        std::cerr << "Usage:" << std::endl
+                  << "\tasm-link [--symbol-map MAP] OBJECT... > PROGRAM" << std::endl
+                  << std::endl
+                  << "Link objects written by `asm-tokenizer --object` into machine code on standard "
+                  << "out, listing every label and its address on standard error." << std::endl
+                  << "With --symbol-map, also write the labels sorted by address to MAP, for "
+                  << "asm-symbolize." << std::endl;
+        exit(1);
+    }
+
+    // Lay out the objects and collect their labels
+    std::vector<object::Object> objects(paths.size());
+    std::vector<uint64_t> bases(paths.size());
+    std::unordered_map<std::string, uint64_t> addresses;
+    std::unordered_map<std::string, size_t> definedIn;
+    uint64_t size = 0;
+    for (size_t k = 0; k < paths.size(); k++)
+    {
+        std::ifstream in(paths[k], std::ios::binary);
+        if (!in)
+        {
+            formatError("File '" + paths[k] + "' not found!");
+        }
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        object::read(data.data(), data.size(), paths[k], objects[k]);
+
+        uint64_t alignment = objects[k].alignment;
+        bases[k] = (size + alignment - 1) / alignment * alignment;
+        size = bases[k] + objects[k].code.size();
+        for (const object::Symbol &symbol : objects[k].symbols)
+        {
+            auto [entry, inserted] = definedIn.try_emplace(symbol.name, k);
+            if (!inserted)
+            {
+                formatError("Duplicate label: " + symbol.name + " (in '" + paths[entry->second] + "' and '" +
+                            paths[k] + "')");
+            }
+            addresses[symbol.name] = bases[k] + symbol.offset;
+        }
+    }
+
+    // Patch every reference now that each label has its final address
+    for (size_t k = 0; k < objects.size(); k++)
+    {
+        for (const object::Relocation &relocation : objects[k].relocations)
+        {
+            auto target = addresses.find(relocation.name);
+            if (target == addresses.end())
+            {
+                formatError("Undefined label: " + relocation.name + " (in '" + paths[k] + "')");
+            }
+            char *code = objects[k].code.data() + relocation.offset;
+            if (relocation.kind == object::ABSOLUTE64)
+            {
+                uint64_t address = target->second;
+                memcpy(code, &address, sizeof(address));
+            }
+            else
+            {
+                int64_t from = bases[k] + relocation.offset;
+                patchBranch(code, relocation.kind, int64_t(target->second) - from);
+            }
+        }
+    }
+
+    std::string listing;
+    std::vector<std::pair<std::string_view, uint64_t>> labels;
+    uint64_t written = 0;
+    for (size_t k = 0; k < objects.size(); k++)
+    {
+        for (const object::Symbol &symbol : objects[k].symbols)
+        {
+            listing += symbol.name + ' ' + std::to_string(bases[k] + symbol.offset) + '\n';
+            labels.emplace_back(symbol.name, bases[k] + symbol.offset);
+        }
+        std::string padding(bases[k] - written, '\0');
+        std::cout.write(padding.data(), padding.size());
+        std::cout.write(objects[k].code.data(), objects[k].code.size());
+        written = bases[k] + objects[k].code.size();
+    }
+    std::cerr.write(listing.data(), listing.size());
+    if (!symbolMapPath.empty())
+    {
+        symbolmap::write(symbolMapPath, std::move(labels), size);
+    }
+    std::cout.flush();
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        _main(argc, argv);
+        return 0;
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,210 @@
+#ifndef ASM_OBJECT_H
+#define ASM_OBJECT_H
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/** Object files, written by `asm-tokenizer --object` and linked by `asm-link`.  An object is one
+ *  source file's machine code placed at address 0, the labels it defines and the references it
+ *  leaves for the linker:
+ *
+ *      "AOBJECT1"          magic
+ *      u64 codeBytes
+ *      u32 alignment       the object must be placed at a multiple of this (4, or more for .align)
+ *      u32 symbolCount
+ *      u32 relocationCount
+ *      u64 stringBytes     size of the string table
+ *      string table        [u32 length][bytes] per name; a name's id is its offset in the table
+ *      symbols             [u32 name][u64 offset] per label, in definition order
+ *      relocations         [u32 name][u8 kind][u64 offset] per reference, by offset
+ *      code                codeBytes bytes
+ *
+ *  Branches to labels defined in the same file are resolved by the assembler, since they do not
+ *  move relative to each other.  Branches to other files, and every `.8byte label` (an absolute
+ *  address), are relocations.  Integers are little-endian.
+ */
+namespace object
+{
+
+const char MAGIC[8] = {'A', 'O', 'B', 'J', 'E', 'C', 'T', '1'};
+
+/** How a relocation is patched, given the offset from its word to the label */
+enum RelocationKind : uint8_t
+{
+    BRANCH26, // b: imm26, the offset / 4
+    BRANCH19, // b.cond: imm19 in bits 5-23, the offset / 4
+    ABSOLUTE64 // .8byte: the label's address, 8 bytes
+};
+
+struct Symbol
+{
+    std::string name;
+    uint64_t offset;
+};
+
+struct Relocation
+{
+    std::string name;
+    RelocationKind kind;
+    uint64_t offset;
+};
+
+struct Object
+{
+    std::string code;
+    uint32_t alignment = 4;
+    std::vector<Symbol> symbols;
+    std::vector<Relocation> relocations;
+};
+
+/** Writes an object, storing each name once */
+inline void write(const Object &object, std::ostream &out)
+{
+    std::string strings;
+    std::unordered_map<std::string, uint32_t> ids;
+    auto append = [](std::string &to, const void *value, size_t bytes)
+    {
+        to.append(static_cast<const char *>(value), bytes);
+    };
+    auto intern = [&](const std::string &name)
+    {
+        auto [entry, inserted] = ids.try_emplace(name, static_cast<uint32_t>(strings.size()));
+        if (inserted)
+        {
+            uint32_t length = name.size();
+            append(strings, &length, sizeof(length));
+            strings += name;
+        }
+        return entry->second;
+    };
+
+    std::string tables;
+    for (const Symbol &symbol : object.symbols)
+    {
+        uint32_t name = intern(symbol.name);
+        append(tables, &name, sizeof(name));
+        append(tables, &symbol.offset, sizeof(symbol.offset));
+    }
+    for (const Relocation &relocation : object.relocations)
+    {
+        uint32_t name = intern(relocation.name);
+        append(tables, &name, sizeof(name));
+        tables += static_cast<char>(relocation.kind);
+        append(tables, &relocation.offset, sizeof(relocation.offset));
+    }
+
+    std::string header(MAGIC, sizeof(MAGIC));
+    uint64_t codeBytes = object.code.size();
+    uint32_t symbolCount = object.symbols.size();
+    uint32_t relocationCount = object.relocations.size();
+    uint64_t stringBytes = strings.size();
+    append(header, &codeBytes, sizeof(codeBytes));
+    append(header, &object.alignment, sizeof(object.alignment));
+    append(header, &symbolCount, sizeof(symbolCount));
+    append(header, &relocationCount, sizeof(relocationCount));
+    append(header, &stringBytes, sizeof(stringBytes));
+    out.write(header.data(), header.size());
+    out.write(strings.data(), strings.size());
+    out.write(tables.data(), tables.size());
+    out.write(object.code.data(), object.code.size());
+}
+
+/** Parses an object from data.  Throws std::runtime_error, naming `path`, if it is not a complete
+ *  object. */
+inline void read(const char *data, size_t size, const std::string &path, Object &object)
+{
+    size_t pos = 0;
+    auto take = [&](void *value, size_t bytes)
+    {
+        if (size - pos < bytes)
+        {
+            throw std::runtime_error("Truncated object file '" + path + "'");
+        }
+        memcpy(value, data + pos, bytes);
+        pos += bytes;
+    };
+
+    if (size < sizeof(MAGIC) || memcmp(data, MAGIC, sizeof(MAGIC)) != 0)
+    {
+        throw std::runtime_error("'" + path + "' is not an object file");
+    }
+    pos = sizeof(MAGIC);
+    uint64_t codeBytes = 0;
+    uint32_t symbolCount = 0;
+    uint32_t relocationCount = 0;
+    uint64_t stringBytes = 0;
+    take(&codeBytes, sizeof(codeBytes));
+    take(&object.alignment, sizeof(object.alignment));
+    take(&symbolCount, sizeof(symbolCount));
+    take(&relocationCount, sizeof(relocationCount));
+    take(&stringBytes, sizeof(stringBytes));
+    if (object.alignment == 0 || (object.alignment & (object.alignment - 1)) != 0)
+    {
+        throw std::runtime_error("Invalid alignment in object file '" + path + "'");
+    }
+
+    if (size - pos < stringBytes)
+    {
+        throw std::runtime_error("Truncated object file '" + path + "'");
+    }
+    const char *strings = data + pos;
+    pos += stringBytes;
+    auto name = [&](uint32_t id)
+    {
+        uint32_t length = 0;
+        if (stringBytes < sizeof(length) || id > stringBytes - sizeof(length))
+        {
+            throw std::runtime_error("Invalid name in object file '" + path + "'");
+        }
+        memcpy(&length, strings + id, sizeof(length));
+        if (length > stringBytes - sizeof(length) - id)
+        {
+            throw std::runtime_error("Invalid name in object file '" + path + "'");
+        }
+        return std::string(strings + id + sizeof(length), length);
+    };
+
+    object.symbols.clear();
+    for (uint32_t k = 0; k < symbolCount; k++)
+    {
+        uint32_t id = 0;
+        uint64_t offset = 0;
+        take(&id, sizeof(id));
+        take(&offset, sizeof(offset));
+        if (offset > codeBytes)
+        {
+            throw std::runtime_error("Invalid symbol in object file '" + path + "'");
+        }
+        object.symbols.push_back({name(id), offset});
+    }
+    object.relocations.clear();
+    for (uint32_t k = 0; k < relocationCount; k++)
+    {
+        uint32_t id = 0;
+        uint8_t kind = 0;
+        uint64_t offset = 0;
+        take(&id, sizeof(id));
+        take(&kind, sizeof(kind));
+        take(&offset, sizeof(offset));
+        uint64_t bytes = kind == ABSOLUTE64 ? 8 : 4;
+        if (kind > ABSOLUTE64 || offset > codeBytes || codeBytes - offset < bytes)
+        {
+            throw std::runtime_error("Invalid relocation in object file '" + path + "'");
+        }
+        object.relocations.push_back({name(id), static_cast<RelocationKind>(kind), offset});
+    }
+    if (size - pos != codeBytes)
+    {
+        throw std::runtime_error("Truncated object file '" + path + "'");
+    }
+    object.code.assign(data + pos, codeBytes);
+}
+
+} // namespace object
+
+#endif
@@ -0,0 +1,1474 @@
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "asm-symbols.h"
+#include "stats.h"
+
+/** Runs machine code produced by `asm` or `asm-tokenizer` on the host.  It executes exactly the
+ *  instructions compileLine emits (add, sub, mul, smulh, umulh, sdiv, udiv, cmp, movz, movk, movn,
+ *  ldur, stur, ldr literal, b, b.cond, br and blr) over a flat memory image with the program
+ *  loaded at address 0.
+ *
+ *  Each word of the program is decoded once, up front, into an Op whose operands are ready to use:
+ *  register fields are indexes into the register file (with register 31 already resolved to sp or
+ *  xzr) and branch targets are Op indexes.  Execution then jumps from handler to handler through
+ *  the address stored in each Op (computed goto), with no decode and no central dispatch switch.
+ *
+ *  The block engine (the default) goes further: the first time a basic block is reached, its Ops
+ *  are translated into micro-ops, fusing cmp with the b.cond after it and movz/movn with the movk
+ *  after them.  Blocks are cached by start address and chained to their successors the first
+ *  time each is taken, so a hot loop runs block to block without lookups, and instructions are
+ *  counted a block at a time.  A store into a translated word drops every block covering it.
+ *
+ *  The op engine's run loop is a template on whether to profile, so without --profile or --trace the handlers
+ *  are exactly the unprofiled ones.  A trace is written as:
+ *
+ *      "ASIMTRC1"          magic
+ *      u64 entry           address of the first instruction
+ *      u32 records         for every branch executed (b, b.cond, br, blr), the word index (address
+ *                          / 4) of the next instruction, whether the branch was taken or not
+ *
+ *  Replaying it from the entry, instructions between branches run in sequence, so the records are
+ *  enough to recover the full path.  Integers are little-endian.
+ */
+
+void formatError(const std::string &message)
+{
+    throw std::runtime_error(message);
+}
+
+enum Opcode : uint8_t
+{
+    ADD,
+    SUB,
+    MUL,
+    SMULH,
+    UMULH,
+    SDIV,
+    UDIV,
+    CMP,
+    MOVZ,
+    MOVK,
+    MOVN,
+    LDUR,
+    STUR,
+    LDR,
+    B,
+    BR,
+    BLR,
+    // b.cond, in the order of the condition field
+    B_EQ,
+    B_NE,
+    B_HS,
+    B_LO,
+    B_MI,
+    B_PL,
+    B_VS,
+    B_VC,
+    B_HI,
+    B_LS,
+    B_GE,
+    B_LT,
+    B_GT,
+    B_LE,
+    B_AL,
+    B_NV,
+    BRANCH_OUTSIDE, // b or b.cond to an address outside the program
+    UNDEFINED,      // Not an instruction the assembler emits, e.g. .8byte data
+    HALT,           // The end of the program
+    OPCODE_COUNT
+};
+
+// The register file: x0-x30 at their own numbers, then
+const int XZR = 31;     // reads as 0; never written
+const int SP = 32;
+const int DISCARD = 33; // where writes to xzr go
+const int REGISTER_COUNT = 34;
+
+/** One predecoded instruction */
+struct Op
+{
+    const void *handler; // Set by Machine::run for its dispatch
+    int64_t imm;         // Immediate, shifted movz/movk/movn value, ldr literal address or branch address
+    uint32_t target;     // Op index of a branch target, or the shift of a movk
+    Opcode opcode;
+    uint8_t rd;          // Register file indexes
+    uint8_t rn;
+    uint8_t rm;          // For b.cond outside the program, the condition
+};
+
+/** Groups of opcodes reported by --profile */
+enum OpcodeClass
+{
+    ARITHMETIC,
+    MULTIPLY,
+    DIVIDE,
+    COMPARE,
+    MOVE,
+    MEMORY_LOAD,
+    MEMORY_STORE,
+    BRANCH,
+    CONDITIONAL_BRANCH,
+    INDIRECT_BRANCH,
+    CLASS_COUNT
+};
+const char *const CLASS_NAMES[CLASS_COUNT] = {"add/sub", "mul",  "div",    "cmp",    "mov",
+                                              "load",    "store", "b",     "b.cond", "br/blr"};
+
+/** Condition names by their encoding */
+const char *const CONDITIONS[16] = {"eq", "ne", "hs", "lo", "mi", "pl", "vs", "vc",
+                                    "hi", "ls", "ge", "lt", "gt", "le", "al", "nv"};
+
+/** The class of an Op that completed (so not UNDEFINED or HALT).  `rm` is the condition of a
+ *  BRANCH_OUTSIDE, 14 (always) for a b. */
+static OpcodeClass classOf(Opcode opcode, uint8_t rm)
+{
+    switch (opcode)
+    {
+    case ADD:
+    case SUB: return ARITHMETIC;
+    case MUL:
+    case SMULH:
+    case UMULH: return MULTIPLY;
+    case SDIV:
+    case UDIV: return DIVIDE;
+    case CMP: return COMPARE;
+    case MOVZ:
+    case MOVK:
+    case MOVN: return MOVE;
+    case LDUR:
+    case LDR: return MEMORY_LOAD;
+    case STUR: return MEMORY_STORE;
+    case B: return BRANCH;
+    case BR:
+    case BLR: return INDIRECT_BRANCH;
+    case BRANCH_OUTSIDE: return rm == 14 ? BRANCH : CONDITIONAL_BRANCH;
+    default: return CONDITIONAL_BRANCH;
+    }
+}
+
+// Base register index of ldr literal loads in Profile::loads, after the register file
+const int PC = REGISTER_COUNT;
+
+/** What Machine::run collects when profiling, and the trace it writes */
+struct Profile
+{
+    std::vector<uint64_t> executions; // Per word of the program, the instructions completed there
+    std::vector<uint64_t> taken;      // Per word, how many times a b.cond there branched
+    uint64_t opcodes[OPCODE_COUNT] = {};
+    uint64_t loads[REGISTER_COUNT + 1] = {}; // By base register, with PC for ldr literal
+    uint64_t stores[REGISTER_COUNT + 1] = {};
+
+    /** Starts writing the trace of a run from `entry` to `path`.  Throws std::runtime_error if the
+     *  file cannot be created. */
+    void startTrace(const std::string &path, uint64_t entry)
+    {
+        trace.open(path, std::ios::binary | std::ios::trunc);
+        if (!trace)
+        {
+            throw std::runtime_error("Unable to write trace '" + path + "'");
+        }
+        tracePath = path;
+        trace.write("ASIMTRC1", 8);
+        trace.write(reinterpret_cast<const char *>(&entry), sizeof(entry));
+        records.reserve(TRACE_BLOCK);
+    }
+
+    bool tracing() const { return !tracePath.empty(); }
+
+    void record(uint32_t index)
+    {
+        records.push_back(index);
+        if (records.size() == TRACE_BLOCK)
+        {
+            flush();
+        }
+    }
+
+    /** Writes the buffered trace records.  Throws std::runtime_error if the write fails. */
+    void flush()
+    {
+        trace.write(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(uint32_t));
+        records.clear();
+        trace.flush();
+        if (!trace)
+        {
+            throw std::runtime_error("Unable to write trace '" + tracePath + "'");
+        }
+    }
+
+private:
+    static const size_t TRACE_BLOCK = 1 << 16;
+    std::ofstream trace;
+    std::string tracePath;
+    std::vector<uint32_t> records;
+};
+
+// Micro-ops of the block engine that are not Opcodes
+enum Fused : uint8_t
+{
+    CONSTANT = OPCODE_COUNT, // movz or movn, then movk of the same register, as one 64-bit move
+    CMP_B_EQ,                // cmp, then a b.cond inside the program, in the order of the condition
+    CMP_B_NV = CMP_B_EQ + 15,
+    CONTINUE,                // the end of a block cut at MAX_BLOCK words, falling through
+    MICRO_OP_COUNT
+};
+
+// Most words a block translates, which bounds the search for blocks a store overwrites
+const uint64_t MAX_BLOCK = 256;
+
+/** One micro-op of a translated block: an Op, or several fused.  The last micro-op of a block also
+ *  holds what leaving the block needs, so that going from block to block reads only it and the
+ *  first micro-op of the next. */
+struct MicroOp
+{
+    const void *handler;    // Set by Machine::runBlocks for its dispatch
+    int64_t imm;            // As in Op, the value of a CONSTANT, or in the last micro-op, the
+                            // instructions in the block
+    const MicroOp *next[2]; // In the last micro-op, the chained successors: the branch target, then
+                            // the fall-through
+    uint32_t target;        // As in Op, for a stur the start of its block, or for br and blr the
+                            // word next[0] leads to
+    uint32_t at;            // Word index of its last instruction
+    uint8_t kind;        // An Opcode, or a Fused for what has no Opcode
+    uint8_t rd;
+    uint8_t rn;
+    uint8_t rm;
+};
+
+/** A translated basic block: the words [start, end) of the program, running straight through to
+ *  the branch (or fault, or end of the program) at its last micro-op */
+struct Block
+{
+    std::vector<MicroOp> ops;
+    uint64_t start;
+    uint64_t end;
+    Block *successors[2] = {};         // The blocks ops.back().next lead into
+    std::vector<Block *> predecessors; // Blocks chained to this one, once per link
+};
+
+/** Sign-extends the low `bits` bits of value */
+static int64_t signExtend(uint32_t value, int bits)
+{
+    return static_cast<int64_t>(static_cast<int32_t>(value << (32 - bits)) >> (32 - bits));
+}
+
+/** Whether condition `cond` (the b.cond field) holds after `cmp a, b` */
+static bool conditionHolds(unsigned cond, uint64_t a, uint64_t b)
+{
+    int64_t difference = static_cast<int64_t>(a - b);
+    bool overflow = static_cast<int64_t>((a ^ b) & (a ^ (a - b))) < 0;
+    switch (cond)
+    {
+    case 0: return a == b;
+    case 1: return a != b;
+    case 2: return a >= b;
+    case 3: return a < b;
+    case 4: return difference < 0;
+    case 5: return difference >= 0;
+    case 6: return overflow;
+    case 7: return !overflow;
+    case 8: return a > b;
+    case 9: return a <= b;
+    case 10: return static_cast<int64_t>(a) >= static_cast<int64_t>(b);
+    case 11: return static_cast<int64_t>(a) < static_cast<int64_t>(b);
+    case 12: return static_cast<int64_t>(a) > static_cast<int64_t>(b);
+    case 13: return static_cast<int64_t>(a) <= static_cast<int64_t>(b);
+    default: return true;
+    }
+}
+
+class Machine
+{
+public:
+    /**
+     * @param code The program, loaded at address 0
+     * @param memoryBytes Size of the memory image; the stack pointer starts at its end
+     */
+    Machine(const std::string &code, uint64_t memoryBytes)
+        : codeBytes(code.size()), words((code.size() + 3) / 4), memoryBytes(memoryBytes)
+    {
+        if (memoryBytes < words * 4 + 8)
+        {
+            formatError("Memory of " + std::to_string(memoryBytes) + " bytes cannot hold the program");
+        }
+        // Anonymous pages are zero and only touched when used
+        void *mapped = mmap(nullptr, memoryBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED)
+        {
+            formatError("Unable to allocate " + std::to_string(memoryBytes) + " bytes of memory");
+        }
+        memory = static_cast<uint8_t *>(mapped);
+        memcpy(memory, code.data(), code.size());
+
+        ops.resize(words + 1);
+        for (uint64_t index = 0; index <= words; index++)
+        {
+            ops[index] = decode(index);
+        }
+        regs[SP] = memoryBytes;
+        regs[30] = end(); // so that `br x30` ends the program
+    }
+
+    ~Machine()
+    {
+        munmap(memory, memoryBytes);
+    }
+
+    Machine(const Machine &) = delete;
+    Machine &operator=(const Machine &) = delete;
+
+    /** The address just past the program's last word: branching there, or running into it, ends the
+     *  program */
+    uint64_t end() const { return words * 4; }
+
+    uint64_t &reg(int index) { return regs[index]; }
+
+    /** The flags as the NZCV bits 3-0, from the last cmp */
+    unsigned nzcv() const
+    {
+        uint64_t difference = cmpA - cmpB;
+        bool n = static_cast<int64_t>(difference) < 0;
+        bool z = difference == 0;
+        bool c = cmpA >= cmpB;
+        bool v = static_cast<int64_t>((cmpA ^ cmpB) & (cmpA ^ difference)) < 0;
+        return n << 3 | z << 2 | c << 1 | v;
+    }
+
+    /** Whether the last run reached the end of the program, rather than stopping at maxSteps */
+    bool finished() const { return halted; }
+
+    /** The Op at word `index` of the program, as last decoded */
+    const Op &op(uint64_t index) const { return ops[index]; }
+
+    /** Runs from `entry` until the program ends, or until the first branch taken after `maxSteps`
+     *  instructions.  Throws std::runtime_error on a fault.
+     *
+     * @param profile If not null, where to count what runs, sized to the program here
+     * @return The number of instructions executed
+     */
+    uint64_t run(uint64_t entry, uint64_t maxSteps, Profile *profile = nullptr);
+
+    /** Runs like run(), translating each basic block reached into micro-ops once and jumping from
+     *  block to block through chained pointers */
+    uint64_t runBlocks(uint64_t entry, uint64_t maxSteps);
+
+    // Blocks translated, micro-ops that replaced two or more instructions, and blocks dropped
+    // because a store overwrote them, by runBlocks
+    uint64_t blocksTranslated = 0;
+    uint64_t fusedOps = 0;
+    uint64_t blocksInvalidated = 0;
+
+private:
+    template <bool Profiling>
+    uint64_t execute(uint64_t entry, uint64_t maxSteps, Profile *profile);
+
+    /** Decodes the word at ops[index].  The Op past the last word halts. */
+    Op decode(uint64_t index) const
+    {
+        Op op = {nullptr, 0, 0, UNDEFINED, DISCARD, XZR, XZR};
+        if (index == words)
+        {
+            op.opcode = HALT;
+            return op;
+        }
+        uint32_t word = 0;
+        memcpy(&word, memory + index * 4, std::min<uint64_t>(4, codeBytes - index * 4));
+
+        uint32_t rd = word & 31u;
+        uint32_t rn = (word >> 5) & 31u;
+        uint32_t rm = (word >> 16) & 31u;
+        auto sp = [](uint32_t r) { return static_cast<uint8_t>(r == 31 ? SP : r); };
+        auto zeroIn = [](uint32_t r) { return static_cast<uint8_t>(r); };
+        auto zeroOut = [](uint32_t r) { return static_cast<uint8_t>(r == 31 ? DISCARD : r); };
+        auto branch = [&](int64_t offset, Opcode opcode)
+        {
+            int64_t target = static_cast<int64_t>(index) + offset / 4;
+            op.imm = static_cast<int64_t>(index * 4) + offset;
+            if (target < 0 || static_cast<uint64_t>(target) > words)
+            {
+                op.rm = opcode == B ? 14 : opcode - B_EQ;
+                op.opcode = BRANCH_OUTSIDE;
+                return;
+            }
+            op.target = target;
+            op.opcode = opcode;
+        };
+
+        switch (word & 0xFFE0FC00u)
+        {
+        case 0x8B206000u: op = {nullptr, 0, 0, ADD, sp(rd), sp(rn), zeroIn(rm)}; return op;
+        case 0xCB206000u: op = {nullptr, 0, 0, SUB, sp(rd), sp(rn), zeroIn(rm)}; return op;
+        case 0x9B007C00u: op = {nullptr, 0, 0, MUL, zeroOut(rd), zeroIn(rn), zeroIn(rm)}; return op;
+        case 0x9B407C00u: op = {nullptr, 0, 0, SMULH, zeroOut(rd), zeroIn(rn), zeroIn(rm)}; return op;
+        case 0x9BC07C00u: op = {nullptr, 0, 0, UMULH, zeroOut(rd), zeroIn(rn), zeroIn(rm)}; return op;
+        case 0x9AC00C00u: op = {nullptr, 0, 0, SDIV, zeroOut(rd), zeroIn(rn), zeroIn(rm)}; return op;
+        case 0x9AC00800u: op = {nullptr, 0, 0, UDIV, zeroOut(rd), zeroIn(rn), zeroIn(rm)}; return op;
+        case 0xEB206000u:
+            if (rd == 31)
+            {
+                op = {nullptr, 0, 0, CMP, DISCARD, sp(rn), zeroIn(rm)};
+            }
+            return op;
+        }
+        if ((word & 0xFFFFFC1Fu) == 0xD61F0000u || (word & 0xFFFFFC1Fu) == 0xD63F0000u)
+        {
+            op.opcode = (word & 0xFFFFFC1Fu) == 0xD61F0000u ? BR : BLR;
+            op.rn = zeroIn(rn);
+            return op;
+        }
+        uint32_t wide = word & 0xFF800000u;
+        if (wide == 0xD2800000u || wide == 0xF2800000u || wide == 0x92800000u)
+        {
+            uint32_t shift = ((word >> 21) & 3u) * 16;
+            op.opcode = wide == 0xD2800000u ? MOVZ : wide == 0xF2800000u ? MOVK : MOVN;
+            op.imm = static_cast<int64_t>(static_cast<uint64_t>((word >> 5) & 0xFFFFu) << shift);
+            op.target = shift;
+            op.rd = zeroOut(rd);
+            op.rn = zeroIn(rd); // movk keeps the other bits of rd
+            return op;
+        }
+        if ((word & 0xFFE00C00u) == 0xF8400000u || (word & 0xFFE00C00u) == 0xF8000000u)
+        {
+            bool load = (word & 0xFFE00C00u) == 0xF8400000u;
+            op.opcode = load ? LDUR : STUR;
+            op.rd = load ? zeroOut(rd) : zeroIn(rd);
+            op.rn = sp(rn);
+            op.imm = signExtend((word >> 12) & 0x1FFu, 9);
+            return op;
+        }
+        if ((word & 0xFF000000u) == 0x58000000u)
+        {
+            op.opcode = LDR;
+            op.rd = zeroOut(rd);
+            op.imm = static_cast<int64_t>(index * 4) + signExtend((word >> 5) & 0x7FFFFu, 19) * 4;
+            return op;
+        }
+        if ((word & 0xFC000000u) == 0x14000000u)
+        {
+            branch(signExtend(word & 0x3FFFFFFu, 26) * 4, B);
+            return op;
+        }
+        if ((word & 0xFF000010u) == 0x54000000u)
+        {
+            branch(signExtend((word >> 5) & 0x7FFFFu, 19) * 4, static_cast<Opcode>(B_EQ + (word & 0xFu)));
+            return op;
+        }
+        return op;
+    }
+
+    /** Decodes the words overlapping [address, address + bytes) again, after a store into the
+     *  program */
+    void redecode(uint64_t address, uint64_t bytes)
+    {
+        for (uint64_t index = address / 4; index < words && index * 4 < address + bytes; index++)
+        {
+            ops[index] = decode(index);
+            if (handlers != nullptr)
+            {
+                ops[index].handler = handlers[ops[index].opcode];
+            }
+        }
+    }
+
+    /** The first micro-op of the block starting at word `index`, translated now if it is not
+     *  cached */
+    const MicroOp *entryAt(uint64_t index)
+    {
+        if (entries[index] == nullptr)
+        {
+            translate(index);
+        }
+        return entries[index];
+    }
+
+    /** Translates the block starting at word `index` from the decoded Ops, fusing cmp with a
+     *  following b.cond and movz or movn with the movk after them */
+    void translate(uint64_t index)
+    {
+        auto block = std::make_unique<Block>();
+        block->start = index;
+        for (;;)
+        {
+            if (index - block->start == MAX_BLOCK)
+            {
+                block->ops.push_back({microHandlers[CONTINUE], 0, {}, 0, static_cast<uint32_t>(index - 1), CONTINUE,
+                                      DISCARD, XZR, XZR});
+                break;
+            }
+            const Op &op = ops[index];
+            MicroOp micro = {microHandlers[op.opcode], op.imm, {}, op.target, static_cast<uint32_t>(index),
+                             op.opcode, op.rd, op.rn, op.rm};
+            if (op.opcode == STUR)
+            {
+                micro.target = block->start;
+            }
+            if (op.opcode == MOVZ || op.opcode == MOVN)
+            {
+                uint64_t value = op.opcode == MOVZ ? op.imm : ~static_cast<uint64_t>(op.imm);
+                uint64_t first = index;
+                while (index + 1 - block->start < MAX_BLOCK && ops[index + 1].opcode == MOVK &&
+                       ops[index + 1].rd == op.rd && ops[index + 1].rn == op.rd)
+                {
+                    index++;
+                    value = (value & ~(uint64_t(0xFFFF) << ops[index].target)) | ops[index].imm;
+                }
+                if (index != first)
+                {
+                    micro = {microHandlers[CONSTANT], static_cast<int64_t>(value), {}, 0,
+                             static_cast<uint32_t>(index), CONSTANT, op.rd, XZR, XZR};
+                    fusedOps++;
+                }
+            }
+            else if (op.opcode == CMP && index + 1 < words && ops[index + 1].opcode >= B_EQ &&
+                     ops[index + 1].opcode <= B_NV && index + 1 - block->start < MAX_BLOCK)
+            {
+                index++;
+                uint8_t kind = CMP_B_EQ + (ops[index].opcode - B_EQ);
+                micro = {microHandlers[kind], 0, {}, ops[index].target, static_cast<uint32_t>(index), kind,
+                         DISCARD, op.rn, op.rm};
+                fusedOps++;
+            }
+            block->ops.push_back(micro);
+            if ((micro.kind >= B && micro.kind < OPCODE_COUNT) || (micro.kind >= CMP_B_EQ && micro.kind <= CMP_B_NV))
+            {
+                // Branches, faults and the end of the program end the block
+                break;
+            }
+            index++;
+        }
+        MicroOp &last = block->ops.back();
+        block->end = last.kind == HALT ? words : last.at + 1;
+        last.imm = block->end - block->start;
+        for (uint64_t covered = block->start; covered < block->end; covered++)
+        {
+            translated[covered]++;
+        }
+        blocksTranslated++;
+        entries[block->start] = block->ops.data();
+        blocks[block->start] = std::move(block);
+    }
+
+    /** Chains the block ending in `last` to its successor starting at word `index`, as its
+     *  next[slot].  For br and blr, next[0] is the first target seen, with its word in `target`. */
+    const MicroOp *chain(const MicroOp *last, int slot, uint64_t index)
+    {
+        Block *from = blocks[last->at + 1 - last->imm].get();
+        const MicroOp *to = entryAt(index);
+        from->ops.back().next[slot] = to;
+        if (slot == 0)
+        {
+            from->ops.back().target = index;
+        }
+        from->successors[slot] = blocks[index].get();
+        from->successors[slot]->predecessors.push_back(from);
+        return to;
+    }
+
+    /** Drops every block that covers a word of [address, address + bytes), after a store into the
+     *  program, unchaining it from its neighbours.
+     *
+     * @return The block starting at word `current`, if it was dropped, kept alive for the caller to
+     *         leave; else null
+     */
+    std::unique_ptr<Block> invalidate(uint64_t address, uint64_t bytes, uint64_t current)
+    {
+        uint64_t first = address / 4;
+        uint64_t last = std::min(words, (address + bytes + 3) / 4);
+        bool hit = false;
+        for (uint64_t index = first; index < last; index++)
+        {
+            hit |= translated[index] != 0;
+        }
+        if (!hit)
+        {
+            return nullptr;
+        }
+
+        std::unique_ptr<Block> kept;
+        for (uint64_t start = first >= MAX_BLOCK ? first - MAX_BLOCK + 1 : 0; start < last; start++)
+        {
+            if (!blocks[start] || blocks[start]->end <= first)
+            {
+                continue;
+            }
+            std::unique_ptr<Block> block = std::move(blocks[start]);
+            entries[start] = nullptr;
+            for (Block *predecessor : block->predecessors)
+            {
+                for (int slot = 0; slot < 2; slot++)
+                {
+                    if (predecessor->successors[slot] == block.get())
+                    {
+                        predecessor->successors[slot] = nullptr;
+                        predecessor->ops.back().next[slot] = nullptr;
+                    }
+                }
+            }
+            for (Block *successor : block->successors)
+            {
+                if (successor != nullptr)
+                {
+                    std::erase(successor->predecessors, block.get());
+                }
+            }
+            for (uint64_t covered = block->start; covered < block->end; covered++)
+            {
+                translated[covered]--;
+            }
+            blocksInvalidated++;
+            if (start == current)
+            {
+                kept = std::move(block);
+            }
+        }
+        return kept;
+    }
+
+    void checkEntry(uint64_t entry) const
+    {
+        if (entry % 4 != 0 || entry > end())
+        {
+            formatError("Entry point " + std::to_string(entry) + " is not an instruction of the program");
+        }
+    }
+
+    /** The word at an address, for messages */
+    uint32_t wordAt(uint64_t address) const
+    {
+        uint32_t word = 0;
+        memcpy(&word, memory + address, std::min<uint64_t>(4, codeBytes - address));
+        return word;
+    }
+
+    uint64_t codeBytes;
+    uint64_t words;
+    uint64_t memoryBytes;
+    uint8_t *memory;
+    std::vector<Op> ops;
+    const void *const *handlers = nullptr;
+    std::vector<std::unique_ptr<Block>> blocks; // By start word, for runBlocks
+    std::vector<const MicroOp *> entries;       // By start word, the first micro-op of each block
+    std::vector<uint16_t> translated;           // Per word, how many blocks cover it
+    const void *const *microHandlers = nullptr;
+    uint64_t regs[REGISTER_COUNT] = {};
+    uint64_t cmpA = 0; // The operands of the last cmp, from which the flags are computed when used
+    uint64_t cmpB = 0;
+    bool halted = false;
+};
+
+uint64_t Machine::run(uint64_t entry, uint64_t maxSteps, Profile *profile)
+{
+    checkEntry(entry);
+    if (profile == nullptr)
+    {
+        return execute<false>(entry, maxSteps, nullptr);
+    }
+    profile->executions.assign(ops.size(), 0);
+    profile->taken.assign(ops.size(), 0);
+    uint64_t steps = execute<true>(entry, maxSteps, profile);
+    if (profile->tracing())
+    {
+        profile->flush();
+    }
+    return steps;
+}
+
+template <bool Profiling>
+uint64_t Machine::execute(uint64_t entry, uint64_t maxSteps, Profile *profile)
+{
+    static const void *const HANDLERS[OPCODE_COUNT] = {
+        &&add, &&sub, &&mul, &&smulh, &&umulh, &&sdiv, &&udiv, &&cmp, &&movz, &&movk, &&movn, &&ldur,
+        &&stur, &&ldr, &&b, &&br, &&blr, &&b_eq, &&b_ne, &&b_hs, &&b_lo, &&b_mi, &&b_pl, &&b_vs,
+        &&b_vc, &&b_hi, &&b_ls, &&b_ge, &&b_lt, &&b_gt, &&b_le, &&b_al, &&b_nv, &&outside,
+        &&undefined, &&halt};
+    handlers = HANDLERS;
+    halted = false;
+    for (Op &op : ops)
+    {
+        op.handler = HANDLERS[op.opcode];
+    }
+
+    // The hot state lives in locals so that it stays in registers
+    uint64_t *x = regs;
+    uint8_t *mem = memory;
+    const uint64_t lastByte = memoryBytes - 8; // the last address a 64-bit access may start at
+    Op *base = ops.data();
+    Op *op = base + entry / 4;
+    uint64_t left = cmpA; // the operands of the last cmp
+    uint64_t right = cmpB;
+    uint64_t steps = 0;
+    std::string fault;
+
+// With Profiling, each instruction is counted as it completes, and each branch traced with where it
+// goes
+#define COUNT()                                                                                                        \
+    if constexpr (Profiling)                                                                                           \
+    {                                                                                                                  \
+        profile->executions[op - base]++;                                                                              \
+        profile->opcodes[op->opcode]++;                                                                                \
+    }
+#define TRACE(to)                                                                                                      \
+    if constexpr (Profiling)                                                                                           \
+    {                                                                                                                  \
+        if (profile->tracing())                                                                                        \
+            profile->record(static_cast<uint32_t>((to) - base));                                                       \
+    }
+// Each handler ends by counting its instruction and jumping straight to the next one's handler
+#define NEXT()                                                                                                         \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        COUNT();                                                                                                       \
+        steps++;                                                                                                       \
+        op++;                                                                                                          \
+        goto *op->handler;                                                                                             \
+    } while (0)
+#define JUMP(to)                                                                                                       \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        Op *next = (to);                                                                                               \
+        COUNT();                                                                                                       \
+        TRACE(next);                                                                                                   \
+        steps++;                                                                                                       \
+        op = next;                                                                                                     \
+        if (steps >= maxSteps)                                                                                         \
+            goto limit;                                                                                                \
+        goto *op->handler;                                                                                             \
+    } while (0)
+#define BCOND(label, condition)                                                                                        \
+    label:                                                                                                             \
+    if (condition)                                                                                                     \
+    {                                                                                                                  \
+        if constexpr (Profiling)                                                                                       \
+            profile->taken[op - base]++;                                                                               \
+        JUMP(base + op->target);                                                                                       \
+    }                                                                                                                  \
+    TRACE(op + 1);                                                                                                     \
+    NEXT();
+
+    goto *op->handler;
+
+add:
+    x[op->rd] = x[op->rn] + x[op->rm];
+    NEXT();
+sub:
+    x[op->rd] = x[op->rn] - x[op->rm];
+    NEXT();
+mul:
+    x[op->rd] = x[op->rn] * x[op->rm];
+    NEXT();
+smulh:
+    x[op->rd] = static_cast<uint64_t>(
+        (static_cast<__int128>(static_cast<int64_t>(x[op->rn])) * static_cast<int64_t>(x[op->rm])) >> 64);
+    NEXT();
+umulh:
+    x[op->rd] = static_cast<uint64_t>((static_cast<unsigned __int128>(x[op->rn]) * x[op->rm]) >> 64);
+    NEXT();
+sdiv:
+{
+    // Division by zero gives 0, and INT64_MIN / -1 wraps, as on hardware
+    int64_t n = x[op->rn];
+    int64_t d = x[op->rm];
+    x[op->rd] = d == 0 ? 0 : d == -1 ? 0 - static_cast<uint64_t>(n) : static_cast<uint64_t>(n / d);
+    NEXT();
+}
+udiv:
+    x[op->rd] = x[op->rm] == 0 ? 0 : x[op->rn] / x[op->rm];
+    NEXT();
+cmp:
+    left = x[op->rn];
+    right = x[op->rm];
+    NEXT();
+movz:
+    x[op->rd] = op->imm;
+    NEXT();
+movk:
+    x[op->rd] = (x[op->rn] & ~(uint64_t(0xFFFF) << op->target)) | op->imm;
+    NEXT();
+movn:
+    x[op->rd] = ~static_cast<uint64_t>(op->imm);
+    NEXT();
+ldur:
+{
+    uint64_t address = x[op->rn] + op->imm;
+    if (address > lastByte)
+    {
+        fault = "Load from " + std::to_string(static_cast<int64_t>(address)) + " outside memory";
+        goto stop;
+    }
+    memcpy(&x[op->rd], mem + address, 8);
+    if constexpr (Profiling)
+        profile->loads[op->rn]++;
+    NEXT();
+}
+stur:
+{
+    uint64_t address = x[op->rn] + op->imm;
+    if (address > lastByte)
+    {
+        fault = "Store to " + std::to_string(static_cast<int64_t>(address)) + " outside memory";
+        goto stop;
+    }
+    memcpy(mem + address, &x[op->rd], 8);
+    if constexpr (Profiling)
+        profile->stores[op->rn]++;
+    if (address < codeBytes)
+    {
+        redecode(address, 8); // self-modifying code
+    }
+    NEXT();
+}
+ldr:
+    if (static_cast<uint64_t>(op->imm) > lastByte)
+    {
+        fault = "Load from " + std::to_string(op->imm) + " outside memory";
+        goto stop;
+    }
+    memcpy(&x[op->rd], mem + op->imm, 8);
+    if constexpr (Profiling)
+        profile->loads[PC]++;
+    NEXT();
+b:
+    JUMP(base + op->target);
+br:
+blr:
+{
+    uint64_t target = x[op->rn];
+    if (target % 4 != 0 || target > end())
+    {
+        fault = "Branch to " + std::to_string(static_cast<int64_t>(target)) + " outside the program";
+        goto stop;
+    }
+    if (op->opcode == BLR)
+    {
+        x[30] = (op - base) * 4 + 4;
+    }
+    JUMP(base + target / 4);
+}
+    BCOND(b_eq, left == right)
+    BCOND(b_ne, left != right)
+    BCOND(b_hs, left >= right)
+    BCOND(b_lo, left < right)
+    BCOND(b_mi, static_cast<int64_t>(left - right) < 0)
+    BCOND(b_pl, static_cast<int64_t>(left - right) >= 0)
+    BCOND(b_vs, static_cast<int64_t>((left ^ right) & (left ^ (left - right))) < 0)
+    BCOND(b_vc, static_cast<int64_t>((left ^ right) & (left ^ (left - right))) >= 0)
+    BCOND(b_hi, left > right)
+    BCOND(b_ls, left <= right)
+    BCOND(b_ge, static_cast<int64_t>(left) >= static_cast<int64_t>(right))
+    BCOND(b_lt, static_cast<int64_t>(left) < static_cast<int64_t>(right))
+    BCOND(b_gt, static_cast<int64_t>(left) > static_cast<int64_t>(right))
+    BCOND(b_le, static_cast<int64_t>(left) <= static_cast<int64_t>(right))
+    BCOND(b_al, true)
+    BCOND(b_nv, true)
+outside:
+    if (conditionHolds(op->rm, left, right))
+    {
+        fault = "Branch to " + std::to_string(op->imm) + " outside the program";
+        goto stop;
+    }
+    TRACE(op + 1);
+    NEXT();
+undefined:
+{
+    std::stringstream message;
+    message << "Undefined instruction 0x" << std::hex << wordAt((op - base) * 4);
+    fault = message.str();
+    goto stop;
+}
+halt:
+    halted = true;
+limit:
+stop:
+#undef COUNT
+#undef TRACE
+#undef NEXT
+#undef JUMP
+#undef BCOND
+    cmpA = left;
+    cmpB = right;
+    if (!fault.empty())
+    {
+        formatError(fault + " at address " + std::to_string((op - base) * 4));
+    }
+    return steps;
+}
+
+uint64_t Machine::runBlocks(uint64_t entry, uint64_t maxSteps)
+{
+    static const void *const HANDLERS[MICRO_OP_COUNT] = {
+        &&add, &&sub, &&mul, &&smulh, &&umulh, &&sdiv, &&udiv, &&cmp, &&movz, &&movk, &&movn, &&ldur,
+        &&stur, &&ldr, &&b, &&br, &&blr, &&b_eq, &&b_ne, &&b_hs, &&b_lo, &&b_mi, &&b_pl, &&b_vs,
+        &&b_vc, &&b_hi, &&b_ls, &&b_ge, &&b_lt, &&b_gt, &&b_le, &&b_al, &&b_nv, &&outside,
+        &&undefined, &&halt, &&constant, &&cmp_b_eq, &&cmp_b_ne, &&cmp_b_hs, &&cmp_b_lo, &&cmp_b_mi,
+        &&cmp_b_pl, &&cmp_b_vs, &&cmp_b_vc, &&cmp_b_hi, &&cmp_b_ls, &&cmp_b_ge, &&cmp_b_lt, &&cmp_b_gt,
+        &&cmp_b_le, &&cmp_b_al, &&cmp_b_nv, &&next_block};
+    checkEntry(entry);
+    // Blocks from an earlier run may predate stores made by run()
+    microHandlers = HANDLERS;
+    blocks.clear();
+    blocks.resize(words + 1);
+    entries.assign(words + 1, nullptr);
+    translated.assign(words + 1, 0);
+    halted = false;
+
+    uint64_t *x = regs;
+    uint8_t *mem = memory;
+    const uint64_t lastByte = memoryBytes - 8;
+    const MicroOp *u = entryAt(entry / 4);
+    std::unique_ptr<Block> retired; // A block a store dropped while it ran
+    uint64_t left = cmpA;
+    uint64_t right = cmpB;
+    uint64_t steps = 0;
+    std::string fault;
+
+// Instructions are counted a block at a time, as it is left
+#define NEXT()                                                                                                         \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        u++;                                                                                                           \
+        goto *u->handler;                                                                                              \
+    } while (0)
+#define TAKEN()                                                                                                        \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        steps += u->imm;                                                                                               \
+        u = u->next[0] != nullptr ? u->next[0] : chain(u, 0, u->target);                                               \
+        if (steps >= maxSteps)                                                                                         \
+            goto limit;                                                                                                \
+        goto *u->handler;                                                                                              \
+    } while (0)
+#define FALL_THROUGH()                                                                                                 \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        steps += u->imm;                                                                                               \
+        u = u->next[1] != nullptr ? u->next[1] : chain(u, 1, u->at + 1);                                               \
+        goto *u->handler;                                                                                              \
+    } while (0)
+// A fused cmp and b.cond sets the flags, then continues as the b.cond
+#define BCOND(label, fused, condition)                                                                                 \
+    fused:                                                                                                             \
+    left = x[u->rn];                                                                                                   \
+    right = x[u->rm];                                                                                                  \
+    label:                                                                                                             \
+    if (condition)                                                                                                     \
+        TAKEN();                                                                                                       \
+    FALL_THROUGH();
+
+    goto *u->handler;
+
+add:
+    x[u->rd] = x[u->rn] + x[u->rm];
+    NEXT();
+sub:
+    x[u->rd] = x[u->rn] - x[u->rm];
+    NEXT();
+mul:
+    x[u->rd] = x[u->rn] * x[u->rm];
+    NEXT();
+smulh:
+    x[u->rd] = static_cast<uint64_t>(
+        (static_cast<__int128>(static_cast<int64_t>(x[u->rn])) * static_cast<int64_t>(x[u->rm])) >> 64);
+    NEXT();
+umulh:
+    x[u->rd] = static_cast<uint64_t>((static_cast<unsigned __int128>(x[u->rn]) * x[u->rm]) >> 64);
+    NEXT();
+sdiv:
+{
+    int64_t n = x[u->rn];
+    int64_t d = x[u->rm];
+    x[u->rd] = d == 0 ? 0 : d == -1 ? 0 - static_cast<uint64_t>(n) : static_cast<uint64_t>(n / d);
+    NEXT();
+}
+udiv:
+    x[u->rd] = x[u->rm] == 0 ? 0 : x[u->rn] / x[u->rm];
+    NEXT();
+cmp:
+    left = x[u->rn];
+    right = x[u->rm];
+    NEXT();
+movz:
+constant:
+    x[u->rd] = u->imm;
+    NEXT();
+movk:
+    x[u->rd] = (x[u->rn] & ~(uint64_t(0xFFFF) << u->target)) | u->imm;
+    NEXT();
+movn:
+    x[u->rd] = ~static_cast<uint64_t>(u->imm);
+    NEXT();
+ldur:
+{
+    uint64_t address = x[u->rn] + u->imm;
+    if (address > lastByte)
+    {
+        fault = "Load from " + std::to_string(static_cast<int64_t>(address)) + " outside memory";
+        goto stop;
+    }
+    memcpy(&x[u->rd], mem + address, 8);
+    NEXT();
+}
+stur:
+{
+    uint64_t address = x[u->rn] + u->imm;
+    if (address > lastByte)
+    {
+        fault = "Store to " + std::to_string(static_cast<int64_t>(address)) + " outside memory";
+        goto stop;
+    }
+    memcpy(mem + address, &x[u->rd], 8);
+    if (address < codeBytes)
+    {
+        redecode(address, 8);
+        retired = invalidate(address, 8, u->target);
+        if (retired)
+        {
+            // This block was overwritten: go on from the next instruction in a new one
+            steps += u->at + 1 - u->target;
+            u = entryAt(u->at + 1);
+            goto *u->handler;
+        }
+    }
+    NEXT();
+}
+ldr:
+    if (static_cast<uint64_t>(u->imm) > lastByte)
+    {
+        fault = "Load from " + std::to_string(u->imm) + " outside memory";
+        goto stop;
+    }
+    memcpy(&x[u->rd], mem + u->imm, 8);
+    NEXT();
+b:
+    TAKEN();
+br:
+blr:
+{
+    uint64_t target = x[u->rn];
+    if (target % 4 != 0 || target > end())
+    {
+        fault = "Branch to " + std::to_string(static_cast<int64_t>(target)) + " outside the program";
+        goto stop;
+    }
+    if (u->kind == BLR)
+    {
+        x[30] = uint64_t(u->at) * 4 + 4;
+    }
+    steps += u->imm;
+    if (u->next[0] != nullptr && u->target == target / 4)
+    {
+        u = u->next[0];
+    }
+    else
+    {
+        // Only the first target is chained, so alternating ones do not relink each time
+        u = u->next[0] == nullptr ? chain(u, 0, target / 4) : entryAt(target / 4);
+    }
+    if (steps >= maxSteps)
+        goto limit;
+    goto *u->handler;
+}
+    BCOND(b_eq, cmp_b_eq, left == right)
+    BCOND(b_ne, cmp_b_ne, left != right)
+    BCOND(b_hs, cmp_b_hs, left >= right)
+    BCOND(b_lo, cmp_b_lo, left < right)
+    BCOND(b_mi, cmp_b_mi, static_cast<int64_t>(left - right) < 0)
+    BCOND(b_pl, cmp_b_pl, static_cast<int64_t>(left - right) >= 0)
+    BCOND(b_vs, cmp_b_vs, static_cast<int64_t>((left ^ right) & (left ^ (left - right))) < 0)
+    BCOND(b_vc, cmp_b_vc, static_cast<int64_t>((left ^ right) & (left ^ (left - right))) >= 0)
+    BCOND(b_hi, cmp_b_hi, left > right)
+    BCOND(b_ls, cmp_b_ls, left <= right)
+    BCOND(b_ge, cmp_b_ge, static_cast<int64_t>(left) >= static_cast<int64_t>(right))
+    BCOND(b_lt, cmp_b_lt, static_cast<int64_t>(left) < static_cast<int64_t>(right))
+    BCOND(b_gt, cmp_b_gt, static_cast<int64_t>(left) > static_cast<int64_t>(right))
+    BCOND(b_le, cmp_b_le, static_cast<int64_t>(left) <= static_cast<int64_t>(right))
+    BCOND(b_al, cmp_b_al, true)
+    BCOND(b_nv, cmp_b_nv, true)
+outside:
+    if (conditionHolds(u->rm, left, right))
+    {
+        fault = "Branch to " + std::to_string(ops[u->at].imm) + " outside the program";
+        goto stop;
+    }
+    FALL_THROUGH();
+next_block:
+    FALL_THROUGH();
+undefined:
+{
+    std::stringstream message;
+    message << "Undefined instruction 0x" << std::hex << wordAt(uint64_t(u->at) * 4);
+    fault = message.str();
+    goto stop;
+}
+halt:
+    steps += u->imm;
+    halted = true;
+limit:
+stop:
+#undef NEXT
+#undef TAKEN
+#undef FALL_THROUGH
+#undef BCOND
+    cmpA = left;
+    cmpB = right;
+    if (!fault.empty())
+    {
+        formatError(fault + " at address " + std::to_string(uint64_t(u->at) * 4));
+    }
+    return steps;
+}
+
+/** Parses a decimal or 0x-prefixed hex number, with an optional leading minus */
+bool parseNumber(std::string_view text, uint64_t &value)
+{
+    bool negative = text.starts_with('-');
+    if (negative)
+    {
+        text.remove_prefix(1);
+    }
+    int base = 10;
+    if (text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X'))
+    {
+        base = 16;
+        text.remove_prefix(2);
+    }
+    const char *end = text.data() + text.size();
+    auto [ptr, error] = std::from_chars(text.data(), end, value, base);
+    if (error != std::errc() || ptr != end || text.empty())
+    {
+        return false;
+    }
+    value = negative ? 0 - value : value;
+    return true;
+}
+
+/** Formats `address` as hex, with `label+0xOFFSET` if the symbol map has a label containing it */
+std::string describe(uint64_t address, const symbolmap::Map *map)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "0x%08llx", static_cast<unsigned long long>(address));
+    std::string description = text;
+    std::string_view name;
+    uint64_t start = 0;
+    if (map != nullptr && map->lookup(address, name, start))
+    {
+        snprintf(text, sizeof(text), "+0x%llx", static_cast<unsigned long long>(address - start));
+        description += ' ';
+        description += name;
+        description += text;
+    }
+    return description;
+}
+
+/** Writes the --profile report: instructions by class, by label (with a symbol map), b.cond
+ *  outcomes, loads and stores by base register, and instructions by address */
+void writeProfile(const std::string &path, const Machine &machine, const Profile &profile, uint64_t steps,
+                  const symbolmap::Map *map)
+{
+    std::string out;
+    char line[128];
+    auto percent = [&](uint64_t count) { return steps == 0 ? 0.0 : 100.0 * count / steps; };
+    uint64_t words = profile.executions.size() - 1;
+    out += "# " + std::to_string(steps) + " instructions\n";
+
+    out += "# by class: class, count, share\n";
+    uint64_t classes[CLASS_COUNT] = {};
+    for (int opcode = 0; opcode < OPCODE_COUNT; opcode++)
+    {
+        // BRANCH_OUTSIDE only completes when its condition fails, so it is never a b
+        classes[classOf(static_cast<Opcode>(opcode), 0)] += profile.opcodes[opcode];
+    }
+    for (int c = 0; c < CLASS_COUNT; c++)
+    {
+        snprintf(line, sizeof(line), "%-8s %14llu %7.2f%%\n", CLASS_NAMES[c],
+                 static_cast<unsigned long long>(classes[c]), percent(classes[c]));
+        out += line;
+    }
+
+    if (map != nullptr)
+    {
+        // Labels in address order, each with the instructions from it to the next label
+        std::vector<std::pair<std::string_view, uint64_t>> labels;
+        for (uint64_t index = 0; index < words; index++)
+        {
+            std::string_view name;
+            uint64_t start = 0;
+            if (profile.executions[index] == 0 || !map->lookup(index * 4, name, start))
+            {
+                continue;
+            }
+            if (labels.empty() || labels.back().first != name)
+            {
+                labels.emplace_back(name, 0);
+            }
+            labels.back().second += profile.executions[index];
+        }
+        std::stable_sort(labels.begin(), labels.end(), [](const auto &a, const auto &b) { return a.second > b.second; });
+        out += "# by label: label, count, share\n";
+        for (const auto &[name, count] : labels)
+        {
+            snprintf(line, sizeof(line), " %14llu %7.2f%%\n", static_cast<unsigned long long>(count), percent(count));
+            out += name;
+            out += line;
+        }
+    }
+
+    out += "# b.cond: address, condition, taken, not taken\n";
+    for (uint64_t index = 0; index < words; index++)
+    {
+        const Op &op = machine.op(index);
+        if (profile.executions[index] == 0 || classOf(op.opcode, op.rm) != CONDITIONAL_BRANCH)
+        {
+            continue;
+        }
+        unsigned condition = op.opcode == BRANCH_OUTSIDE ? op.rm : op.opcode - B_EQ;
+        uint64_t taken = profile.taken[index];
+        snprintf(line, sizeof(line), " b.%s %llu %llu\n", CONDITIONS[condition], static_cast<unsigned long long>(taken),
+                 static_cast<unsigned long long>(profile.executions[index] - taken));
+        out += describe(index * 4, map);
+        out += line;
+    }
+
+    out += "# memory: base register, loads, stores\n";
+    for (int r = 0; r <= REGISTER_COUNT; r++)
+    {
+        if (profile.loads[r] == 0 && profile.stores[r] == 0)
+        {
+            continue;
+        }
+        std::string name = r == PC ? "pc" : r == SP ? "sp" : "x" + std::to_string(r);
+        snprintf(line, sizeof(line), "%-4s %14llu %14llu\n", name.c_str(),
+                 static_cast<unsigned long long>(profile.loads[r]), static_cast<unsigned long long>(profile.stores[r]));
+        out += line;
+    }
+
+    out += "# by address: address, count, share\n";
+    for (uint64_t index = 0; index < words; index++)
+    {
+        uint64_t count = profile.executions[index];
+        if (count == 0)
+        {
+            continue;
+        }
+        snprintf(line, sizeof(line), " %llu %.2f%%\n", static_cast<unsigned long long>(count), percent(count));
+        out += describe(index * 4, map);
+        out += line;
+    }
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(out.data(), out.size());
+    file.close();
+    if (!file)
+    {
+        formatError("Unable to write profile '" + path + "'");
+    }
+}
+
+// Phases reported by --stats
+enum Phase
+{
+    LOAD,
+    RUN,
+    REPORT,
+    PHASE_COUNT
+};
+const char *const PHASE_NAMES[PHASE_COUNT] = {"load", "run", "report"};
+
+void _main(int argc, char *argv[])
+{
+    uint64_t entry = 0;
+    uint64_t memoryBytes = 64 << 20;
+    uint64_t maxSteps = UINT64_MAX;
+    bool statsFlag = false;
+    std::string profilePath;
+    std::string tracePath;
+    std::string symbolMapPath;
+    std::string engine;
+    std::vector<std::pair<int, uint64_t>> initial;
+    std::string path = "-";
+    int files = 0;
+    bool usage = false;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        std::string value = i + 1 < argc ? argv[i + 1] : "";
+        uint64_t number = 0;
+        if ((arg == "--entry" || arg == "--memory" || arg == "--max-steps") && i + 1 < argc)
+        {
+            if (!parseNumber(value, number))
+            {
+                formatError("Invalid number for " + arg + ": " + value);
+            }
+            (arg == "--entry" ? entry : arg == "--memory" ? memoryBytes : maxSteps) = number;
+            i++;
+        }
+        else if (arg == "--reg" && i + 1 < argc)
+        {
+            // xN=VALUE or sp=VALUE
+            size_t equals = value.find('=');
+            std::string name = value.substr(0, equals);
+            uint64_t index = 0;
+            bool valid = equals != std::string::npos && parseNumber(value.substr(equals + 1), number);
+            if (valid && name == "sp")
+            {
+                index = SP;
+            }
+            else if (!valid || name.size() < 2 || name[0] != 'x' || !parseNumber(name.substr(1), index) || index > 30)
+            {
+                formatError("Invalid register assignment: " + value);
+            }
+            initial.emplace_back(index, number);
+            i++;
+        }
+        else if ((arg == "--profile" || arg == "--trace" || arg == "--symbol-map") && i + 1 < argc)
+        {
+            (arg == "--profile" ? profilePath : arg == "--trace" ? tracePath : symbolMapPath) = value;
+            i++;
+        }
+        else if (arg == "--engine" && i + 1 < argc && (value == "ops" || value == "blocks"))
+        {
+            engine = value;
+            i++;
+        }
+        else if (arg == "--stats")
+        {
+            statsFlag = true;
+        }
+        else if (arg.starts_with("--") || files++ > 0)
+        {
+            usage = true;
+        }
+        else
+        {
+            path = arg;
+        }
+    }
+    bool profiling = !profilePath.empty() || !tracePath.empty();
+    if ((!symbolMapPath.empty() && profilePath.empty()) || (profiling && engine == "blocks"))
+    {
+        usage = true;
+    }
+    if (usage)
+    {
+        std::cerr << "Usage:" << std::endl
+                  << "\tasm-sim [--engine ops|blocks] [--entry ADDRESS] [--memory BYTES] [--max-steps N] "
+                  << "[--reg xN=VALUE]... [--profile REPORT [--symbol-map MAP]] [--trace TRACE] [--stats] [FILE]"
+                  << std::endl
+                  << std::endl
+                  << "Run machine code produced by asm or asm-tokenizer, read from FILE (or standard in "
+                  << "if FILE is unspecified or `-`), and print the final registers." << std::endl
+                  << "The program is loaded at address 0 of a zeroed memory of BYTES (default 64 MiB); sp "
+                  << "starts at its end and x30 at the end of the program, so `br x30` or running off the "
+                  << "end stops it." << std::endl
+                  << "With --max-steps, stop at the first branch after N instructions." << std::endl
+                  << "--engine blocks (the default) translates each basic block once and chains blocks "
+                  << "together; --engine ops interprets one predecoded instruction at a time, and is "
+                  << "what --profile and --trace use." << std::endl
+                  << "With --reg, set a register before running; repeatable." << std::endl
+                  << "With --profile, write instruction counts by class, label, b.cond outcome, memory base "
+                  << "register and address to REPORT, naming addresses by the labels in MAP from "
+                  << "`asm-tokenizer --symbol-map`." << std::endl
+                  << "With --trace, write where every branch executed went to TRACE (format in asm-sim.cpp)."
+                  << std::endl;
+        exit(1);
+    }
+
+    Stats stats("asm-sim", PHASE_NAMES, PHASE_COUNT, Stats::requested(statsFlag));
+    Stats::Time time = stats.now();
+    int fd = STDIN_FILENO;
+    if (path != "-")
+    {
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            formatError("File '" + path + "' not found!");
+        }
+    }
+    std::string code;
+    char block[1 << 16];
+    ssize_t n;
+    while ((n = read(fd, block, sizeof(block))) > 0)
+    {
+        code.append(block, n);
+    }
+
+    Machine machine(code, memoryBytes);
+    for (const auto &[index, value] : initial)
+    {
+        machine.reg(index) = value;
+    }
+    Profile profile;
+    if (!tracePath.empty())
+    {
+        profile.startTrace(tracePath, entry);
+    }
+    time = stats.add(LOAD, time);
+    uint64_t steps = 0;
+    if (profiling || engine == "ops")
+    {
+        steps = machine.run(entry, maxSteps, profiling ? &profile : nullptr);
+    }
+    else
+    {
+        steps = machine.runBlocks(entry, maxSteps);
+        stats.count("blocks_translated", machine.blocksTranslated);
+        stats.count("fused_ops", machine.fusedOps);
+        stats.count("blocks_invalidated", machine.blocksInvalidated);
+    }
+    time = stats.add(RUN, time);
+    if (!profilePath.empty())
+    {
+        std::unique_ptr<symbolmap::Map> map;
+        if (!symbolMapPath.empty())
+        {
+            map = std::make_unique<symbolmap::Map>(symbolMapPath);
+        }
+        writeProfile(profilePath, machine, profile, steps, map.get());
+        stats.add(REPORT, time);
+    }
+    stats.count("code_bytes", code.size());
+    stats.count("instructions", steps);
+
+    std::string out;
+    char line[64];
+    for (int r = 0; r <= 31; r++)
+    {
+        uint64_t value = machine.reg(r == 31 ? SP : r);
+        snprintf(line, sizeof(line), "%-4s 0x%016llx %lld\n", r == 31 ? "sp" : ("x" + std::to_string(r)).c_str(),
+                 static_cast<unsigned long long>(value), static_cast<long long>(value));
+        out += line;
+    }
+    unsigned flags = machine.nzcv();
+    snprintf(line, sizeof(line), "nzcv %u%u%u%u\n", flags >> 3 & 1, flags >> 2 & 1, flags >> 1 & 1, flags & 1);
+    out += line;
+    out += "instructions " + std::to_string(steps) + (machine.finished() ? "" : " (stopped by --max-steps)") + "\n";
+    std::cout << out;
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        _main(argc, argv);
+        return 0;
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+}
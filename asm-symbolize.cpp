@@ -0,0 +1,112 @@
+#include <charconv>
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "asm-symbols.h"
+
+/** Looks up addresses in a symbol map written by `asm-tokenizer --symbol-map` or
+ *  `asm-link --symbol-map`, printing the label that contains each one.
+ */
+
+void formatError(const std::string &message)
+{
+    throw std::runtime_error(message);
+}
+
+/** Parses a decimal or 0x-prefixed hex address */
+bool parseAddress(const std::string &text, uint64_t &address)
+{
+    int base = 10;
+    size_t start = 0;
+    if (text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X'))
+    {
+        base = 16;
+        start = 2;
+    }
+    const char *end = text.data() + text.size();
+    auto [ptr, error] = std::from_chars(text.data() + start, end, address, base);
+    return error == std::errc() && ptr == end && start < text.size();
+}
+
+/** Prints `ADDRESS label+0xOFFSET`, or `ADDRESS ??` if no label contains the address */
+void symbolize(const symbolmap::Map &map, const std::string &text, std::string &out)
+{
+    uint64_t address = 0;
+    if (!parseAddress(text, address))
+    {
+        formatError("Invalid address: " + text);
+    }
+    std::string_view name;
+    uint64_t start = 0;
+    out += text;
+    if (map.lookup(address, name, start))
+    {
+        out += ' ';
+        out += name;
+        out += (std::stringstream() << "+0x" << std::hex << address - start).str();
+    }
+    else
+    {
+        out += " ??";
+    }
+    out += '\n';
+}
+
+void _main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage:" << std::endl
+                  << "\tasm-symbolize MAP [ADDRESS...]" << std::endl
+                  << std::endl
+                  << "Print the label containing each ADDRESS (decimal or 0x hex) as `ADDRESS "
+                  << "label+0xOFFSET`, or `ADDRESS ??` outside every label." << std::endl
+                  << "Without addresses, read them from standard in, one per line." << std::endl;
+        exit(1);
+    }
+
+    symbolmap::Map map(argv[1]);
+    std::string out;
+    if (argc > 2)
+    {
+        for (int i = 2; i < argc; i++)
+        {
+            symbolize(map, argv[i], out);
+        }
+    }
+    else
+    {
+        std::string line;
+        while (std::getline(std::cin, line))
+        {
+            if (!line.empty())
+            {
+                symbolize(map, line, out);
+            }
+            if (out.size() >= 1 << 16)
+            {
+                std::cout << out;
+                out.clear();
+            }
+        }
+    }
+    std::cout << out;
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        _main(argc, argv);
+        return 0;
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,181 @@
+#ifndef ASM_SYMBOLS_H
+#define ASM_SYMBOLS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Symbol maps: a program's labels sorted by address, written by `asm-tokenizer --symbol-map` and
+ *  `asm-link --symbol-map` for profilers and symbolizers.  The file is used in place through mmap,
+ *  so opening one costs nothing per label and a lookup is a binary search:
+ *
+ *      "ASYMMAP1"          magic; the last byte is the format version
+ *      u64 count           number of labels
+ *      u64 codeBytes       size of the program, where the last label ends
+ *      u64 stringBytes     size of the string pool
+ *      entries             [u64 address][u32 name][u32 length] per label, by address
+ *      string pool         the names, each at its entry's `name` offset
+ *
+ *  Labels at the same address keep their definition order.  Integers are little-endian, and the
+ *  entries are 8-byte aligned in the file.
+ */
+namespace symbolmap
+{
+
+const char MAGIC[8] = {'A', 'S', 'Y', 'M', 'M', 'A', 'P', '1'};
+
+struct Header
+{
+    char magic[8];
+    uint64_t count;
+    uint64_t codeBytes;
+    uint64_t stringBytes;
+};
+
+struct Entry
+{
+    uint64_t address;
+    uint32_t name;
+    uint32_t length;
+};
+
+/** Writes the map of `labels`, given as name and address in definition order, to `path`.  Throws
+ *  std::runtime_error if the file cannot be written. */
+inline void write(const std::string &path, std::vector<std::pair<std::string_view, uint64_t>> labels,
+                  uint64_t codeBytes)
+{
+    std::stable_sort(labels.begin(), labels.end(),
+                     [](const auto &a, const auto &b) { return a.second < b.second; });
+    std::vector<Entry> entries;
+    entries.reserve(labels.size());
+    std::string strings;
+    for (const auto &[name, address] : labels)
+    {
+        entries.push_back({address, static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(name.size())});
+        strings += name;
+    }
+
+    Header header;
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.count = entries.size();
+    header.codeBytes = codeBytes;
+    header.stringBytes = strings.size();
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(entries.data()), entries.size() * sizeof(Entry));
+    out.write(strings.data(), strings.size());
+    out.close();
+    if (!out)
+    {
+        throw std::runtime_error("Unable to write symbol map '" + path + "'");
+    }
+}
+
+/** A symbol map opened in place */
+class Map
+{
+public:
+    /** Maps the file at `path`.  Throws std::runtime_error if it is missing or not a complete map. */
+    explicit Map(const std::string &path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            throw std::runtime_error("File '" + path + "' not found!");
+        }
+        size = st.st_size;
+        if (size >= sizeof(Header))
+        {
+            mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (mapped == MAP_FAILED)
+        {
+            throw std::runtime_error("'" + path + "' is not a symbol map");
+        }
+
+        const char *data = static_cast<const char *>(mapped);
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0)
+        {
+            throw std::runtime_error("'" + path + "' is not a symbol map");
+        }
+        uint64_t tables = size - sizeof(Header);
+        if (header.count > tables / sizeof(Entry) ||
+            header.stringBytes != tables - header.count * sizeof(Entry))
+        {
+            throw std::runtime_error("Truncated symbol map '" + path + "'");
+        }
+        entries = reinterpret_cast<const Entry *>(data + sizeof(Header));
+        strings = data + sizeof(Header) + header.count * sizeof(Entry);
+    }
+
+    ~Map()
+    {
+        if (mapped != MAP_FAILED)
+        {
+            munmap(mapped, size);
+        }
+    }
+
+    Map(const Map &) = delete;
+    Map &operator=(const Map &) = delete;
+
+    uint64_t count() const { return header.count; }
+    uint64_t codeBytes() const { return header.codeBytes; }
+
+    /** Finds the label that contains `address`: the last one at or before it, as long as it is
+     *  inside the program.
+     *
+     * @return false if no label contains `address`
+     */
+    bool lookup(uint64_t address, std::string_view &name, uint64_t &labelAddress) const
+    {
+        if (address >= header.codeBytes)
+        {
+            return false;
+        }
+        const Entry *end = entries + header.count;
+        const Entry *after = std::upper_bound(entries, end, address,
+                                              [](uint64_t value, const Entry &entry) { return value < entry.address; });
+        if (after == entries)
+        {
+            return false;
+        }
+        const Entry &entry = after[-1];
+        if (entry.name > header.stringBytes || entry.length > header.stringBytes - entry.name)
+        {
+            return false;
+        }
+        name = std::string_view(strings + entry.name, entry.length);
+        labelAddress = entry.address;
+        return true;
+    }
+
+private:
+    void *mapped = MAP_FAILED;
+    size_t size = 0;
+    Header header;
+    const Entry *entries = nullptr;
+    const char *strings = nullptr;
+};
+
+} // namespace symbolmap
+
+#endif
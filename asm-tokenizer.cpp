@@ -1,11 +1,38 @@
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <map>
+#include <set>
 #include <cstdint>
+#include <deque>
+#include <unordered_map>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "asm-cache.h"
+#include "asm-encode.h"
+#include "asm-lexer.h"
+#include "asm-object.h"
+#include "asm-symbols.h"
+#include "stats.h"
+
 /** Prints an error to stderr with an "ERROR: " prefix, and newline suffix. Terminates the program with an error.
  *
  * @param message The error to print
@@ -31,19 +58,30 @@ enum TokenType
     COMMA,
     LBRACK,
     RBRACK,
-    NEWLINE
+    NEWLINE,
+    // A double-quoted string, quotes included (the file name of .incbin)
+    STRING
 };
 
 struct Token
 {
     TokenType type;
-    std::string lexeme;
+
+    // Points into the input (or its string table).  Empty for REG, ZREG, INT and HEXINT tokens read
+    // from the binary format, which is why those are only ever used through `value`.
+    std::string_view lexeme;
+
+    // Register number for REG and ZREG, the integer for INT and HEXINT, parsed once when read.  For
+    // the `.cond` of a b.cond, RELAXED_BRANCH once the layout has relaxed it (see relaxBranches).
+    int64_t value;
 };
 
+const int64_t RELAXED_BRANCH = 1;
+
 #define TOKEN_TYPE_READER(t) \
     if (s == #t)             \
     return t
-TokenType stringToTokenType(const std::string &s)
+TokenType stringToTokenType(std::string_view s)
 {
     TOKEN_TYPE_READER(DOTID);
     TOKEN_TYPE_READER(LABEL);
@@ -56,6 +94,7 @@ TokenType stringToTokenType(const std::string &s)
     TOKEN_TYPE_READER(LBRACK);
     TOKEN_TYPE_READER(RBRACK);
     TOKEN_TYPE_READER(NEWLINE);
+    TOKEN_TYPE_READER(STRING);
     return NONE;
 }
 #undef TOKEN_TYPE_READER
@@ -78,6 +117,7 @@ std::string tokenTypeToString(const TokenType &t)
         TOKEN_TYPE_PRINTER(LBRACK);
         TOKEN_TYPE_PRINTER(RBRACK);
         TOKEN_TYPE_PRINTER(NEWLINE);
+        TOKEN_TYPE_PRINTER(STRING);
     default:
         formatError("Unrecognized token type");
         return "";
@@ -92,33 +132,8 @@ std::ostream &operator<<(std::ostream &out, const Token token)
     return out;
 }
 
-std::istream &operator>>(std::istream &in, Token &token)
-{
-    std::string tokenType;
-    in >> tokenType;
-    token.type = stringToTokenType(tokenType);
-    if (token.type != NEWLINE)
-    {
-        in >> token.lexeme;
-    }
-    else
-    {
-        token.lexeme = "";
-    }
-    return in;
-}
-
-static uint32_t imm_mod_two(int imm, uint32_t mod)
-{
-    long long x = static_cast<long long>(imm);
-    long long m = static_cast<long long>(mod);
-    long long r = x % m;
-    if (r < 0)
-        r += m;
-    return static_cast<uint32_t>(r);
-}
 
-static uint32_t bswap32_arith(uint32_t enc)
+static constexpr uint32_t bswap32_arith(uint32_t enc)
 {
     uint32_t b0 = enc % 256u;
     uint32_t b1 = (enc / 256u) % 256u;
@@ -128,21 +143,14 @@ static uint32_t bswap32_arith(uint32_t enc)
     return b0 * 16777216u + b1 * 65536u + b2 * 256u + b3;
 }
 
-static uint32_t enc_r3_arith(uint32_t base, int rd, int rn, int rm)
-{
-    return base + static_cast<uint32_t>(rm) * 65536u // 2^16
-           + static_cast<uint32_t>(rn) * 32u         // 2^5
-           + static_cast<uint32_t>(rd);
-}
-
-static bool decodeBCond(const std::string &instruction, uint32_t &cond)
+static bool decodeBCond(std::string_view instruction, uint32_t &cond)
 {
     if (instruction.size() < 4 || instruction[0] != 'b' || instruction[1] != '.')
     {
         return false;
     }
 
-    const std::string suffix = instruction.substr(2);
+    const std::string_view suffix = instruction.substr(2);
     if (suffix == "eq")
         cond = 0u;
     else if (suffix == "ne")
@@ -169,7 +177,27 @@ static bool decodeBCond(const std::string &instruction, uint32_t &cond)
     return true;
 }
 
-static bool instructionAllowsLabelOperand(const std::string &instruction)
+static bool isMoveWide(std::string_view instruction)
+{
+    return instruction == "movz" || instruction == "movk" || instruction == "movn";
+}
+
+/** The b.cond that branches when `instruction` (a b.cond) does not */
+static std::string_view invertBCond(std::string_view instruction)
+{
+    static const std::string_view PAIRS[][2] = {
+        {"b.eq", "b.ne"}, {"b.hs", "b.lo"}, {"b.hi", "b.ls"}, {"b.ge", "b.lt"}, {"b.gt", "b.le"}};
+    for (const auto &pair : PAIRS)
+    {
+        if (instruction == pair[0])
+            return pair[1];
+        if (instruction == pair[1])
+            return pair[0];
+    }
+    return instruction;
+}
+
+static bool instructionAllowsLabelOperand(std::string_view instruction)
 {
     if (instruction == "b")
     {
@@ -179,489 +207,2474 @@ static bool instructionAllowsLabelOperand(const std::string &instruction)
     return decodeBCond(instruction, cond);
 }
 
-bool compileLine(uint32_t &word, const std::string &instruction, int one, int two, int three)
+/** Why compileLine rejected an instruction.  Encoding reports these instead of throwing, and the
+ *  message is only built, by encodeErrorMessage, for a line that actually fails.
+ */
+enum EncodeError
 {
-    uint32_t enc = 0;
+    ENCODE_OK,
+    IMMEDIATE_RANGE,
+    IMMEDIATE_ALIGNMENT,
+    SHIFT_AMOUNT,
+    UNKNOWN_INSTRUCTION
+};
+
+/** The message for an error from compileLine, where `operand` is the value it rejected */
+std::string encodeErrorMessage(EncodeError error, std::string_view instruction, int operand)
+{
+    std::string name(instruction);
+    switch (error)
+    {
+    case IMMEDIATE_RANGE:
+        return name + " immediate out of range : " + std::to_string(operand);
+    case IMMEDIATE_ALIGNMENT:
+        return name + " immediate must be a multiple of 4 bytes: " + std::to_string(operand);
+    case SHIFT_AMOUNT:
+        return name + " shift must be 0, 16, 32 or 48: " + std::to_string(operand);
+    case UNKNOWN_INSTRUCTION:
+        return "Unknown instruction: " + name;
+    default:
+        return "";
+    }
+}
+
+/** Encodes one instruction from its operands without allocating or throwing, with the encoder
+ *  shared with asm and the assembler library (arm64::detail::encodeFields).
+ *
+ * @param[out] word The machine code, byte-swapped for output
+ * @param[out] operand On error, the operand value that was rejected
+ * @return ENCODE_OK, or why the instruction cannot be encoded
+ */
+EncodeError compileLine(uint32_t &word, std::string_view instruction, int one, int two, int three, int &operand)
+{
+    arm64::detail::InstructionInfo info;
+    if (!arm64::detail::lookupInstruction(instruction, info))
+    {
+        return UNKNOWN_INSTRUCTION;
+    }
 
-    if (instruction == "add")
+    const int64_t values[3] = {one, two, three};
+    uint32_t enc = 0;
+    size_t rejected = 0;
+    switch (arm64::detail::encodeFields(info, values, enc, rejected))
     {
-        enc = enc_r3_arith(0x8B206000u, one, two, three);
+    case arm64::Error::None:
+        break;
+    case arm64::Error::ImmediateAlignment:
+        operand = values[rejected];
+        return IMMEDIATE_ALIGNMENT;
+    default:
+        operand = values[rejected];
+        return info.kind == arm64::detail::Kind::MoveWide && rejected == 2 ? SHIFT_AMOUNT : IMMEDIATE_RANGE;
     }
-    else if (instruction == "br")
+
+    word = bswap32_arith(enc);
+    return ENCODE_OK;
+}
+
+/** Parses all of `text` as a number with std::from_chars, which neither allocates nor throws */
+template <typename T>
+static bool parseNumber(std::string_view text, T &value, int base = 10)
+{
+    const char *end = text.data() + text.size();
+    auto [ptr, error] = std::from_chars(text.data(), end, value, base);
+    return error == std::errc() && ptr == end;
+}
+
+/** Parses an INT or HEXINT lexeme.  Values from 2^63 to 2^64 - 1 are accepted and returned as their
+ *  two's complement bit pattern, so that any 64-bit constant can be written in hex or decimal.
+ *  Negative hex (`-0x10`) is down to -2^63.
+ *
+ * @return false if the lexeme is not an integer that fits in 64 bits
+ */
+bool parseInteger(std::string_view lexeme, int64_t &value)
+{
+    if (lexeme.starts_with('#'))
     {
-        enc = 0xD61F0000u + static_cast<uint32_t>(one) * 32u;
+        lexeme.remove_prefix(1); // the optional immediate prefix of ARM syntax
     }
-    else if (instruction == "blr")
+    uint64_t bits = 0;
+    if (lexeme.starts_with("-0x") || lexeme.starts_with("-0X"))
     {
-        enc = 0xD63F0000u + static_cast<uint32_t>(one) * 32u;
+        if (!parseNumber(lexeme.substr(3), bits, 16) || bits > uint64_t(1) << 63)
+        {
+            return false;
+        }
+        bits = 0 - bits;
     }
-    else if (instruction == "cmp")
+    else if (lexeme.starts_with("0x") || lexeme.starts_with("0X"))
     {
-        enc = enc_r3_arith(0xEB206000u, 31, one, two);
+        if (!parseNumber(lexeme.substr(2), bits, 16))
+        {
+            return false;
+        }
     }
-    else if (instruction == "sub")
+    else if (lexeme.starts_with('-'))
     {
-        enc = enc_r3_arith(0xCB206000u, one, two, three);
+        return parseNumber(lexeme, value);
     }
-    else if (instruction == "mul")
+    else if (!parseNumber(lexeme, bits))
     {
-        enc = enc_r3_arith(0x9B007C00u, one, two, three);
+        return false;
     }
-    else if (instruction == "smulh")
+    value = static_cast<int64_t>(bits);
+    return true;
+}
+
+/** Parses a REG or ZREG lexeme (`xN` or `xzr`) into its register number.
+ *
+ * @return false if the lexeme is not a register
+ */
+bool parseRegister(std::string_view lexeme, int64_t &value)
+{
+    if (lexeme == "xzr")
     {
-        enc = enc_r3_arith(0x9B407C00u, one, two, three);
+        value = 31;
+        return true;
     }
-    else if (instruction == "umulh")
+    int number = 0;
+    if (!lexeme.starts_with('x') || !parseNumber(lexeme.substr(1), number))
     {
-        enc = enc_r3_arith(0x9BC07C00u, one, two, three);
+        return false;
     }
-    else if (instruction == "sdiv")
+    value = number;
+    return true;
+}
+
+/** Parses the value of a REG, ZREG, INT or HEXINT token from its lexeme, once, as it is read */
+void parseTokenValue(Token &token)
+{
+    if ((token.type == REG || token.type == ZREG) && !parseRegister(token.lexeme, token.value))
     {
-        enc = enc_r3_arith(0x9AC00C00u, one, two, three);
+        formatError("Invalid register: " + std::string(token.lexeme));
     }
-    else if (instruction == "udiv")
+    if ((token.type == INT || token.type == HEXINT) && !parseInteger(token.lexeme, token.value))
     {
-        enc = enc_r3_arith(0x9AC00800u, one, two, three);
+        formatError("Invalid integer: " + std::string(token.lexeme));
     }
-    else if (instruction == "ldur")
+}
+
+/** The whole input, mapped when it is a regular file and read into memory otherwise.  Token lexemes
+ *  point into it, so it must outlive the tokens.
+ */
+class Input
+{
+public:
+    explicit Input(int fd)
     {
-        int imm = three;
-        if (imm < -256 || imm > 255)
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
         {
-            formatError("ldur immediate out of range : " + std::to_string(imm));
-            return false;
+            mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        if (mapped != MAP_FAILED)
+        {
+            length = st.st_size;
+            madvise(mapped, length, MADV_SEQUENTIAL);
+            begin = static_cast<const char *>(mapped);
+            return;
+        }
+        char block[1 << 16];
+        ssize_t n;
+        while ((n = read(fd, block, sizeof(block))) > 0)
+        {
+            buffer.insert(buffer.end(), block, block + n);
         }
-        uint32_t imm9 = imm_mod_two(imm, 512u);
-        enc = 0xF8400000u + imm9 * 4096u + static_cast<uint32_t>(two) * 32u + static_cast<uint32_t>(one);
+        begin = buffer.data();
+        length = buffer.size();
     }
-    else if (instruction == "stur")
+
+    ~Input()
     {
-        int imm = three;
-        if (imm < -256 || imm > 255)
+        if (mapped != MAP_FAILED)
         {
-            formatError("stur immediate out of range : " + std::to_string(imm));
-            return false;
+            munmap(mapped, length);
         }
-        uint32_t imm9 = imm_mod_two(imm, 512u);
-        enc = 0xF8000000u + imm9 * 4096u + static_cast<uint32_t>(two) * 32u + static_cast<uint32_t>(one);
     }
-    else if (instruction == "ldr")
+
+    Input(const Input &) = delete;
+    Input &operator=(const Input &) = delete;
+
+    const char *data() const { return begin; }
+    size_t size() const { return length; }
+
+private:
+    void *mapped = MAP_FAILED;
+    std::vector<char> buffer;
+    const char *begin = nullptr;
+    size_t length = 0;
+};
+
+/** Parses the text token at data[pos]: a `TYPE lexeme` pair separated by whitespace (NEWLINE has no
+ *  lexeme).  The lexeme is a view into `data`; registers and integers are parsed here, once.
+ *
+ * @param atEnd Whether `data` holds the rest of the input.  If not, a word that runs up to `size`
+ *     may continue past it, so it is not taken.
+ * @return false, leaving pos unchanged, if data ends before the token does
+ */
+bool readTextToken(const char *data, size_t size, size_t &pos, bool atEnd, Token &token)
+{
+    size_t next = pos;
+    auto nextWord = [&](std::string_view &word)
     {
-        int imm = two;
-        if ((imm % 4) != 0)
+        while (next < size && std::isspace(static_cast<unsigned char>(data[next])))
         {
-            formatError("ldr immediate must be a multiple of 4 bytes: " + std::to_string(imm));
-            return false;
+            next++;
         }
-        int imm19_signed = imm / 4;
-        if (imm19_signed < -262144 || imm19_signed > 262143)
+        size_t start = next;
+        while (next < size && !std::isspace(static_cast<unsigned char>(data[next])))
         {
-            formatError("ldr immediate out of range : " + std::to_string(imm));
-            return false;
+            next++;
         }
-        uint32_t imm19 = imm_mod_two(imm19_signed, 524288u);
-        enc = 0x58000000u + imm19 * 32u + static_cast<uint32_t>(one);
+        word = std::string_view(data + start, next - start);
+        return !word.empty() && (next < size || atEnd);
+    };
+
+    std::string_view word;
+    if (!nextWord(word))
+    {
+        return false;
     }
-    else if (instruction == "b")
+    token = {stringToTokenType(word), std::string_view(), 0};
+    if (token.type != NEWLINE && !nextWord(token.lexeme))
     {
-        int imm = one;
-        if ((imm % 4) != 0)
-        {
-            formatError("b immediate must be a multiple of 4 bytes: " + std::to_string(imm));
-            return false;
-        }
-        int imm26_signed = imm / 4;
-        if (imm26_signed < -33554432 || imm26_signed > 33554431)
+        return false; // at the very end, a type with no lexeme is ignored
+    }
+    if (token.type == NONE)
+    {
+        formatError("Invalid token type");
+    }
+    parseTokenValue(token);
+    pos = next;
+    return true;
+}
+
+/** Reads the text token format from a buffer holding the whole input */
+void readTextTokens(const char *data, size_t size, std::vector<Token> &tokens)
+{
+    tokens.reserve(size / 8);
+    size_t pos = 0;
+    Token token;
+    while (readTextToken(data, size, pos, true, token))
+    {
+        tokens.push_back(token);
+    }
+}
+
+/** Token type for each state of the source lexer: the name of an accepting state up to its first
+ *  '.', so `ID.x` (an `x` that may still become a register) is an ID.  Non-accepting states, and
+ *  WHITESPACE and COMMENT, are NONE.
+ */
+const std::array<TokenType, ASM_LEXER_STATE_COUNT> &sourceTokenTypes()
+{
+    static const std::array<TokenType, ASM_LEXER_STATE_COUNT> types = []
+    {
+        std::array<TokenType, ASM_LEXER_STATE_COUNT> types;
+        for (int state = 0; state < ASM_LEXER_STATE_COUNT; state++)
         {
-            formatError("b immediate out of range : " + std::to_string(imm));
-            return false;
+            std::string_view name = ASM_LEXER_STATE_NAMES[state];
+            types[state] = ASM_LEXER_ACCEPTING[state] ? stringToTokenType(name.substr(0, name.find('.'))) : NONE;
         }
-        uint32_t imm26 = imm_mod_two(imm26_signed, 67108864u);
-        enc = 0x14000000u + imm26;
-    }
-    else
+        return types;
+    }();
+    return types;
+}
+
+/** Lexes the next token of ARM64 source at data[pos], skipping whitespace and comments.  Tokens
+ *  are matched by maximal munch with the DFA in asm-lexer.h, generated from asm-lexer.dfa: the
+ *  longest prefix that ends in an accepting state.  The result is what the external tokenizer would
+ *  have produced for the same source (`b.ne` is an ID and a DOTID, `xzr` a ZREG, `sp` an ID).
+ *
+ * @param atEnd Whether `data` holds the rest of the input.  If not, a token that runs up to `size`
+ *     may continue past it, so it is not taken.
+ * @return false, leaving pos unchanged, if data ends before the token does
+ */
+bool readSourceToken(const char *data, size_t size, size_t &pos, bool atEnd, Token &token)
+{
+    const std::array<TokenType, ASM_LEXER_STATE_COUNT> &types = sourceTokenTypes();
+    size_t next = pos;
+    while (next < size)
     {
-        uint32_t cond = 0;
-        if (decodeBCond(instruction, cond))
+        int state = 0;
+        int accepted = -1;
+        size_t end = next;
+        size_t i = next;
+        while (i < size && (state = ASM_LEXER_TRANSITIONS[state][static_cast<unsigned char>(data[i])]) >= 0)
         {
-            int imm = one;
-            if ((imm % 4) != 0)
+            i++;
+            if (ASM_LEXER_ACCEPTING[state])
             {
-                formatError(instruction + " immediate must be a multiple of 4 bytes: " + std::to_string(imm));
-                return false;
+                accepted = state;
+                end = i;
             }
-            int imm19_signed = imm / 4;
-            if (imm19_signed < -262144 || imm19_signed > 262143)
+        }
+        if (i == size && !atEnd)
+        {
+            return false;
+        }
+        if (accepted < 0)
+        {
+            unsigned char c = data[next];
+            formatError(std::isprint(c) ? "Unexpected character '" + std::string(1, c) + "'"
+                                        : (std::stringstream() << "Unexpected byte " << static_cast<int>(c)).str());
+        }
+        std::string_view lexeme(data + next, end - next);
+        if ((types[accepted] == INT || types[accepted] == HEXINT) && end < size &&
+            (std::isalnum(static_cast<unsigned char>(data[end])) || data[end] == '_'))
+        {
+            // `-0x10` must not lex as `-0` and `x10`, nor `12ab` as `12` and `ab`
+            size_t stop = end;
+            while (stop < size && (std::isalnum(static_cast<unsigned char>(data[stop])) || data[stop] == '_'))
             {
-                formatError(instruction + " immediate out of range : " + std::to_string(imm));
-                return false;
+                stop++;
             }
-            uint32_t imm19 = imm_mod_two(imm19_signed, 524288u);
-            enc = 0x54000000u + imm19 * 32u + cond;
+            formatError("Invalid integer: " + std::string(data + next, stop - next));
         }
-        else
+        next = end;
+        if (types[accepted] == NONE)
         {
-            formatError("Unknown instruction: " + instruction);
-            return false;
+            continue; // whitespace or a comment
         }
+        token = {types[accepted], types[accepted] == NEWLINE ? std::string_view() : lexeme, 0};
+        parseTokenValue(token);
+        pos = next;
+        return true;
     }
-
-    word = bswap32_arith(enc);
-    return true;
+    return false;
 }
 
-int64_t parseInteger(const std::string &lexeme)
+/** Lexes ARM64 source from a buffer holding the whole input */
+void readSourceTokens(const char *data, size_t size, std::vector<Token> &tokens)
 {
-    if (lexeme.substr(0, 2) == "0x" || lexeme.substr(0, 2) == "0X")
+    tokens.reserve(size / 4);
+    size_t pos = 0;
+    Token token;
+    while (readSourceToken(data, size, pos, true, token))
     {
-        return std::stoll(lexeme.substr(2), nullptr, 16);
+        tokens.push_back(token);
     }
-    return std::stoll(lexeme);
 }
 
-int parseRegister(const std::string &lexeme)
+/** Binary token format, written by `--write-tokens` and recognized by its magic:
+ *
+ *      "ATOKENS1"          magic
+ *      u64 tokenCount
+ *      u64 stringBytes     size of the string table
+ *      string table        [u32 length][bytes] per string; a string's id is its offset in the table
+ *      tokens              [u8 type][payload] per token
+ *
+ *  The payload is a u32 string id for DOTID, LABEL, ID and STRING, a u8 register number for REG and ZREG,
+ *  an i64 for INT and HEXINT, and nothing for the rest.  Each distinct lexeme is stored once and
+ *  numbers are stored parsed, so reading is a bounds check and a copy per token.  Integers are
+ *  little-endian.
+ */
+const char BINARY_MAGIC[8] = {'A', 'T', 'O', 'K', 'E', 'N', 'S', '1'};
+
+const size_t BINARY_HEADER_BYTES = sizeof(BINARY_MAGIC) + 2 * sizeof(uint64_t);
+
+bool isBinaryTokens(const char *data, size_t size)
 {
-    if (lexeme == "xzr")
-        return 31;
-    if (lexeme[0] == 'x')
+    return size >= sizeof(BINARY_MAGIC) && memcmp(data, BINARY_MAGIC, sizeof(BINARY_MAGIC)) == 0;
+}
+
+/** Reads the token count and string table size from a binary header */
+void readBinaryHeader(const char *data, size_t size, uint64_t &count, uint64_t &stringBytes)
+{
+    if (size < BINARY_HEADER_BYTES)
     {
-        return std::stoi(lexeme.substr(1));
+        formatError("Truncated binary token stream");
     }
-    formatError("Invalid register: " + lexeme);
-    return 0;
+    memcpy(&count, data + sizeof(BINARY_MAGIC), sizeof(count));
+    memcpy(&stringBytes, data + sizeof(BINARY_MAGIC) + sizeof(count), sizeof(stringBytes));
 }
 
-/** Takes a tokenization of an ARM64 assembly file as input, then outputs a list of parameters for compileLine,
- * replacing label uses with their respective addresses. Prints label addresses into standard out.
- *
- * If the file is not found, print an error and returns a non-0 value.
+/** Parses the binary token at data[pos].  DOTID, LABEL, ID and STRING lexemes are views into
+ *  `strings`.
  *
- * @return 0 on success, non-0 on error
+ * @return false, leaving pos unchanged, if data ends before the token does
  */
-int _main(int argc, char *argv[])
+bool readBinaryToken(const char *data, size_t size, size_t &pos, std::string_view strings, Token &token)
 {
-    if (argc > 2)
-    {
-        std::cerr << "Usage:" << std::endl
-                  << "\ttokenasm [FILE]" << std::endl
-                  << std::endl
-                  << "If FILE is unspecified or if FILE is `-`, read tokenized assembly from standard "
-                  << "in. Otherwise, read tokenized assembly from FILE." << std::endl;
-        return 1;
-    }
-
-    std::ifstream fp;
-    std::istream &in =
-        (argc > 1 && std::string(argv[1]) != "-")
-        ? [&]() -> std::istream &
+    size_t next = pos;
+    auto take = [&](void *value, size_t bytes)
     {
-        fp.open(argv[1]);
-        return fp;
-    }()
-        : std::cin;
+        if (size - next < bytes)
+        {
+            return false;
+        }
+        memcpy(value, data + next, bytes);
+        next += bytes;
+        return true;
+    };
 
-    if (!fp && argc > 1)
+    uint8_t type = 0;
+    if (!take(&type, sizeof(type)))
     {
-        formatError((std::stringstream() << "File '" << argv[1] << "' not found!").str());
-        return 1;
+        return false;
     }
-    Token currToken;
-    std::vector<Token> tokens;
-    while (!in.eof())
+    token = {static_cast<TokenType>(type), std::string_view(), 0};
+    switch (token.type)
+    {
+    case DOTID:
+    case LABEL:
+    case ID:
+    case STRING:
     {
-        in >> currToken;
-        if (!in.fail())
+        uint32_t id = 0;
+        uint32_t length = 0;
+        if (!take(&id, sizeof(id)))
         {
-            if (currToken.type == NONE)
-            {
-                formatError("Invalid token type");
-            }
-            tokens.push_back(currToken);
+            return false;
+        }
+        if (id > strings.size() || strings.size() - id < sizeof(length))
+        {
+            formatError("Invalid string id in binary token stream");
+        }
+        memcpy(&length, strings.data() + id, sizeof(length));
+        if (length > strings.size() - id - sizeof(length))
+        {
+            formatError("Invalid string id in binary token stream");
         }
+        token.lexeme = strings.substr(id + sizeof(length), length);
+        break;
     }
-
-    // -- YOUR CODE HERE --
-    // You've been given a vector of all the tokens, so you're now free to manipulate and scan all tokens as many times as necessary.
-    // Go ham!
-    // Build symbol table
-    std::map<std::string, int64_t> symTable;
-    std::vector<std::string> label;
-    int64_t current = 0;
-    size_t i = 0;
-
-    while (i < tokens.size())
+    case REG:
+    case ZREG:
     {
-        if (tokens[i].type == NEWLINE)
+        uint8_t reg = 0;
+        if (!take(&reg, sizeof(reg)))
         {
-            i++;
-            continue;
+            return false;
         }
-
-        if (tokens[i].type == LABEL)
+        token.value = reg;
+        break;
+    }
+    case INT:
+    case HEXINT:
+        if (!take(&token.value, sizeof(token.value)))
         {
-            std::string labelName = tokens[i].lexeme;
-            if (labelName.back() == ':')
-            {
-                labelName = labelName.substr(0, labelName.length() - 1);
-            }
-            symTable[labelName] = current;
-            label.push_back(labelName);
-            i++;
-            if (i < tokens.size() && tokens[i].type != NEWLINE)
-            {
-                formatError("Must be followed by NEWLINE or be at end");
-            }
-            if (i < tokens.size())
-            {
-                i++;
-            }
-            continue;
+            return false;
         }
+        break;
+    case COMMA:
+        token.lexeme = ",";
+        break;
+    case LBRACK:
+        token.lexeme = "[";
+        break;
+    case RBRACK:
+        token.lexeme = "]";
+        break;
+    case NEWLINE:
+        break;
+    default:
+        formatError("Invalid token type");
+    }
+    pos = next;
+    return true;
+}
 
-        if (i >= tokens.size())
-        {
-            break;
-        }
-        if (tokens[i].type == NEWLINE)
+/** Reads the binary token format in place: lexemes are views into the string table in `data`. */
+void readBinaryTokens(const char *data, size_t size, std::vector<Token> &tokens)
+{
+    uint64_t count = 0;
+    uint64_t stringBytes = 0;
+    readBinaryHeader(data, size, count, stringBytes);
+    size_t pos = BINARY_HEADER_BYTES;
+    if (stringBytes > size - pos)
+    {
+        formatError("Truncated binary token stream");
+    }
+    std::string_view strings(data + pos, stringBytes);
+    pos += stringBytes;
+    tokens.reserve(std::min<uint64_t>(count, size - pos));
+
+    Token token;
+    while (pos < size)
+    {
+        if (!readBinaryToken(data, size, pos, strings, token))
         {
-            i++;
-            continue;
+            formatError("Truncated binary token stream");
         }
+        tokens.push_back(token);
+    }
+}
 
-        TokenType type = tokens[i].type;
+/** Writes tokens in the binary format, interning every DOTID, LABEL and ID lexeme. */
+void writeBinaryTokens(const std::vector<Token> &tokens, std::ostream &out)
+{
+    std::string strings;
+    std::string body;
+    std::unordered_map<std::string_view, uint32_t> ids;
+    auto append = [](std::string &to, const void *value, size_t bytes)
+    {
+        to.append(static_cast<const char *>(value), bytes);
+    };
 
-        if (type == DOTID)
+    for (const Token &token : tokens)
+    {
+        body += static_cast<char>(token.type);
+        if (token.type == DOTID || token.type == LABEL || token.type == ID || token.type == STRING)
         {
-            if (tokens[i].lexeme == ".8byte")
-            {
-                i++;
-                if (i >= tokens.size() || (tokens[i].type != HEXINT && tokens[i].type != INT && tokens[i].type != ID))
-                {
-                    formatError("Expected integer");
-                }
-                i++; // skip the integer
-                current += 8;
-                // Must be followed by NEWLINE or be at end
-                if (i < tokens.size() && tokens[i].type != NEWLINE)
-                {
-                    formatError("Must be followed by NEWLINE or be at end");
-                }
-                if (i < tokens.size())
-                    i++; // skip newline
-            }
-            else
+            auto [entry, inserted] = ids.try_emplace(token.lexeme, static_cast<uint32_t>(strings.size()));
+            if (inserted)
             {
-                formatError("Unknown directive: " + tokens[i].lexeme);
+                uint32_t length = token.lexeme.size();
+                append(strings, &length, sizeof(length));
+                strings += token.lexeme;
             }
+            append(body, &entry->second, sizeof(entry->second));
         }
-        else if (type == ID)
+        else if (token.type == REG || token.type == ZREG)
         {
-            std::string instruction = tokens[i].lexeme;
-            if (instruction.size() > 2 && instruction[0] == 'b' && instruction[1] == '.')
-            {
-                formatError("Conditional branch must be tokenized as ID b followed by DOTID .cond");
-            }
-            i++; // skip instruction
-            if (instruction == "b" && i < tokens.size() && tokens[i].type == DOTID)
+            if (token.value < 0 || token.value > 31)
             {
-                i++;
-            }
-            while (i < tokens.size() && tokens[i].type != NEWLINE)
-            {
-                i++;
+                formatError("Invalid register: " + std::string(token.lexeme));
             }
-            current += 4;
-            if (i < tokens.size())
-                i++; // skip newline
+            body += static_cast<char>(token.value);
         }
-        else
+        else if (token.type == INT || token.type == HEXINT)
         {
-            formatError("Unexpected token: " + tokenTypeToString(type));
+            append(body, &token.value, sizeof(token.value));
         }
     }
 
-    // Output symbol table to stderr
-    for (const auto &label : label)
+    uint64_t header[2] = {tokens.size(), strings.size()};
+    out.write(BINARY_MAGIC, sizeof(BINARY_MAGIC));
+    out.write(reinterpret_cast<const char *>(header), sizeof(header));
+    out << strings << body;
+}
+
+/** One instruction of the sequence that `mov xN, imm64` expands to */
+struct MoveWide
+{
+    const char *instruction; // movz, movn or movk
+    int imm16;
+    int shift;
+};
+
+/** Picks the shortest movz/movn/movk sequence that loads `value`.  Halfwords that already hold the
+ *  right bits after the first instruction are skipped: zero halfwords when starting from movz, and
+ *  0xFFFF halfwords when starting from movn, which is chosen when there are more of the latter.
+ *
+ * @param value The constant to load
+ * @param steps Receives the instructions, in order
+ * @return The number of instructions, from 1 to 4
+ */
+size_t planMov(uint64_t value, MoveWide steps[4])
+{
+    int zeros = 0;
+    int ones = 0;
+    for (int shift = 0; shift < 64; shift += 16)
     {
-        std::cerr << label << " " << symTable[label] << "\n";
+        uint64_t halfword = (value >> shift) & 0xFFFF;
+        zeros += halfword == 0;
+        ones += halfword == 0xFFFF;
     }
 
-    // Second pass: Generate machine code
-    i = 0;
-    current = 0;
+    bool inverted = ones > zeros;
+    uint64_t skip = inverted ? 0xFFFF : 0;
+    size_t count = 0;
+    for (int shift = 0; shift < 64; shift += 16)
+    {
+        uint64_t halfword = (value >> shift) & 0xFFFF;
+        if (halfword == skip)
+        {
+            continue;
+        }
+        if (count == 0)
+        {
+            steps[count++] = {inverted ? "movn" : "movz", static_cast<int>(inverted ? ~halfword & 0xFFFF : halfword),
+                              shift};
+        }
+        else
+        {
+            steps[count++] = {"movk", static_cast<int>(halfword), shift};
+        }
+    }
+    if (count == 0)
+    {
+        // Every halfword is 0 (or 0xFFFF): a single movz/movn of 0 loads it
+        steps[count++] = {inverted ? "movn" : "movz", 0, 0};
+    }
+    return count;
+}
+
+/** Parses the operands of `mov xN, imm64` starting at tokens[i], leaving i on the NEWLINE (or end) */
+void parseMov(const std::vector<Token> &tokens, size_t &i, int &rd, uint64_t &value)
+{
+    if (i >= tokens.size() || (tokens[i].type != REG && tokens[i].type != ZREG))
+    {
+        formatError("mov expects a register and an immediate");
+    }
+    rd = tokens[i++].value;
+    if (i + 1 >= tokens.size() || tokens[i].type != COMMA ||
+        (tokens[i + 1].type != INT && tokens[i + 1].type != HEXINT))
+    {
+        formatError("mov expects a register and an immediate");
+    }
+    value = static_cast<uint64_t>(tokens[i + 1].value);
+    i += 2;
+    if (i < tokens.size() && tokens[i].type != NEWLINE)
+    {
+        formatError("Unexpected token " + std::string(tokens[i].lexeme) + " while processing mov");
+    }
+}
+
+enum Phase
+{
+    READ,
+    FIRST_PASS,
+    SECOND_PASS,
+    SINGLE_PASS,
+    STREAM,
+    WRITE,
+    PHASE_COUNT
+};
+
+/** Phases reported by --stats */
+const char *const PHASE_NAMES[PHASE_COUNT] = {"read", "first_pass", "second_pass", "single_pass", "stream", "write"};
+
+/** Label names interned to dense ids.  Each name is copied once into an arena of large blocks and
+ *  found through a flat open-addressing table of ids keyed by its FNV-1a hash, so a lookup is one
+ *  hash and usually one probe however many labels there are, and memory is a few words per label.
+ *  Addresses are stored by id: once a use has been interned, resolving it is an array index.
+ */
+class SymbolTable
+{
+public:
+    static constexpr uint32_t NO_SYMBOL = UINT32_MAX;
+
+    SymbolTable() : slots(1024, NO_SYMBOL) {}
+
+    /** Returns the id of `name`, adding it as an undefined label if it is new */
+    uint32_t intern(std::string_view name)
+    {
+        uint64_t hash = hashName(name);
+        size_t mask = slots.size() - 1;
+        size_t slot = hash & mask;
+        for (; slots[slot] != NO_SYMBOL; slot = (slot + 1) & mask)
+        {
+            const Symbol &symbol = symbols[slots[slot]];
+            if (symbol.hash == hash && symbol.name == name)
+            {
+                return slots[slot];
+            }
+        }
+        uint32_t id = symbols.size();
+        symbols.push_back({store(name), hash, 0, false});
+        slots[slot] = id;
+        if (symbols.size() * 2 > slots.size())
+        {
+            grow();
+        }
+        return id;
+    }
+
+    /** Sets the address of a label.  Returns false if it was already defined (the address is still
+     *  updated, so the last definition wins). */
+    bool define(uint32_t id, int64_t address)
+    {
+        bool first = !symbols[id].defined;
+        symbols[id].address = address;
+        symbols[id].defined = true;
+        return first;
+    }
+
+    bool defined(uint32_t id) const { return symbols[id].defined; }
+    int64_t address(uint32_t id) const { return symbols[id].address; }
+    std::string_view name(uint32_t id) const { return symbols[id].name; }
+    size_t size() const { return symbols.size(); }
+
+private:
+    static constexpr size_t BLOCK_BYTES = 1 << 20;
+
+    struct Symbol
+    {
+        std::string_view name; // Points into the arena
+        uint64_t hash;
+        int64_t address;
+        bool defined;
+    };
+
+    static uint64_t hashName(std::string_view name)
+    {
+        uint64_t hash = 14695981039346656037ull; // FNV-1a
+        for (char c : name)
+        {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    /** Copies a name into the arena */
+    std::string_view store(std::string_view name)
+    {
+        if (BLOCK_BYTES - blockUsed < name.size())
+        {
+            blocks.push_back(std::make_unique<char[]>(std::max(BLOCK_BYTES, name.size())));
+            blockUsed = 0;
+        }
+        char *copy = blocks.back().get() + blockUsed;
+        memcpy(copy, name.data(), name.size());
+        blockUsed += name.size();
+        return std::string_view(copy, name.size());
+    }
+
+    void grow()
+    {
+        std::vector<uint32_t> bigger(slots.size() * 2, NO_SYMBOL);
+        size_t mask = bigger.size() - 1;
+        for (uint32_t id = 0; id < symbols.size(); id++)
+        {
+            size_t slot = symbols[id].hash & mask;
+            while (bigger[slot] != NO_SYMBOL)
+            {
+                slot = (slot + 1) & mask;
+            }
+            bigger[slot] = id;
+        }
+        slots.swap(bigger);
+    }
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    size_t blockUsed = BLOCK_BYTES;
+    std::vector<Symbol> symbols;
+    std::vector<uint32_t> slots; // Symbol ids; a power of two in size, at most half full
+};
+
+/** Interns the label uses on the line starting at tokens[i], storing each ID operand's symbol id in
+ *  its `value`.  The instruction itself (the first token) is not a label use. */
+void internOperands(std::vector<Token> &tokens, size_t i, SymbolTable &symbols)
+{
+    for (i++; i < tokens.size() && tokens[i].type != NEWLINE; i++)
+    {
+        if (tokens[i].type == ID)
+        {
+            tokens[i].value = symbols.intern(tokens[i].lexeme);
+        }
+    }
+}
+
+/** Prints `name address` for each label definition to stderr.  stderr is unbuffered, so the listing
+ *  is built up first and written at once; with millions of labels, writing it piecewise costs more
+ *  than assembling. */
+void printLabels(const SymbolTable &symbols, const std::vector<uint32_t> &labels)
+{
+    std::string listing;
+    for (uint32_t id : labels)
+    {
+        listing += symbols.name(id);
+        listing += ' ';
+        listing += std::to_string(symbols.address(id));
+        listing += '\n';
+    }
+    std::cerr.write(listing.data(), listing.size());
+}
+
+/** Writes the labels to `path` as a symbol map (see asm-symbols.h), each once, at its final address.
+ *
+ * @param size The size of the program
+ */
+void writeSymbolMap(const std::string &path, const SymbolTable &symbols, const std::vector<uint32_t> &labels,
+                    int64_t size)
+{
+    std::vector<std::pair<std::string_view, uint64_t>> entries;
+    entries.reserve(labels.size());
+    std::vector<bool> written(symbols.size());
+    for (uint32_t id : labels)
+    {
+        if (!written[id])
+        {
+            written[id] = true;
+            entries.emplace_back(symbols.name(id), symbols.address(id));
+        }
+    }
+    symbolmap::write(path, std::move(entries), size);
+}
+
+/** Returns the name of the label defined by a LABEL token */
+std::string_view labelName(const Token &token)
+{
+    std::string_view name = token.lexeme;
+    if (!name.empty() && name.back() == ':')
+    {
+        name.remove_suffix(1);
+    }
+    return name;
+}
+
+/** A data directive other than `.8byte`.  Each is sized from its operands alone (and, for .incbin,
+ *  the file's size), so the first pass never reads the data:
+ *
+ *  - `.incbin "file"[, offset[, length]]`: bytes of a file, by default from offset to its end
+ *  - `.space size[, fill]`: `size` copies of the byte `fill` (default 0)
+ *  - `.fill repeat[, size[, value]]`: `repeat` copies of `value` (default 0) stored little-endian
+ *    in `size` bytes (default 1, at most 8)
+ *  - `.align exponent[, fill]`: bytes `fill` (default 0) up to the next multiple of 2^exponent
+ */
+struct Data
+{
+    std::string path;    // The file to include for .incbin, else empty
+    uint64_t offset = 0; // Where the bytes start in the file
+    uint64_t length = 0; // Size in bytes
+    int unit = 1;        // Bytes of `value` per copy, for the others
+    uint64_t value = 0;
+};
+
+bool isDataDirective(std::string_view name)
+{
+    return name == ".incbin" || name == ".space" || name == ".fill" || name == ".align";
+}
+
+/** Parses the data directive that starts at tokens[i] (a DOTID token) as placed at address
+ *  `current`.  On return, i is past the line's NEWLINE.
+ */
+void parseData(const std::vector<Token> &tokens, size_t &i, int64_t current, Data &data)
+{
+    std::string name(tokens[i].lexeme);
+    bool incbin = name == ".incbin";
+    size_t maxOperands = incbin || name == ".fill" ? 3 : 2;
+    i++;
+
+    // .incbin takes a string then integers, the others only integers, all separated by commas
+    int64_t operands[3] = {0, 0, 0};
+    size_t count = 0;
+    if (incbin)
+    {
+        std::string_view path = i < tokens.size() && tokens[i].type == STRING ? tokens[i].lexeme : "";
+        if (path.size() < 2)
+        {
+            formatError("Expected a file name after .incbin");
+        }
+        data.path = std::string(path.substr(1, path.size() - 2));
+        count = 1;
+        i++;
+    }
+    for (; i < tokens.size() && tokens[i].type != NEWLINE; count++)
+    {
+        if (count > 0)
+        {
+            if (tokens[i].type != COMMA)
+            {
+                formatError("Expected , in " + name);
+            }
+            i++;
+        }
+        if (i >= tokens.size() || (tokens[i].type != INT && tokens[i].type != HEXINT))
+        {
+            formatError("Expected integer in " + name);
+        }
+        if (count == maxOperands)
+        {
+            formatError("Too many operands for " + name);
+        }
+        operands[count - incbin] = tokens[i].value;
+        i++;
+    }
+    if (count == 0)
+    {
+        formatError("Expected integer after " + name);
+    }
+    if (i < tokens.size())
+    {
+        i++; // skip newline
+    }
+
+    if (incbin)
+    {
+        struct stat st;
+        if (stat(data.path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            formatError("Unable to read '" + data.path + "'");
+        }
+        uint64_t size = st.st_size;
+        uint64_t offset = operands[0];
+        if (operands[0] < 0 || offset > size || (count > 2 && (operands[1] < 0 || size - offset < uint64_t(operands[1]))))
+        {
+            formatError(".incbin range is outside '" + data.path + "'");
+        }
+        data.offset = offset;
+        data.length = count > 2 ? operands[1] : size - offset;
+    }
+    else if (name == ".space")
+    {
+        if (operands[0] < 0)
+        {
+            formatError("Invalid size for .space: " + std::to_string(operands[0]));
+        }
+        data.length = operands[0];
+        data.value = operands[1];
+    }
+    else if (name == ".fill")
+    {
+        int64_t size = count > 1 ? operands[1] : 1;
+        if (operands[0] < 0 || size < 1 || size > 8)
+        {
+            formatError("Invalid repeat or size for .fill");
+        }
+        data.unit = size;
+        data.length = operands[0] * size;
+        data.value = operands[2];
+    }
+    else
+    {
+        if (operands[0] < 0 || operands[0] > 30)
+        {
+            formatError("Invalid exponent for .align: " + std::to_string(operands[0]));
+        }
+        uint64_t alignment = uint64_t(1) << operands[0];
+        data.length = (alignment - uint64_t(current) % alignment) % alignment;
+        data.value = operands[1];
+    }
+}
+
+/** Passes each byte of a data directive to emit(char).  Included files are read in blocks; see
+ *  copyData for the copy that avoids user space.
+ */
+template <typename Emit>
+void emitData(const Data &data, Emit emit)
+{
+    if (data.path.empty())
+    {
+        for (uint64_t k = 0; k < data.length; k++)
+        {
+            emit(static_cast<char>(data.value >> (8 * (k % data.unit))));
+        }
+        return;
+    }
+    int fd = open(data.path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        formatError("Unable to read '" + data.path + "'");
+    }
+    char block[1 << 16];
+    for (uint64_t done = 0; done < data.length;)
+    {
+        ssize_t n = pread(fd, block, std::min<uint64_t>(sizeof(block), data.length - done), data.offset + done);
+        if (n <= 0)
+        {
+            close(fd);
+            formatError("'" + data.path + "' changed while assembling");
+        }
+        for (ssize_t k = 0; k < n; k++)
+        {
+            emit(block[k]);
+        }
+        done += n;
+    }
+    close(fd);
+}
+
+/** Copies the bytes of an .incbin to the current position of outFd inside the kernel: with
+ *  copy_file_range when the output is a regular file, else sendfile (pipes, sockets), and only if
+ *  neither is supported, through a buffer.  Anything buffered for outFd must be flushed first.
+ */
+void copyData(const Data &data, int outFd)
+{
+    int fd = open(data.path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        formatError("Unable to read '" + data.path + "'");
+    }
+    enum Method
+    {
+        COPY_FILE_RANGE,
+        SENDFILE,
+        READ_WRITE
+    } method = COPY_FILE_RANGE;
+    off_t offset = data.offset;
+    uint64_t left = data.length;
+    char block[1 << 16];
+    while (left > 0)
+    {
+        size_t chunk = std::min<uint64_t>(left, 1 << 30);
+        ssize_t n;
+        if (method == COPY_FILE_RANGE)
+        {
+            n = copy_file_range(fd, &offset, outFd, nullptr, chunk, 0);
+        }
+        else if (method == SENDFILE)
+        {
+            n = sendfile(outFd, fd, &offset, chunk);
+        }
+        else
+        {
+            n = pread(fd, block, std::min(chunk, sizeof(block)), offset);
+            for (ssize_t written = 0, w; written < n; written += w)
+            {
+                if ((w = write(outFd, block + written, n - written)) <= 0)
+                {
+                    close(fd);
+                    formatError("Unable to write output");
+                }
+            }
+            offset += std::max<ssize_t>(n, 0);
+        }
+        if (n < 0 && method != READ_WRITE)
+        {
+            // Not supported for this pair of files (e.g. EXDEV, EINVAL, or an O_APPEND output)
+            method = static_cast<Method>(method + 1);
+            continue;
+        }
+        if (n <= 0)
+        {
+            close(fd);
+            formatError("'" + data.path + "' changed while assembling");
+        }
+        left -= n;
+    }
+    close(fd);
+}
+
+/** Encodes the directive or instruction that starts at tokens[i] (a DOTID or ID token) as
+ *  placed at address `current`.  Each output byte is passed to emit(char); on return, i is past the
+ *  line's NEWLINE and current is past its bytes.
+ *
+ * @param symbols Label addresses.  The line's label uses must have been interned (internOperands).
+ * @param pending If non-null, an undefined label is not an error: the line is encoded as if the
+ *     label were at `current` and the label's id is stored here, to be patched once defined
+ */
+template <typename Emit>
+void encodeLine(const std::vector<Token> &tokens, size_t &i, int64_t &current, const SymbolTable &symbols,
+                uint32_t *pending, Emit emit)
+{
+    auto lookup = [&](const Token &token)
+    {
+        uint32_t id = token.value;
+        if (symbols.defined(id))
+        {
+            return symbols.address(id);
+        }
+        if (pending == nullptr)
+        {
+            formatError("Undefined label: " + std::string(token.lexeme));
+        }
+        *pending = id;
+        return current;
+    };
+
+    if (tokens[i].type == DOTID && isDataDirective(tokens[i].lexeme))
+    {
+        Data data;
+        parseData(tokens, i, current, data);
+        emitData(data, emit);
+        current += data.length;
+        return;
+    }
+
+    if (tokens[i].type == DOTID)
+    {
+        if (tokens[i].lexeme != ".8byte")
+        {
+            formatError("Unknown directive: " + std::string(tokens[i].lexeme));
+        }
+        i++;
+        if (i >= tokens.size() || (tokens[i].type != HEXINT && tokens[i].type != INT && tokens[i].type != ID))
+        {
+            formatError("Expected integer after .8byte");
+        }
+        int64_t value = tokens[i].type == ID ? lookup(tokens[i]) : tokens[i].value;
+        i++;
+        if (i < tokens.size() && tokens[i].type != NEWLINE)
+        {
+            formatError("Must be followed by NEWLINE or be at end");
+        }
+        // Output 8 bytes in little-endian
+        for (int j = 0; j < 8; ++j)
+        {
+            emit((char)((value >> (j * 8)) & 0xFF));
+        }
+        current += 8;
+        if (i < tokens.size())
+            i++;
+        return;
+    }
+
+    // Nothing below allocates or throws unless the line is invalid (see --check-allocations)
+    std::string_view instruction = tokens[i].lexeme;
+    if (instruction.size() > 2 && instruction[0] == 'b' && instruction[1] == '.')
+    {
+        formatError("Conditional branch must be tokenized as ID b followed by DOTID .cond");
+    }
+    i++;
+
+    // `b` and `.cond` are joined into a local buffer: every condition fits
+    char branchName[8];
+    bool relaxed = false;
+    if (instruction == "b" && i < tokens.size() && tokens[i].type == DOTID)
+    {
+        std::string_view cond = tokens[i].lexeme;
+        relaxed = tokens[i].value == RELAXED_BRANCH;
+        if (cond.size() >= sizeof(branchName) - 1)
+        {
+            formatError("Unknown instruction: b" + std::string(cond));
+        }
+        branchName[0] = 'b';
+        memcpy(branchName + 1, cond.data(), cond.size());
+        instruction = std::string_view(branchName, cond.size() + 1);
+        i++;
+    }
+
+    if (current % 4 != 0)
+    {
+        formatError("Instruction at unaligned address " + std::to_string(current) + " (use .align 2)");
+    }
+
+    auto emitWord = [&](uint32_t machineCode)
+    {
+        emit((char)((machineCode >> 24) & 0xFF));
+        emit((char)((machineCode >> 16) & 0xFF));
+        emit((char)((machineCode >> 8) & 0xFF));
+        emit((char)((machineCode >> 0) & 0xFF));
+        current += 4;
+    };
+    auto compile = [&](std::string_view name, int one, int two, int three)
+    {
+        uint32_t machineCode = 0;
+        int operand = 0;
+        EncodeError error = compileLine(machineCode, name, one, two, three, operand);
+        if (error != ENCODE_OK)
+        {
+            formatError(encodeErrorMessage(error, name, operand));
+        }
+        emitWord(machineCode);
+    };
+
+    if (instruction == "mov")
+    {
+        int rd;
+        uint64_t value;
+        MoveWide steps[4];
+        parseMov(tokens, i, rd, value);
+        size_t count = planMov(value, steps);
+        for (size_t step = 0; step < count; step++)
+        {
+            compile(steps[step].instruction, rd, steps[step].imm16, steps[step].shift);
+        }
+        if (i < tokens.size() && tokens[i].type == NEWLINE)
+            i++;
+        return;
+    }
+
+    // Operands past the third are ignored, as compileLine takes three
+    int params[3] = {0, 0, 0};
+    size_t count = 0;
+    auto push = [&](int value)
+    {
+        if (count < 3)
+        {
+            params[count] = value;
+        }
+        count++;
+    };
+
+    // Parse parameters
+    while (i < tokens.size() && tokens[i].type != NEWLINE)
+    {
+        TokenType t = tokens[i].type;
+
+        if (t == REG || t == ZREG)
+        {
+            push(tokens[i].value);
+            i++;
+        }
+        else if (t == ID && tokens[i].lexeme == "lsl" && isMoveWide(instruction))
+        {
+            // movz x0, 0x1234, lsl 16: the shift amount follows as an INT
+            i++;
+        }
+        else if (t == ID && tokens[i].lexeme == "sp" && !instructionAllowsLabelOperand(instruction))
+        {
+            push(31);
+            i++;
+        }
+        else if (t == INT || t == HEXINT)
+        {
+            push(tokens[i].value);
+            i++;
+        }
+        else if (t == ID)
+        {
+            if (!instructionAllowsLabelOperand(instruction))
+            {
+                formatError("Unexpected token " + std::string(tokens[i].lexeme) + " while processing " +
+                            std::string(instruction));
+            }
+            // Label reference: offset from the current instruction
+            push(lookup(tokens[i]) - current);
+            i++;
+        }
+        else if (t == COMMA)
+        {
+            i++;
+        }
+        else if (t == LBRACK)
+        {
+            i++;
+        }
+        else if (t == RBRACK)
+        {
+            i++;
+        }
+        else
+        {
+            formatError("Unexpected token : " + tokenTypeToString(t));
+        }
+    }
+
+    if (relaxed)
+    {
+        // See relaxBranches; the offset was taken from the b.cond, 4 bytes before the b
+        compile(invertBCond(instruction), 8, 0, 0);
+        compile("b", params[0] - 4, 0, 0);
+    }
+    else
+    {
+        compile(instruction, params[0], params[1], params[2]);
+    }
+    if (i < tokens.size() && tokens[i].type == NEWLINE)
+        i++;
+}
+
+/** Assembles in a single pass over the tokens.  Each line is encoded as soon as it is reached; a
+ *  line that uses a label not yet defined is encoded with a placeholder and recorded as a fixup,
+ *  and when the label is defined every fixup waiting on it is re-encoded in place.  The output and
+ *  the label listing on stderr are the same as with two passes.
+ *
+ *  Labels must be defined once: with two passes a redefinition silently moves every use, which a
+ *  single pass cannot do for uses it has already encoded.
+ *
+ *  With `object`, the file is one of several to link (see asm-object.h): labels still undefined at
+ *  the end become relocations instead of errors, as does every `.8byte label`, and `object` is
+ *  written instead of the machine code and the label listing.
+ *
+ * @param symbolMap If not empty, where to write a symbol map of the labels
+ * @param stats Counts the instructions, labels and fixups
+ */
+void assembleSinglePass(std::vector<Token> &tokens, std::ostream &out, const std::string &symbolMap, Stats &stats,
+                        bool object = false)
+{
+    // Fixups waiting on the same label form a list through `next`, headed by the label's entry in
+    // firstFixup, so recording one never allocates more than a vector slot
+    struct Fixup
+    {
+        size_t token;    // First token of the line to re-encode
+        int64_t address; // Where the line's bytes start
+        uint32_t next;   // Next fixup for the same label, or NO_SYMBOL
+    };
+
+    SymbolTable symbols;
+    std::vector<uint32_t> labels;
+    std::vector<Fixup> fixups;
+    std::vector<uint32_t> firstFixup;
+    size_t unresolved = 0;
+    object::Object linkable;
+    std::string &code = linkable.code;
+    int64_t current = 0;
+    size_t i = 0;
+    uint64_t instructions = 0;
+
+    while (i < tokens.size())
+    {
+        TokenType type = tokens[i].type;
+        if (type == NEWLINE)
+        {
+            i++;
+        }
+        else if (type == LABEL)
+        {
+            uint32_t id = symbols.intern(labelName(tokens[i]));
+            if (!symbols.define(id, current))
+            {
+                formatError("Duplicate label: " + std::string(symbols.name(id)));
+            }
+            labels.push_back(id);
+            i++;
+            if (i < tokens.size() && tokens[i].type != NEWLINE)
+            {
+                formatError("Must be followed by NEWLINE or be at end");
+            }
+            if (i < tokens.size())
+            {
+                i++;
+            }
+
+            for (uint32_t f = id < firstFixup.size() ? firstFixup[id] : SymbolTable::NO_SYMBOL;
+                 f != SymbolTable::NO_SYMBOL; f = fixups[f].next)
+            {
+                size_t token = fixups[f].token;
+                int64_t address = fixups[f].address;
+                char *patch = code.data() + address;
+                encodeLine(tokens, token, address, symbols, nullptr, [&](char c) { *patch++ = c; });
+                unresolved--;
+            }
+            if (id < firstFixup.size())
+            {
+                firstFixup[id] = SymbolTable::NO_SYMBOL;
+            }
+        }
+        else if (type == DOTID || type == ID)
+        {
+            size_t token = i;
+            int64_t address = current;
+            uint32_t pending = SymbolTable::NO_SYMBOL;
+            internOperands(tokens, i, symbols);
+            encodeLine(tokens, i, current, symbols, &pending, [&](char c) { code += c; });
+            instructions++;
+            if (object && tokens[token].lexeme == ".8byte" && tokens[token + 1].type == ID)
+            {
+                // The label's address depends on where the linker puts this file, even if it is here
+                std::string name(symbols.name(tokens[token + 1].value));
+                linkable.relocations.push_back({name, object::ABSOLUTE64, uint64_t(address)});
+                pending = SymbolTable::NO_SYMBOL;
+            }
+            if (object && tokens[token].lexeme == ".align")
+            {
+                linkable.alignment = std::max<uint32_t>(linkable.alignment, uint32_t(1) << tokens[token + 1].value);
+            }
+            if (pending != SymbolTable::NO_SYMBOL)
+            {
+                if (pending >= firstFixup.size())
+                {
+                    firstFixup.resize(pending + 1, SymbolTable::NO_SYMBOL);
+                }
+                fixups.push_back({token, address, firstFixup[pending]});
+                firstFixup[pending] = fixups.size() - 1;
+                unresolved++;
+            }
+        }
+        else
+        {
+            formatError("Unexpected token: " + tokenTypeToString(type));
+        }
+    }
+
+    if (object)
+    {
+        for (uint32_t id = 0; id < firstFixup.size(); id++)
+        {
+            for (uint32_t f = firstFixup[id]; f != SymbolTable::NO_SYMBOL; f = fixups[f].next)
+            {
+                // Only branches are left: each was encoded with an offset of 0, for the linker to fill
+                const Token &next = tokens[fixups[f].token + 1];
+                object::RelocationKind kind = next.type == DOTID ? object::BRANCH19 : object::BRANCH26;
+                linkable.relocations.push_back({std::string(symbols.name(id)), kind, uint64_t(fixups[f].address)});
+            }
+        }
+        std::sort(linkable.relocations.begin(), linkable.relocations.end(),
+                  [](const object::Relocation &a, const object::Relocation &b) { return a.offset < b.offset; });
+        for (uint32_t id : labels)
+        {
+            linkable.symbols.push_back({std::string(symbols.name(id)), uint64_t(symbols.address(id))});
+        }
+        object::write(linkable, out);
+        stats.count("instructions", instructions);
+        stats.count("labels", labels.size());
+        stats.count("relocations", linkable.relocations.size());
+        stats.count("bytes_out", code.size());
+        return;
+    }
+
+    if (unresolved > 0)
+    {
+        // Report the first use, as the two-pass assembler would: encoding its line again without
+        // `pending` raises the undefined label error
+        size_t line = SIZE_MAX;
+        for (uint32_t head : firstFixup)
+        {
+            for (uint32_t f = head; f != SymbolTable::NO_SYMBOL; f = fixups[f].next)
+            {
+                line = std::min(line, fixups[f].token);
+            }
+        }
+        int64_t address = 0;
+        encodeLine(tokens, line, address, symbols, nullptr, [](char) {});
+    }
+
+    printLabels(symbols, labels);
+    if (!symbolMap.empty())
+    {
+        writeSymbolMap(symbolMap, symbols, labels, code.size());
+    }
+    out.write(code.data(), code.size());
+    stats.count("instructions", instructions);
+    stats.count("labels", labels.size());
+    stats.count("fixups", fixups.size());
+    stats.count("bytes_out", code.size());
+}
+
+/** A line to encode in the second pass: its first token and its address */
+struct Line
+{
+    size_t token;
+    int64_t address;
+};
+
+/** Relaxes each b.cond in `branches` (the `.cond` token and the line's address, from a layout pass)
+ *  whose label is beyond its ±1 MB reach: it is marked RELAXED_BRANCH, and encoded as the inverted
+ *  condition branching over an unconditional `b`, which reaches ±128 MB:
+ *
+ *      b.eq far        ->      b.ne +8
+ *                              b far
+ *
+ *  Branches in range keep the short form.  A relaxed branch stays relaxed, so repeating the layout
+ *  until this returns false always ends.
+ *
+ * @param relaxed Incremented for each branch relaxed
+ * @return Whether any branch was relaxed, moving the code after it
+ */
+bool relaxBranches(std::vector<Token> &tokens, const std::vector<Line> &branches, const SymbolTable &symbols,
+                   uint64_t &relaxed)
+{
+    bool changed = false;
+    for (const Line &branch : branches)
+    {
+        Token &cond = tokens[branch.token];
+        if (cond.value == RELAXED_BRANCH || branch.token + 1 >= tokens.size() || tokens[branch.token + 1].type != ID)
+        {
+            continue;
+        }
+        uint32_t id = tokens[branch.token + 1].value;
+        if (!symbols.defined(id))
+        {
+            continue; // an error when encoding
+        }
+        int64_t words = (symbols.address(id) - branch.address) / 4;
+        if (words < -262144 || words > 262143)
+        {
+            cond.value = RELAXED_BRANCH;
+            relaxed++;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+/** The second pass on `jobs` threads.  Every line's address is known after the first pass, so each
+ *  line is encoded independently, straight into its place in one preallocated buffer.  Threads take
+ *  batches of lines from a shared counter.  A thread stops at its first error; batches that start
+ *  after the earliest error found so far are skipped, and the error of the earliest line is
+ *  reported after writing the output before it, exactly as the serial second pass would.
+ *
+ * @param size Total size of the output in bytes
+ */
+void encodeParallel(const std::vector<Token> &tokens, const std::vector<Line> &lines, const SymbolTable &symbols,
+                    int64_t size, unsigned jobs, std::ostream &out)
+{
+    const size_t BATCH_LINES = 4096;
+
+    struct Failure
+    {
+        size_t line = SIZE_MAX;
+        std::string message;
+    };
+
+    std::string code(size, '\0');
+    std::vector<Failure> failures(jobs);
+    std::atomic<size_t> nextBatch(0);
+    std::atomic<size_t> firstFailure(SIZE_MAX);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < jobs; t++)
+    {
+        threads.emplace_back([&, t]()
+        {
+            while (true)
+            {
+                size_t begin = nextBatch.fetch_add(BATCH_LINES);
+                if (begin >= lines.size() || begin > firstFailure.load())
+                {
+                    return;
+                }
+                size_t end = std::min(begin + BATCH_LINES, lines.size());
+                for (size_t k = begin; k < end; k++)
+                {
+                    size_t i = lines[k].token;
+                    int64_t current = lines[k].address;
+                    char *next = code.data() + current;
+                    try
+                    {
+                        encodeLine(tokens, i, current, symbols, nullptr, [&](char c) { *next++ = c; });
+                    }
+                    catch (std::exception &e)
+                    {
+                        failures[t] = {k, e.what()};
+                        size_t earliest = firstFailure.load();
+                        while (k < earliest && !firstFailure.compare_exchange_weak(earliest, k))
+                        {
+                        }
+                        return;
+                    }
+                }
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+
+    const Failure *failure = nullptr;
+    for (const Failure &f : failures)
+    {
+        if (f.line != SIZE_MAX && (failure == nullptr || f.line < failure->line))
+        {
+            failure = &f;
+        }
+    }
+    out.write(code.data(), failure != nullptr ? lines[failure->line].address : size);
+    if (failure != nullptr)
+    {
+        out.flush();
+        formatError(failure->message);
+    }
+}
+
+/** Reads tokens a line at a time, for streaming.  Input is read in blocks; only the current line
+ *  and the rest of its block are held (plus the string table of the binary format), so memory does
+ *  not grow with the input.
+ *
+ * @param source Whether the input is ARM64 source, lexed as it is read, rather than tokens
+ */
+class TokenStream
+{
+public:
+    TokenStream(int fd, bool source) : fd(fd), buffer(BLOCK_BYTES), source(source)
+    {
+        while (!atEnd && end < BINARY_HEADER_BYTES)
+        {
+            fill();
+        }
+        binary = !source && isBinaryTokens(buffer.data(), end);
+        if (binary)
+        {
+            uint64_t count = 0;
+            uint64_t stringBytes = 0;
+            readBinaryHeader(buffer.data(), end, count, stringBytes);
+            begin = BINARY_HEADER_BYTES;
+            while (!atEnd && end - begin < stringBytes)
+            {
+                fill();
+            }
+            if (end - begin < stringBytes)
+            {
+                formatError("Truncated binary token stream");
+            }
+            strings.assign(buffer.data() + begin, stringBytes);
+            begin += stringBytes;
+        }
+    }
+
+    /** Reads the tokens of the next line, up to and including its NEWLINE, into `line`.  Their
+     *  lexemes stay valid until the next call.
+     *
+     * @return false at the end of the input
+     */
+    bool nextLine(std::vector<Token> &line)
+    {
+        line.clear();
+        size_t pos = begin;
+        Token token;
+        while (true)
+        {
+            bool complete = binary ? readBinaryToken(buffer.data(), end, pos, strings, token)
+                            : source ? readSourceToken(buffer.data(), end, pos, atEnd, token)
+                                     : readTextToken(buffer.data(), end, pos, atEnd, token);
+            if (complete)
+            {
+                line.push_back(token);
+                if (token.type == NEWLINE)
+                {
+                    break;
+                }
+                continue;
+            }
+            if (atEnd)
+            {
+                if (binary && pos < end)
+                {
+                    formatError("Truncated binary token stream");
+                }
+                break;
+            }
+            // The line continues past the buffer: read more and parse it again from its start
+            fill();
+            line.clear();
+            pos = begin;
+        }
+        begin = pos;
+        return !line.empty();
+    }
+
+    uint64_t bytesRead() const { return totalRead; }
+
+private:
+    static const size_t BLOCK_BYTES = 1 << 20;
+
+    /** Moves the unconsumed bytes to the front of the buffer and reads another block after them */
+    void fill()
+    {
+        memmove(buffer.data(), buffer.data() + begin, end - begin);
+        end -= begin;
+        begin = 0;
+        if (buffer.size() - end < BLOCK_BYTES)
+        {
+            buffer.resize(end + BLOCK_BYTES);
+        }
+        ssize_t n = read(fd, buffer.data() + end, buffer.size() - end);
+        if (n <= 0)
+        {
+            atEnd = true;
+            return;
+        }
+        end += n;
+        totalRead += n;
+    }
+
+    int fd;
+    std::vector<char> buffer;
+    size_t begin = 0; // Start of the first unconsumed token
+    size_t end = 0;   // End of the data read so far
+    bool atEnd = false;
+    uint64_t totalRead = 0;
+    bool source;
+    bool binary = false;
+    std::string strings;
+};
+
+/** Writes machine code to a file descriptor as it is produced, holding back only what fixups still
+ *  need.  When the output is a regular file, every byte is written as soon as it is produced and
+ *  fixups are patched in place with pwrite.  Otherwise (a pipe), bytes from the earliest unresolved
+ *  fixup onwards are kept in memory until it is resolved.
+ */
+class StreamOutput
+{
+public:
+    explicit StreamOutput(int fd) : fd(fd)
+    {
+        // pwrite on an O_APPEND file (stdout opened with >>) ignores the offset and appends, so such
+        // output is held back like a pipe's
+        struct stat st;
+        int flags = fcntl(fd, F_GETFL);
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && flags >= 0 && !(flags & O_APPEND))
+        {
+            base = lseek(fd, 0, SEEK_CUR);
+        }
+    }
+
+    /** Appends bytes at address `next()` */
+    void append(const std::string &bytes)
+    {
+        buffer += bytes;
+        if (buffer.size() - head >= FLUSH_BYTES)
+        {
+            flush();
+        }
+    }
+
+    /** Marks the bytes at `address` as a placeholder that will be patched */
+    void hold(int64_t address)
+    {
+        if (base < 0)
+        {
+            held.insert(address);
+        }
+    }
+
+    /** Overwrites the placeholder at `address` */
+    void patch(int64_t address, const std::string &bytes)
+    {
+        if (address >= bufferStart + static_cast<int64_t>(head))
+        {
+            memcpy(buffer.data() + (address - bufferStart), bytes.data(), bytes.size());
+        }
+        else if (pwrite(fd, bytes.data(), bytes.size(), base + address) != static_cast<ssize_t>(bytes.size()))
+        {
+            formatError("Unable to patch output");
+        }
+        held.erase(address);
+    }
+
+    /** Writes everything that is not held back */
+    void flush()
+    {
+        size_t ready = buffer.size();
+        if (!held.empty())
+        {
+            ready = *held.begin() - bufferStart;
+        }
+        size_t written = head;
+        while (written < ready)
+        {
+            ssize_t n = write(fd, buffer.data() + written, ready - written);
+            if (n <= 0)
+            {
+                formatError("Unable to write output");
+            }
+            written += n;
+        }
+        head = written;
+        // Drop written bytes once they are most of the buffer, so held data is not moved repeatedly
+        if (head > buffer.size() / 2)
+        {
+            buffer.erase(0, head);
+            bufferStart += head;
+            head = 0;
+        }
+    }
+
+    /** Appends the bytes of an .incbin by copying them in the kernel (see copyData), if nothing is
+     *  held back; otherwise they must be kept in memory like any other bytes, and nothing is done.
+     *
+     * @return Whether the bytes were appended
+     */
+    bool copy(const Data &data)
+    {
+        flush();
+        if (!held.empty())
+        {
+            return false;
+        }
+        copyData(data, fd);
+        bufferStart += buffer.size() + data.length;
+        buffer.clear();
+        head = 0;
+        return true;
+    }
+
+private:
+    static const size_t FLUSH_BYTES = 1 << 20;
+
+    int fd;
+    off_t base = -1;       // File offset of address 0, or -1 if the output cannot be patched in place
+    std::string buffer;    // Bytes from address bufferStart on
+    int64_t bufferStart = 0;
+    size_t head = 0;       // Bytes of buffer already written
+    std::set<int64_t> held; // Addresses of unresolved placeholders (only when base < 0)
+};
+
+/** Assembles tokens as they are read, for inputs too large to hold in memory.  Lines are encoded and
+ *  written as soon as they are read; a line that uses a label not yet defined is written as a
+ *  placeholder, and a copy of its tokens is kept as a fixup until the label is defined.  Memory is
+ *  the symbol table plus the outstanding fixups (and, when the output is a pipe, the bytes they
+ *  block), not the size of the program.  Labels must be defined once, as with --single-pass, and
+ *  are listed on stderr as they are defined.
+ *
+ * @param symbolMap If not empty, where to write a symbol map of the labels once all are defined
+ * @param stats Counts the lines, tokens, instructions, labels and fixups
+ */
+void assembleStreaming(TokenStream &in, int outFd, const std::string &symbolMap, Stats &stats)
+{
+    // A line waiting on a label, with its own copy of its tokens' lexemes.  Kept in a deque, since
+    // the lexemes may live inside `lexemes` itself (short string optimization) and must not move.
+    struct Fixup
+    {
+        std::vector<Token> tokens;
+        std::string lexemes;
+        int64_t address;
+        uint32_t next; // Next fixup for the same label, or NO_SYMBOL
+    };
+
+    SymbolTable symbols;
+    StreamOutput out(outFd);
+    std::deque<Fixup> fixups;
+    std::vector<uint32_t> freeFixups;
+    std::vector<uint32_t> firstFixup;
+    size_t unresolved = 0;
+    std::string listing;
+    std::vector<uint32_t> defined; // Only kept for the symbol map
+    std::vector<Token> line;
+    std::string bytes;
+    int64_t current = 0;
+    uint64_t lines = 0;
+    uint64_t tokens = 0;
+    uint64_t instructions = 0;
+    uint64_t labels = 0;
+    uint64_t fixupCount = 0;
+
+    while (in.nextLine(line))
+    {
+        lines++;
+        tokens += line.size();
+        TokenType type = line[0].type;
+        if (type == NEWLINE)
+        {
+            continue;
+        }
+        if (type == LABEL)
+        {
+            uint32_t id = symbols.intern(labelName(line[0]));
+            if (!symbols.define(id, current))
+            {
+                formatError("Duplicate label: " + std::string(symbols.name(id)));
+            }
+            labels++;
+            if (!symbolMap.empty())
+            {
+                defined.push_back(id);
+            }
+            if (line.size() > 1 && line[1].type != NEWLINE)
+            {
+                formatError("Must be followed by NEWLINE or be at end");
+            }
+            listing += symbols.name(id);
+            listing += ' ';
+            listing += std::to_string(current);
+            listing += '\n';
+            if (listing.size() >= 1 << 16)
+            {
+                std::cerr.write(listing.data(), listing.size());
+                listing.clear();
+            }
+
+            uint32_t f = id < firstFixup.size() ? firstFixup[id] : SymbolTable::NO_SYMBOL;
+            while (f != SymbolTable::NO_SYMBOL)
+            {
+                Fixup &fixup = fixups[f];
+                size_t token = 0;
+                int64_t address = fixup.address;
+                bytes.clear();
+                encodeLine(fixup.tokens, token, address, symbols, nullptr, [&](char c) { bytes += c; });
+                out.patch(fixup.address, bytes);
+                unresolved--;
+                freeFixups.push_back(f);
+                uint32_t next = fixup.next;
+                fixup.tokens = std::vector<Token>();
+                fixup.lexemes = std::string();
+                f = next;
+            }
+            if (id < firstFixup.size())
+            {
+                firstFixup[id] = SymbolTable::NO_SYMBOL;
+            }
+            continue;
+        }
+        if (type != DOTID && type != ID)
+        {
+            formatError("Unexpected token: " + tokenTypeToString(type));
+        }
 
-    while (i < tokens.size())
-    {
-        if (tokens[i].type == NEWLINE)
+        if (type == DOTID && line[0].lexeme == ".incbin")
         {
-            i++;
+            Data data;
+            size_t token = 0;
+            parseData(line, token, current, data);
+            if (!out.copy(data))
+            {
+                bytes.clear();
+                emitData(data, [&](char c) { bytes += c; });
+                out.append(bytes);
+            }
+            current += data.length;
+            instructions++;
             continue;
         }
 
-        if (tokens[i].type == LABEL)
+        int64_t address = current;
+        uint32_t pending = SymbolTable::NO_SYMBOL;
+        size_t token = 0;
+        internOperands(line, 0, symbols);
+        bytes.clear();
+        encodeLine(line, token, current, symbols, &pending, [&](char c) { bytes += c; });
+        instructions++;
+        if (pending != SymbolTable::NO_SYMBOL)
         {
-            i++;
-            if (i < tokens.size() && tokens[i].type != NEWLINE)
+            fixupCount++;
+            uint32_t f = fixups.size();
+            if (!freeFixups.empty())
             {
-                formatError("Must be followed by NEWLINE or be at end");
+                f = freeFixups.back();
+                freeFixups.pop_back();
             }
-            if (i < tokens.size())
+            else
             {
-                i++;
+                fixups.emplace_back();
+            }
+            if (pending >= firstFixup.size())
+            {
+                firstFixup.resize(pending + 1, SymbolTable::NO_SYMBOL);
+            }
+            Fixup &fixup = fixups[f];
+            fixup.tokens = line;
+            for (const Token &t : line)
+            {
+                fixup.lexemes += t.lexeme;
+            }
+            size_t offset = 0;
+            for (Token &t : fixup.tokens)
+            {
+                t.lexeme = std::string_view(fixup.lexemes.data() + offset, t.lexeme.size());
+                offset += t.lexeme.size();
+            }
+            fixup.address = address;
+            fixup.next = firstFixup[pending];
+            firstFixup[pending] = f;
+            unresolved++;
+            out.hold(address);
+        }
+        out.append(bytes);
+    }
+    std::cerr.write(listing.data(), listing.size());
+
+    if (unresolved > 0)
+    {
+        // Encoding the earliest waiting line again without `pending` raises the undefined label error
+        const Fixup *first = nullptr;
+        for (uint32_t head : firstFixup)
+        {
+            for (uint32_t f = head; f != SymbolTable::NO_SYMBOL; f = fixups[f].next)
+            {
+                if (first == nullptr || fixups[f].address < first->address)
+                {
+                    first = &fixups[f];
+                }
             }
+        }
+        size_t token = 0;
+        int64_t address = 0;
+        encodeLine(first->tokens, token, address, symbols, nullptr, [](char) {});
+    }
+    out.flush();
+    if (!symbolMap.empty())
+    {
+        writeSymbolMap(symbolMap, symbols, defined, current);
+    }
+    stats.count("lines", lines);
+    stats.count("tokens", tokens);
+    stats.count("instructions", instructions);
+    stats.count("labels", labels);
+    stats.count("fixups", fixupCount);
+    stats.count("bytes_in", in.bytesRead());
+    stats.count("bytes_out", current);
+}
+
+/** The cache key for the machine code of tokens [begin, end) when placed at address `start`.  The
+ *  encoding of a block depends only on its tokens, the distance from `start` to each label it
+ *  branches to, the absolute address of each label it stores with `.8byte`, and `start % 4` (an
+ *  instruction at an unaligned address is an error), so the key is exactly those.  Moving a block
+ *  therefore only invalidates it if a branch target moved relative to it, it stores a label
+ *  address, or its alignment changed.
+ *
+ *  Blocks with `.incbin` (whose bytes live in another file) or `.align` (whose bytes depend on the
+ *  absolute address) are not cached: their key is empty.
+ */
+std::string blockCacheKey(const std::vector<Token> &tokens, size_t begin, size_t end, int64_t start,
+                          const SymbolTable &symbols)
+{
+    std::string key = "B";
+    key += static_cast<char>(start & 3);
+    for (size_t i = begin; i < end; i++)
+    {
+        if (tokens[i].type == DOTID && (tokens[i].lexeme == ".incbin" || tokens[i].lexeme == ".align"))
+        {
+            return "";
+        }
+        key += static_cast<char>(tokens[i].type);
+        if (tokens[i].type == REG || tokens[i].type == ZREG || tokens[i].type == INT || tokens[i].type == HEXINT)
+        {
+            key.append(reinterpret_cast<const char *>(&tokens[i].value), sizeof(tokens[i].value));
             continue;
         }
+        key += tokens[i].lexeme;
+        key += '\0';
+        if (tokens[i].type == DOTID && tokens[i].value == RELAXED_BRANCH)
+        {
+            key += '\3';
+        }
+        if (tokens[i].type == ID)
+        {
+            uint32_t id = tokens[i].value;
+            if (i > begin && tokens[i - 1].type != NEWLINE && symbols.defined(id))
+            {
+                bool absolute = tokens[i - 1].type == DOTID && tokens[i - 1].lexeme == ".8byte";
+                int64_t address = absolute ? symbols.address(id) : symbols.address(id) - start;
+                key += absolute ? '\1' : '\2';
+                key.append(reinterpret_cast<const char *>(&address), sizeof(address));
+            }
+        }
+    }
+    return key;
+}
 
-        if (i >= tokens.size())
+/** Takes a tokenization of an ARM64 assembly file as input, then outputs a list of parameters for compileLine,
+ * replacing label uses with their respective addresses. Prints label addresses into standard out.
+ *
+ * If the file is not found, print an error and returns a non-0 value.
+ *
+ * @return 0 on success, non-0 on error
+ */
+int _main(int argc, char *argv[])
+{
+    std::string cachePath;
+    std::string writeTokensPath;
+    std::string symbolMapPath;
+    bool singlePass = false;
+    bool objectOutput = false;
+    bool stream = false;
+    bool source = false;
+    bool statsFlag = false;
+    bool checkAllocations = false;
+    unsigned jobs = 1;
+    bool badOption = false;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if ((arg == "-j" || arg == "--cache" || arg == "--write-tokens" || arg == "--symbol-map") && i + 1 == argc)
         {
+            // An option missing its value is an error, not the input file
+            badOption = true;
             break;
         }
-        if (tokens[i].type == NEWLINE)
+        if (arg.starts_with("-j"))
         {
-            i++;
-            continue;
+            std::string count = arg.size() > 2 ? arg.substr(2) : argv[++i];
+            auto [end, error] = std::from_chars(count.data(), count.data() + count.size(), jobs);
+            if (error != std::errc() || end != count.data() + count.size() || jobs == 0)
+            {
+                std::cerr << "ERROR: invalid job count '" << count << "'" << std::endl;
+                badOption = true;
+                break;
+            }
+        }
+        else if (arg == "--cache")
+        {
+            cachePath = argv[++i];
+        }
+        else if (arg == "--write-tokens")
+        {
+            writeTokensPath = argv[++i];
+        }
+        else if (arg == "--symbol-map")
+        {
+            symbolMapPath = argv[++i];
+        }
+        else if (arg == "--single-pass")
+        {
+            singlePass = true;
+        }
+        else if (arg == "--object")
+        {
+            objectOutput = true;
         }
+        else if (arg == "--stream")
+        {
+            stream = true;
+        }
+        else if (arg == "--source")
+        {
+            source = true;
+        }
+        else if (arg == "--stats")
+        {
+            statsFlag = true;
+        }
+        else if (arg == "--check-allocations")
+        {
+            checkAllocations = true;
+        }
+        else
+        {
+            args.push_back(arg);
+        }
+    }
 
-        TokenType type = tokens[i].type;
+    if (badOption || args.size() > 1 || (singlePass + objectOutput + stream + !cachePath.empty() + (jobs > 1) > 1) ||
+        (stream && !writeTokensPath.empty()) || (objectOutput && !symbolMapPath.empty()) ||
+        (checkAllocations && (singlePass || objectOutput || stream || !cachePath.empty() || jobs > 1)))
+    {
+        std::cerr << "Usage:" << std::endl
+                  << "\ttokenasm [-j N | --cache CACHE | --single-pass] [--source] [--write-tokens OUT] [--symbol-map MAP] [--stats] [FILE]" << std::endl
+                  << "\ttokenasm --stream [--source] [--symbol-map MAP] [--stats] [FILE]" << std::endl
+                  << "\ttokenasm --object [--source] [--stats] [FILE] > OBJECT" << std::endl
+                  << "\ttokenasm --check-allocations [--source] [FILE]" << std::endl
+                  << std::endl
+                  << "If FILE is unspecified or if FILE is `-`, read tokenized assembly from standard "
+                  << "in. Otherwise, read tokenized assembly from FILE." << std::endl
+                  << "Tokens may be in the text format or the binary format; the binary format is "
+                  << "recognized by its magic." << std::endl
+                  << "With --source, read ARM64 source instead of tokens and lex it directly." << std::endl
+                  << "With -j N, encode on N threads once the label addresses are known." << std::endl
+                  << "With --single-pass, encode in one pass over the tokens, backpatching forward "
+                  << "label references; every label must be defined once." << std::endl
+                  << "With --stream, do the same while reading, holding only unresolved references "
+                  << "in memory." << std::endl
+                  << "With --object, write an object file for asm-link instead of machine code: labels "
+                  << "defined in other files are left for the linker." << std::endl
+                  << "With --write-tokens, convert the tokens to the binary format in OUT instead of "
+                  << "assembling." << std::endl
+                  << "With --cache, reuse machine code for label-delimited blocks cached in CACHE by "
+                  << "earlier runs." << std::endl
+                  << "With --symbol-map, also write the labels sorted by address to MAP, for "
+                  << "asm-symbolize." << std::endl
+                  << "With --stats (or ASM_STATS set), print timings and counters as JSON to "
+                  << "standard error." << std::endl
+                  << "With --check-allocations, fail if encoding any instruction allocates on the heap."
+                  << std::endl;
+        return 1;
+    }
+
+    int fd = STDIN_FILENO;
+    if (!args.empty() && args[0] != "-")
+    {
+        fd = open(args[0].c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            formatError((std::stringstream() << "File '" << args[0] << "' not found!").str());
+            return 1;
+        }
+    }
+
+    std::unique_ptr<AssemblyCache> cache;
+    if (!cachePath.empty())
+    {
+        cache = std::make_unique<AssemblyCache>(cachePath);
+    }
+
+    Stats stats("asm-tokenizer", PHASE_NAMES, PHASE_COUNT, Stats::requested(statsFlag));
+    Stats::Time time = stats.now();
+    if (stream)
+    {
+        TokenStream in(fd, source);
+        assembleStreaming(in, STDOUT_FILENO, symbolMapPath, stats);
+        stats.add(STREAM, time);
+        return 0;
+    }
+
+    Input input(fd);
+    std::vector<Token> tokens;
+    if (source)
+    {
+        readSourceTokens(input.data(), input.size(), tokens);
+    }
+    else if (isBinaryTokens(input.data(), input.size()))
+    {
+        readBinaryTokens(input.data(), input.size(), tokens);
+    }
+    else
+    {
+        readTextTokens(input.data(), input.size(), tokens);
+    }
+
+    time = stats.add(READ, time);
+    stats.count("bytes_in", input.size());
+    stats.count("tokens", tokens.size());
+
+    if (!writeTokensPath.empty())
+    {
+        std::ofstream out(writeTokensPath, std::ios::binary | std::ios::trunc);
+        writeBinaryTokens(tokens, out);
+        if (!out)
+        {
+            formatError("Unable to write '" + writeTokensPath + "'");
+        }
+        return 0;
+    }
+
+    if (singlePass || objectOutput)
+    {
+        assembleSinglePass(tokens, std::cout, symbolMapPath, stats, objectOutput);
+        time = stats.add(SINGLE_PASS, time);
+        std::cout.flush();
+        stats.add(WRITE, time);
+        return 0;
+    }
+
+    // -- YOUR CODE HERE --
+    // You've been given a vector of all the tokens, so you're now free to manipulate and scan all tokens as many times as necessary.
+    // Go ham!
+    // Build symbol table
+    SymbolTable symbols;
+    std::vector<uint32_t> labels;
+    // Token index where each label-delimited block starts, for the cache
+    std::vector<size_t> blockStarts = {0};
+    // Each line to encode, for the parallel second pass
+    std::vector<Line> lines;
+    uint64_t instructions = 0;
+    int64_t current = 0;
+    size_t i = 0;
+    // Each b.cond, by its `.cond` token and address, for relaxBranches
+    std::vector<Line> branches;
+    uint64_t relaxed = 0;
+
+    // Relaxing a branch moves everything after it, so the layout is repeated until it is stable
+    do
+    {
+        labels.clear();
+        blockStarts.assign(1, 0);
+        lines.clear();
+        branches.clear();
+        instructions = 0;
+        current = 0;
+        i = 0;
 
-        if (type == DOTID)
+        while (i < tokens.size())
         {
-            if (tokens[i].lexeme == ".8byte")
+            if (tokens[i].type == NEWLINE)
             {
                 i++;
-                if (i >= tokens.size() || (tokens[i].type != HEXINT && tokens[i].type != INT && tokens[i].type != ID))
-                {
-                    formatError("Expected integer after .8byte");
-                }
-                int64_t value = 0;
-                if (tokens[i].type == ID)
-                {
-                    const std::string &labelName = tokens[i].lexeme;
-                    if (symTable.find(labelName) == symTable.end())
-                    {
-                        formatError("Undefined label: " + labelName);
-                    }
-                    value = symTable[labelName];
-                }
-                else
+                continue;
+            }
+
+            if (tokens[i].type == LABEL)
+            {
+                uint32_t id = symbols.intern(labelName(tokens[i]));
+                symbols.define(id, current);
+                labels.push_back(id);
+                if (i != blockStarts.back())
                 {
-                    value = parseInteger(tokens[i].lexeme);
+                    blockStarts.push_back(i);
                 }
                 i++;
-                // Output 8 bytes in little-endian
-                for (int j = 0; j < 8; ++j)
+                if (i < tokens.size() && tokens[i].type != NEWLINE)
                 {
-                    std::cout << (char)((value >> (j * 8)) & 0xFF);
+                    formatError("Must be followed by NEWLINE or be at end");
                 }
-                current += 8;
-                if (i < tokens.size() && tokens[i].type == NEWLINE)
+                if (i < tokens.size())
+                {
                     i++;
+                }
+                continue;
             }
-            else
-            {
-                formatError("Unknown directive: " + tokens[i].lexeme);
-            }
-        }
-        else if (type == ID)
-        {
-            std::string instruction = tokens[i].lexeme;
-            if (instruction.size() > 2 && instruction[0] == 'b' && instruction[1] == '.')
+
+            if (i >= tokens.size())
             {
-                formatError("Conditional branch must be tokenized as ID");
+                break;
             }
-            i++;
-
-            if (instruction == "b" && i < tokens.size() && tokens[i].type == DOTID)
+            if (tokens[i].type == NEWLINE)
             {
-                instruction += tokens[i].lexeme;
                 i++;
+                continue;
             }
 
-            std::vector<int> params;
+            TokenType type = tokens[i].type;
 
-            // Parse parameters
-            while (i < tokens.size() && tokens[i].type != NEWLINE)
+            if (type == DOTID)
             {
-                TokenType t = tokens[i].type;
-
-                if (t == REG || t == ZREG)
+                if (tokens[i].lexeme == ".8byte")
                 {
-                    params.push_back(parseRegister(tokens[i].lexeme));
+                    internOperands(tokens, i, symbols);
+                    instructions++;
+                    if (jobs > 1)
+                    {
+                        lines.push_back({i, current});
+                    }
                     i++;
+                    if (i >= tokens.size() || (tokens[i].type != HEXINT && tokens[i].type != INT && tokens[i].type != ID))
+                    {
+                        formatError("Expected integer");
+                    }
+                    i++; // skip the integer
+                    current += 8;
+                    // Must be followed by NEWLINE or be at end
+                    if (i < tokens.size() && tokens[i].type != NEWLINE)
+                    {
+                        formatError("Must be followed by NEWLINE or be at end");
+                    }
+                    if (i < tokens.size())
+                        i++; // skip newline
                 }
-                else if (t == ID && tokens[i].lexeme == "sp" && !instructionAllowsLabelOperand(instruction))
+                else if (isDataDirective(tokens[i].lexeme))
                 {
-                    params.push_back(31);
-                    i++;
+                    instructions++;
+                    if (jobs > 1)
+                    {
+                        lines.push_back({i, current});
+                    }
+                    Data data;
+                    parseData(tokens, i, current, data);
+                    current += data.length;
                 }
-                else if (t == INT || t == HEXINT)
+                else
                 {
-                    params.push_back(parseInteger(tokens[i].lexeme));
-                    i++;
+                    formatError("Unknown directive: " + std::string(tokens[i].lexeme));
                 }
-                else if (t == ID)
+            }
+            else if (type == ID)
+            {
+                std::string instruction(tokens[i].lexeme);
+                if (instruction.size() > 2 && instruction[0] == 'b' && instruction[1] == '.')
                 {
-                    if (!instructionAllowsLabelOperand(instruction))
-                    {
-                        formatError("Unexpected token " + tokens[i].lexeme + " while processing " + instruction);
-                    }
-                    // Label reference
-                    std::string labelName = tokens[i].lexeme;
-                    if (symTable.find(labelName) == symTable.end())
-                    {
-                        formatError("Undefined label: " + labelName);
-                    }
-                    // Calculate offset from current instruction
-                    int64_t offset = symTable[labelName] - current;
-                    params.push_back(offset);
-                    i++;
+                    formatError("Conditional branch must be tokenized as ID b followed by DOTID .cond");
                 }
-                else if (t == COMMA)
+                internOperands(tokens, i, symbols);
+                instructions++;
+                if (jobs > 1)
                 {
-                    i++;
+                    lines.push_back({i, current});
                 }
-                else if (t == LBRACK)
+                i++; // skip instruction
+                if (instruction == "mov")
                 {
-                    i++;
+                    // The expansion is 1 to 4 instructions depending on the constant
+                    int rd;
+                    uint64_t value;
+                    MoveWide steps[4];
+                    parseMov(tokens, i, rd, value);
+                    current += 4 * planMov(value, steps);
+                    if (i < tokens.size())
+                        i++; // skip newline
+                    continue;
                 }
-                else if (t == RBRACK)
+                int64_t size = 4;
+                if (instruction == "b" && i < tokens.size() && tokens[i].type == DOTID)
                 {
+                    branches.push_back({i, current});
+                    size = tokens[i].value == RELAXED_BRANCH ? 8 : 4;
                     i++;
                 }
-                else
+                while (i < tokens.size() && tokens[i].type != NEWLINE)
                 {
-                    formatError("Unexpected token : " + tokenTypeToString(t));
+                    i++;
                 }
+                current += size;
+                if (i < tokens.size())
+                    i++; // skip newline
             }
+            else
+            {
+                formatError("Unexpected token: " + tokenTypeToString(type));
+            }
+        }
+    } while (relaxBranches(tokens, branches, symbols, relaxed));
 
-            // Call 
-            
-            uint32_t machineCode;
-            int p1 = params.size() > 0 ? params[0] : 0;
-            int p2 = params.size() > 1 ? params[1] : 0;
-            int p3 = params.size() > 2 ? params[2] : 0;
+    // Output symbol table to stderr
+    printLabels(symbols, labels);
+    if (!symbolMapPath.empty())
+    {
+        writeSymbolMap(symbolMapPath, symbols, labels, current);
+    }
+
+    time = stats.add(FIRST_PASS, time);
+    stats.count("instructions", instructions);
+    stats.count("labels", labels.size());
+    stats.count("relaxed_branches", relaxed);
+    stats.count("bytes_out", current);
+
+    if (jobs > 1)
+    {
+        encodeParallel(tokens, lines, symbols, current, jobs, std::cout);
+        time = stats.add(SECOND_PASS, time);
+        std::cout.flush();
+        stats.add(WRITE, time);
+        return 0;
+    }
+
+    // Second pass: Generate machine code
+    i = 0;
+    current = 0;
+
+    // With a cache, each block is either copied from the cache or encoded and recorded
+    size_t block = 0;
+    std::string blockKey;
+    std::string blockCode;
+    bool recording = false;
+    auto emit = [&](char c)
+    {
+        std::cout << c;
+        if (recording)
+        {
+            blockCode += c;
+        }
+    };
 
-            if (!compileLine(machineCode, instruction, p1, p2, p3))
+    while (i < tokens.size())
+    {
+        if (cache && block < blockStarts.size() && i == blockStarts[block])
+        {
+            if (recording)
+            {
+                cache->insert(blockKey, blockCode);
+            }
+            size_t end = block + 1 < blockStarts.size() ? blockStarts[block + 1] : tokens.size();
+            blockKey = blockCacheKey(tokens, i, end, current, symbols);
+            block++;
+            // Blocks without a key are encoded every time
+            recording = !blockKey.empty();
+            if (recording && cache->find(blockKey, blockCode))
             {
-                return 1;
+                std::cout.write(blockCode.data(), blockCode.size());
+                current += blockCode.size();
+                i = end;
+                recording = false;
+                continue;
             }
+            blockCode.clear();
+        }
 
-            // Output machine code
-            std::cout << (char)((machineCode >> 24) & 0xFF)
-                      << (char)((machineCode >> 16) & 0xFF)
-                      << (char)((machineCode >> 8) & 0xFF)
-                      << (char)((machineCode >> 0) & 0xFF);
+        if (tokens[i].type == NEWLINE)
+        {
+            i++;
+            continue;
+        }
 
-            current += 4;
-            if (i < tokens.size() && tokens[i].type == NEWLINE)
+        if (tokens[i].type == LABEL)
+        {
+            i++;
+            if (i < tokens.size() && tokens[i].type != NEWLINE)
+            {
+                formatError("Must be followed by NEWLINE or be at end");
+            }
+            if (i < tokens.size())
+            {
                 i++;
+            }
+            continue;
         }
-        else
+
+        if (i >= tokens.size())
         {
-            formatError("Unexpected token: " + tokenTypeToString(type));
+            break;
+        }
+        if (tokens[i].type == NEWLINE)
+        {
+            i++;
+            continue;
         }
+
+        if (tokens[i].type != DOTID && tokens[i].type != ID)
+        {
+            formatError("Unexpected token: " + tokenTypeToString(tokens[i].type));
+        }
+        if (tokens[i].type == DOTID && tokens[i].lexeme == ".incbin" && !recording)
+        {
+            // Included files go from file to output in the kernel, after what is buffered so far
+            Data data;
+            parseData(tokens, i, current, data);
+            std::cout.flush();
+            copyData(data, STDOUT_FILENO);
+            current += data.length;
+            continue;
+        }
+        if (checkAllocations && tokens[i].type == ID)
+        {
+            // Valid instructions are encoded without touching the heap
+            int64_t address = current;
+            std::string_view instruction = tokens[i].lexeme;
+            uint64_t before = Stats::allocations();
+            encodeLine(tokens, i, current, symbols, nullptr, emit);
+            if (Stats::allocations() != before)
+            {
+                formatError("Encoding " + std::string(instruction) + " at address " + std::to_string(address) +
+                            " allocated " + std::to_string(Stats::allocations() - before) + " times");
+            }
+            continue;
+        }
+        encodeLine(tokens, i, current, symbols, nullptr, emit);
     }
 
+    if (recording)
+    {
+        cache->insert(blockKey, blockCode);
+    }
+    if (cache)
+    {
+        stats.count("cache_hits", cache->hitCount());
+        stats.count("cache_misses", cache->missCount());
+    }
+    time = stats.add(SECOND_PASS, time);
+    std::cout.flush();
+    stats.add(WRITE, time);
     return 0;
 }
 
@@ -669,8 +2682,7 @@ int main(int argc, char *argv[])
 {
     try
     {
-        _main(argc, argv);
-        return 0;
+        return _main(argc, argv);
     }
     catch (std::exception &e)
     {
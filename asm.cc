@@ -1,3 +1,4 @@
+#include <charconv>
 #include <fstream>
 #include <iostream>
 #include <regex>
@@ -5,28 +6,32 @@
 #include <map>
 #include <cstdint>
 #include <stdexcept>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
 
-void formatError(const std::string &message);
+#include "asm-cache.h"
+#include "asm-encode.h"
+#include "asm-input.h"
+#include "stats.h"
 
-/** For a given instruction, returns the machine code for that instruction.
- *
- * @param[out] word The machine code for the instruction
- * @param instruction The name of the instruction
- * @param one The value of the first parameter
- * @param two The value of the second parameter
- * @param three The value of the third parameter
- */
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
 
-static uint32_t imm_mod_two(int imm, uint32_t mod)
-{
-    long long x = static_cast<long long>(imm);
-    long long m = static_cast<long long>(mod);
-    long long r = x % m;
-    if (r < 0) r += m;
-    return static_cast<uint32_t>(r);
-}
+void formatError(const std::string &message);
 
-static uint32_t bswap32_arith(uint32_t enc)
+static constexpr uint32_t bswap32_arith(uint32_t enc)
 {
     uint32_t b0 = enc % 256u;
     uint32_t b1 = (enc / 256u) % 256u;
@@ -36,132 +41,41 @@ static uint32_t bswap32_arith(uint32_t enc)
     return b0 * 16777216u + b1 * 65536u + b2 * 256u + b3;
 }
 
-static uint32_t enc_r3_arith(uint32_t base, int rd, int rn, int rm)
-{
-    return base
-         + static_cast<uint32_t>(rm) * 65536u   // 2^16
-         + static_cast<uint32_t>(rn) * 32u      // 2^5
-         + static_cast<uint32_t>(rd);
-}
-
+/** For a given instruction, returns the machine code for that instruction.  The encoding itself is
+ *  arm64::detail::encodeFields, shared with asm-tokenizer and the assembler library.
+ *
+ * @param[out] word The machine code for the instruction
+ * @param instruction The name of the instruction
+ * @param one The value of the first parameter
+ * @param two The value of the second parameter
+ * @param three The value of the third parameter
+ */
 bool compileLine(uint32_t &          word,
                  const std::string & instruction,
                  int                 one,
                  int                 two,
                  int                 three)
 {
-    uint32_t enc = 0;
-
-    if (instruction == "add")
-    {
-        enc = enc_r3_arith(0x8B206000u, one, two, three);
-    }
-    else if (instruction == "br")
-    {
-        enc = 0xD61F0000u + static_cast<uint32_t>(one) * 32u;
-    }
-    else if (instruction == "blr")
-    {
-        enc = 0xD63F0000u + static_cast<uint32_t>(one) * 32u;
-    }
-    else if (instruction == "cmp")
-    {
-        // cmp xN, xM  == subs xzr, xN, xM 
-        enc = enc_r3_arith(0xEB206000u, 31, one, two);
-    }
-    else if (instruction == "sub")
-    {
-        enc = enc_r3_arith(0xCB206000u, one, two, three);
-    }
-    else if (instruction == "mul")
-    {
-        enc = enc_r3_arith(0x9B007C00u, one, two, three);
-    }
-    else if (instruction == "smulh")
-    {
-        enc = enc_r3_arith(0x9B407C00u, one, two, three);
-    }
-    else if (instruction == "umulh")
-    {
-        enc = enc_r3_arith(0x9BC07C00u, one, two, three);
-    }
-    else if (instruction == "sdiv")
-    {
-        enc = enc_r3_arith(0x9AC00C00u, one, two, three);
-    }
-    else if (instruction == "udiv")
-    {
-        enc = enc_r3_arith(0x9AC00800u, one, two, three);
-    }
-    
-    
-    else if (instruction == "ldur")
-    {
-        int imm = three;
-        if (imm < -256 || imm > 255)
-        {
-            formatError("ldur immediate out of range : " + std::to_string(imm));
-            return false;
-        }
-        uint32_t imm9 = imm_mod_two(imm, 512u); // 2^9
-        enc = 0xF8400000u
-            + imm9 * 4096u
-            + static_cast<uint32_t>(two) * 32u
-            + static_cast<uint32_t>(one);
-    }
-    else if (instruction == "stur")
+    arm64::detail::InstructionInfo info;
+    if (!arm64::detail::lookupInstruction(instruction, info))
     {
-        int imm = three;
-        if (imm < -256 || imm > 255)
-        {
-            formatError("stur immediate out of range : " + std::to_string(imm));
-            return false;
-        }
-        uint32_t imm9 = imm_mod_two(imm, 512u); // 2^9
-        enc = 0xF8000000u
-            + imm9 * 4096u
-            + static_cast<uint32_t>(two) * 32u
-            + static_cast<uint32_t>(one);
+        formatError("'" + instruction + "' is not a known instruction");
+        return false;
     }
-    else if (instruction == "ldr")
-    {
-        int imm = two;
-        if ((imm % 4) != 0)
-        {
-            formatError("ldr immediate must be a multiple of 4 bytes: " + std::to_string(imm));
-            return false;
-        }
 
-        int imm19_signed = imm / 4;
-        if (imm19_signed < -262144 || imm19_signed > 262143)
-        {
-            formatError("ldr immediate out of range : " + std::to_string(imm));
-            return false;
-        }
-
-        uint32_t imm19 = imm_mod_two(imm19_signed, 524288u); // 2^19
-        enc = 0x58000000u
-            + imm19 * 32u
-            + static_cast<uint32_t>(one);
+    const int64_t values[3] = {one, two, three};
+    uint32_t enc = 0;
+    size_t rejected = 0;
+    arm64::Error error = arm64::detail::encodeFields(info, values, enc, rejected);
+    if (error == arm64::Error::ImmediateAlignment)
+    {
+        formatError(instruction + " immediate must be a multiple of 4 bytes: " + std::to_string(values[rejected]));
+        return false;
     }
-    else if (instruction == "b")
+    if (error != arm64::Error::None)
     {
-        int imm = one;
-        if ((imm % 4) != 0)
-        {
-            formatError("b immediate must be a multiple of 4 bytes: " + std::to_string(imm));
-            return false;
-        }
-
-        int imm26_signed = imm / 4;
-        if (imm26_signed < -33554432 || imm26_signed > 33554431)
-        {
-            formatError("b immediate out of range : " + std::to_string(imm));
-            return false;
-        }
-
-        uint32_t imm26 = imm_mod_two(imm26_signed, 67108864u); // 2^26
-        enc = 0x14000000u + imm26;
+        formatError(instruction + " immediate out of range : " + std::to_string(values[rejected]));
+        return false;
     }
 
     word = bswap32_arith(enc);
@@ -169,21 +83,31 @@ bool compileLine(uint32_t &          word,
 }
 
 
+/** Where formatError sends its messages.  Parallel workers point this at a per-chunk buffer so that
+ *  errors can be replayed in input order by the writer. */
+static thread_local std::ostream *errorStream = &std::cerr;
+
 /** Prints an error to stderr with an "ERROR: " prefix, and newline suffix.
  *
  * @param message The error to print
  */
 void formatError(const std::string &message)
 {
-    std::cerr << "ERROR: " << message << std::endl;
+    *errorStream << "ERROR: " << message << std::endl;
 }
 
 /** Matches a line of ARM assembly, potentially with comments */
 std::regex ARM_LINE_PATTERN(
     "^\\s*([a-z]+)\\s+(x\\d+|0x[0-9a-fA-F]*|-?\\d+|xzr)\\s*(?:(?:(?:,\\s*(x\\d+|0x[0-9a-fA-F]*|-?\\d+|xzr))?(?:,\\s*(x\\d+|0x[0-9a-fA-F]*|-?\\d+|xzr))?)|(?:,\\s*\\[\\s*(x\\d+|xzr)\\s*,\\s*(0x[0-9a-fA-F]*|-?\\d+)\\s*\\]))\\s*(?:\\/\\/.*)?$");
 
-/** Recognizes an empty line (or an empty line with a comment) */
-std::regex EMPTY_LINE("^\\s*(//.*)?$");
+/** Recognizes an empty line (or an empty line with a comment), as the regex `^\s*(//.*)?$` would:
+ *  whitespace, then optionally a `//` comment, which like `.` cannot contain '\r' */
+bool isEmptyLine(std::string_view line)
+{
+    size_t start = input::skipSpace(line);
+    return start == line.size() ||
+           (line.compare(start, 2, "//") == 0 && line.find('\r', start) == std::string_view::npos);
+}
 
 /** Maps the instruction name to the parameter type.  The value must be a 3 character string, 'r'
  *  represents a register, 'i' represents an immediate, 'z' represents a register where 0 is allowed, and ' ' represents no value */
@@ -258,17 +182,18 @@ uint32_t readReg(bool zeroable, const std::string &s)
     return ret;
 }
 
-/** Compiles one line of assembly and send the binary to standard out.  If the assembly is invalid,
+/** Compiles one line of assembly and send the binary to out.  If the assembly is invalid,
  *  print an error to stderr and return false.  Assumes that the assembly does not have a trailing
  *  comment.
  *
  * @param line The line to parse
- * @return True if the line is valid assembly and was output to stdout, false otherwise
+ * @param out Where the machine code is written
+ * @return True if the line is valid assembly and was output to out, false otherwise
  */
-bool parseLine(const std::string &line)
+bool parseLine(std::string_view line, std::ostream &out)
 {
-    std::smatch matches;
-    if (!std::regex_search(line, matches, ARM_LINE_PATTERN))
+    std::match_results<std::string_view::const_iterator> matches;
+    if (!std::regex_search(line.begin(), line.end(), matches, ARM_LINE_PATTERN))
     {
         formatError((std::stringstream() << "Unable to parse line: \"" << line << "\"").str());
         return false;
@@ -339,6 +264,11 @@ bool parseLine(const std::string &line)
         formatError(arg.what());
         return false;
     }
+    catch (std::out_of_range &)
+    {
+        formatError("Value '" + argmatches[index] + "' is out of range");
+        return false;
+    }
 
     uint32_t binary = 0;
     bool compiled = compileLine(binary,
@@ -349,10 +279,10 @@ bool parseLine(const std::string &line)
     if (compiled)
     {
         // Output of the binary in BIG-ENDIAN order
-        std::cout << (char)((binary >> 24) & 0xFF)
-                  << (char)((binary >> 16) & 0xFF)
-                  << (char)((binary >> 8) & 0xFF)
-                  << (char)((binary >> 0) & 0xFF);
+        out << (char)((binary >> 24) & 0xFF)
+            << (char)((binary >> 16) & 0xFF)
+            << (char)((binary >> 8) & 0xFF)
+            << (char)((binary >> 0) & 0xFF);
         return true;
     }
     else
@@ -362,66 +292,735 @@ bool parseLine(const std::string &line)
     }
 }
 
-/** Entrypoint for the assembler.  The first parameter (optional) is a mips assembly file to
- *  read.  If no parameter is specified, read assembly from stdin.  Prints machine code to stdout.
- *  If invalid assembly is found, prints an error to stderr, stops reading assembly, and return a
- *  non-0 value.
+/** Cache of encoded lines, when `--cache` is given */
+static AssemblyCache *lineCache = nullptr;
+
+/** Strips the comment from one raw input line and assembles it, skipping empty lines.  With a
+ *  line cache, lines seen before are copied from the cache instead of being parsed again.
  *
- * If the file is not found, print an error and returns a non-0 value.
+ * @param line The raw line, as read from the input
+ * @param out Where the machine code is written
+ * @return False if the line is invalid assembly (an error has been printed), true otherwise
+ */
+bool assembleLine(std::string_view line, std::ostream &out)
+{
+    // Filter out any comments
+    line = line.substr(0, input::findByte(line, ';'));
+
+    if (isEmptyLine(line))
+    {
+        return true;
+    }
+
+    if (lineCache == nullptr)
+    {
+        return parseLine(line, out);
+    }
+
+    // A line's machine code depends only on its text, so the text is the whole cache key
+    std::string key = "L";
+    key += line;
+    std::string code;
+    if (!lineCache->find(key, code))
+    {
+        std::ostringstream encoded;
+        if (!parseLine(line, encoded))
+        {
+            return false;
+        }
+        code = encoded.str();
+        lineCache->insert(key, code);
+    }
+    out.write(code.data(), code.size());
+    return true;
+}
+
+/** A fixed-capacity FIFO shared between pipeline stages.  push blocks while the queue is full and
+ *  pop blocks while it is empty; once closed, push fails and pop drains what is left.
+ */
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [&] { return closed || items.size() < capacity; });
+        if (closed)
+        {
+            return false;
+        }
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [&] { return closed || !items.empty(); });
+        if (items.empty())
+        {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed = false;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+};
+
+/** A run of consecutive input lines, assembled as a unit by one worker. */
+struct Chunk
+{
+    // The lines, '\n'-separated: a view of the input when it stays in memory, else of `text`
+    std::string_view lines;
+    std::string text;
+
+    // Filled in by the worker.  If a line failed, output holds the machine code of the lines before
+    // it and errors holds what formatError printed for it.
+    std::string output;
+    std::string errors;
+    bool failed = false;
+
+    std::mutex mutex;
+    std::condition_variable doneChanged;
+    bool done = false;
+};
+
+/** Number of lines handed to a worker at a time */
+const size_t CHUNK_LINES = 4096;
+
+/** Assembles the input with a reader thread, `jobs` worker threads and the calling thread acting as
+ *  an in-order writer.  Output, including the partial output before an error, is identical to the
+ *  sequential loop in main.
  *
+ * @param in The assembly to read
+ * @param jobs The number of worker threads
+ * @param stats Counts the lines and bytes read and the bytes written
  * @return 0 on success, non-0 on error
  */
-int main(int argc, char *argv[])
+int assembleParallel(input::Reader &in, unsigned jobs, Stats &stats)
 {
-    if (argc > 2)
+    BoundedQueue<std::shared_ptr<Chunk>> work(2 * jobs);
+    BoundedQueue<std::shared_ptr<Chunk>> ordered(4 * jobs);
+    std::atomic<bool> cancelled(false);
+    uint64_t linesRead = 0;
+    uint64_t bytesWritten = 0;
+
+    std::thread reader([&]()
     {
-        std::cerr << "Usage:" << std::endl
-                  << "\tasm [$FILE]" << std::endl
-                  << std::endl
-                  << "If $FILE is unspecified or if $FILE is `-`, read the assembly from standard "
-                  << "in. Otherwise, read the assembly from $FILE." << std::endl;
+        bool more = true;
+        while (more && !cancelled)
+        {
+            auto chunk = std::make_shared<Chunk>();
+            std::string_view line;
+            const char *start = nullptr;
+            size_t count = 0;
+            while (count < CHUNK_LINES && (more = in.nextLine(line)))
+            {
+                // Lines of a mapped file or memory stay put, so the chunk can view them in place
+                if (in.stable())
+                {
+                    start = start == nullptr ? line.data() : start;
+                    chunk->lines = std::string_view(start, line.data() + line.size() - start);
+                }
+                else
+                {
+                    chunk->text += line;
+                    chunk->text += '\n';
+                }
+                count++;
+            }
+            if (count == 0)
+            {
+                break;
+            }
+            if (!in.stable())
+            {
+                chunk->lines = chunk->text;
+            }
+            linesRead += count;
+            // The writer must learn about a chunk before any worker can finish it
+            if (!ordered.push(chunk) || !work.push(chunk))
+            {
+                break;
+            }
+        }
+        ordered.close();
+        work.close();
+    });
+
+    std::vector<std::thread> workers;
+    for (unsigned j = 0; j < jobs; j++)
+    {
+        workers.emplace_back([&]()
+        {
+            std::shared_ptr<Chunk> chunk;
+            while (work.pop(chunk))
+            {
+                if (!cancelled)
+                {
+                    std::ostringstream out;
+                    std::ostringstream errors;
+                    errorStream = &errors;
+                    input::Reader lines(chunk->lines.data(), chunk->lines.size());
+                    std::string_view line;
+                    while (lines.nextLine(line))
+                    {
+                        if (!assembleLine(line, out))
+                        {
+                            chunk->failed = true;
+                            break;
+                        }
+                    }
+                    errorStream = &std::cerr;
+                    chunk->output = out.str();
+                    chunk->errors = errors.str();
+                    chunk->text = std::string();
+                }
+                std::lock_guard<std::mutex> lock(chunk->mutex);
+                chunk->done = true;
+                chunk->doneChanged.notify_all();
+            }
+        });
+    }
+
+    int result = 0;
+    std::shared_ptr<Chunk> chunk;
+    while (ordered.pop(chunk))
+    {
+        {
+            std::unique_lock<std::mutex> lock(chunk->mutex);
+            chunk->doneChanged.wait(lock, [&] { return chunk->done; });
+        }
+        std::cout.write(chunk->output.data(), chunk->output.size());
+        bytesWritten += chunk->output.size();
+        if (chunk->failed)
+        {
+            std::cout.flush();
+            std::cerr << chunk->errors;
+            result = 1;
+            break;
+        }
+    }
+
+    cancelled = true;
+    ordered.close();
+    work.close();
+    reader.join();
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+    stats.count("lines", linesRead);
+    stats.count("bytes_in", in.bytes());
+    stats.count("bytes_out", bytesWritten);
+    stats.count("instructions", bytesWritten / 4);
+    return result;
+}
+
+enum Phase
+{
+    READ,
+    ASSEMBLE,
+    PHASE_COUNT
+};
+
+const char *const PHASE_NAMES[PHASE_COUNT] = {"read", "assemble"};
+
+/** Forwards output to another stream buffer, counting the bytes written, for --stats */
+class CountingBuffer : public std::streambuf
+{
+public:
+    explicit CountingBuffer(std::streambuf *target) : target(target) {}
+
+    uint64_t bytes = 0;
+
+protected:
+    int overflow(int c) override
+    {
+        if (c == EOF)
+        {
+            return 0;
+        }
+        bytes++;
+        return target->sputc(c);
+    }
+
+    std::streamsize xsputn(const char *s, std::streamsize n) override
+    {
+        bytes += n;
+        return target->sputn(s, n);
+    }
+
+    int sync() override
+    {
+        return target->pubsync();
+    }
+
+private:
+    std::streambuf *target;
+};
+
+/** Assembles lines from in until the end of the input or the first invalid line.
+ *
+ * @param in The assembly to read
+ * @param out Where the machine code is written
+ * @param stats Accumulates the time spent, as one assemble phase (reading lines, mapped or buffered,
+ *              is too cheap to time line by line), and the lines and bytes read
+ * @return 0 on success, non-0 on error
+ */
+int assembleStream(input::Reader &in, std::ostream &out, Stats &stats)
+{
+    Stats::Time time = stats.now();
+    uint64_t lines = 0;
+    int result = 0;
+    std::string_view line;
+    while (in.nextLine(line))
+    {
+        lines++;
+        if (!assembleLine(line, out))
+        {
+            result = 1;
+            break;
+        }
+    }
+    stats.add(ASSEMBLE, time);
+    stats.count("lines", lines);
+    stats.count("bytes_in", in.bytes());
+    return result;
+}
+
+/** Longest daemon request header line: a PATH or OUTPUT line with a path up to PATH_MAX */
+const size_t MAX_REQUEST_LINE = 8192;
+
+/** Largest SOURCE a daemon request may send */
+const size_t MAX_REQUEST_SOURCE = size_t(1) << 28;
+
+/** Seconds a daemon worker waits on a silent client before dropping the request */
+const int REQUEST_TIMEOUT_SECONDS = 10;
+
+/** Buffered reads of the request framing from a daemon client socket */
+class SocketReader
+{
+public:
+    explicit SocketReader(int fd) : fd(fd) {}
+
+    /** Reads up to (and discards) the next newline
+     *
+     * @return false at the end of the input, or if the line is longer than MAX_REQUEST_LINE
+     */
+    bool readLine(std::string &line)
+    {
+        line.clear();
+        char c;
+        while (readExact(&c, 1))
+        {
+            if (c == '\n')
+            {
+                return true;
+            }
+            if (line.size() == MAX_REQUEST_LINE)
+            {
+                return false;
+            }
+            line += c;
+        }
+        return false;
+    }
+
+    bool readExact(char *data, size_t length)
+    {
+        while (length > 0)
+        {
+            if (start == end && !fill())
+            {
+                return false;
+            }
+            size_t n = std::min(length, end - start);
+            std::copy(buffer + start, buffer + start + n, data);
+            start += n;
+            data += n;
+            length -= n;
+        }
+        return true;
+    }
+
+private:
+    bool fill()
+    {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        start = 0;
+        end = n > 0 ? n : 0;
+        return n > 0;
+    }
+
+    int fd;
+    char buffer[65536];
+    size_t start = 0;
+    size_t end = 0;
+};
+
+static bool writeAll(int fd, const std::string &data)
+{
+    size_t written = 0;
+    while (written < data.size())
+    {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n <= 0)
+        {
+            return false;
+        }
+        written += n;
+    }
+    return true;
+}
+
+/** Serves one daemon request.  A request is a sequence of header lines:
+ *
+ *      SOURCE <length>\n<length bytes of assembly>   or   PATH <file>\n
+ *      OUTPUT <file>\n                                   (optional)
+ *      END\n
+ *
+ *  The response is `<exit status> <output length> <error length>\n` followed by the machine code
+ *  (empty if OUTPUT was given, in which case it was written to that file) and the text `asm` would
+ *  have printed to stderr.
+ *
+ * @param fd The connected client socket; closed on return
+ */
+void serveRequest(int fd)
+{
+    SocketReader reader(fd);
+    std::string source;
+    std::string path;
+    std::string outputPath;
+    bool haveSource = false;
+    bool valid = false;
+    std::string line;
+    try
+    {
+        while (reader.readLine(line))
+        {
+            if (line == "END")
+            {
+                valid = haveSource || !path.empty();
+                break;
+            }
+            else if (line.starts_with("SOURCE "))
+            {
+                size_t length = std::stoull(line.substr(7));
+                if (length > MAX_REQUEST_SOURCE)
+                {
+                    break;
+                }
+                source.resize(length);
+                if (!reader.readExact(source.data(), length))
+                {
+                    break;
+                }
+                haveSource = true;
+            }
+            else if (line.starts_with("PATH "))
+            {
+                path = line.substr(5);
+            }
+            else if (line.starts_with("OUTPUT "))
+            {
+                outputPath = line.substr(7);
+            }
+            else
+            {
+                break;
+            }
+        }
+    }
+    catch (std::exception &)
+    {
+        valid = false;
+    }
+
+    std::ostringstream out;
+    std::ostringstream errors;
+    errorStream = &errors;
+    int status = 1;
+    // Nothing one request does may escape into the worker thread and take down the daemon
+    try
+    {
+        if (!valid)
+        {
+            formatError("malformed daemon request");
+        }
+        else if (haveSource)
+        {
+            input::Reader in(source.data(), source.size());
+            Stats stats("asm", PHASE_NAMES, PHASE_COUNT, false);
+            status = assembleStream(in, out, stats);
+        }
+        else
+        {
+            // A path of "-" names a file here, not standard in
+            input::Reader in(path == "-" ? "./-" : path);
+            if (!in.ok())
+            {
+                formatError((std::stringstream() << "file '" << path << "' not found!").str());
+            }
+            else
+            {
+                Stats stats("asm", PHASE_NAMES, PHASE_COUNT, false);
+                status = assembleStream(in, out, stats);
+            }
+        }
+    }
+    catch (std::exception &e)
+    {
+        formatError(std::string("unable to assemble request: ") + e.what());
+        status = 1;
+    }
+    errorStream = &std::cerr;
+
+    std::string machineCode = out.str();
+    if (valid && !outputPath.empty())
+    {
+        std::ofstream file(outputPath, std::ios::binary | std::ios::trunc);
+        file.write(machineCode.data(), machineCode.size());
+        if (!file)
+        {
+            errors << "ERROR: unable to write '" << outputPath << "'" << std::endl;
+            status = 1;
+        }
+        machineCode.clear();
+    }
+
+    std::string error = errors.str();
+    std::string header = std::to_string(status) + " " + std::to_string(machineCode.size()) + " " +
+                         std::to_string(error.size()) + "\n";
+    writeAll(fd, header) && writeAll(fd, machineCode) && writeAll(fd, error);
+    close(fd);
+}
+
+/** Runs the assembler as a resident daemon that accepts requests (see serveRequest) on a Unix
+ *  socket and serves them from a pool of worker threads.  Runs until killed.
+ *
+ * @param socketPath Where to create the socket, readable and writable only by its owner.  A stale
+ *                   socket there is replaced; any other file is an error.
+ * @param jobs The number of worker threads
+ * @return non-0 if the socket could not be set up
+ */
+int runDaemon(const std::string &socketPath, unsigned jobs)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+    {
+        formatError("socket path '" + socketPath + "' is too long");
         return 1;
     }
+    std::copy(socketPath.begin(), socketPath.end(), address.sun_path);
 
-    std::ifstream fp;
-    std::istream &in =
-        (argc > 1 && std::string(argv[1]) != "-")
-        ? [&]() -> std::istream &
+    struct stat existing;
+    if (lstat(socketPath.c_str(), &existing) == 0)
     {
-        fp.open(argv[1]);
-        return fp;
-    }()
-        : std::cin;
+        if (!S_ISSOCK(existing.st_mode))
+        {
+            formatError("'" + socketPath + "' exists and is not a socket");
+            return 1;
+        }
+        unlink(socketPath.c_str());
+    }
 
-    if (!fp && argc > 1)
+    // The daemon reads and writes files for whoever connects, so only the owner may.  The umask
+    // covers the window between bind and chmod.
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t mask = umask(0177);
+    bool bound = listener >= 0 && bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0;
+    umask(mask);
+    if (!bound || chmod(socketPath.c_str(), 0600) != 0 || listen(listener, 128) != 0)
     {
-        formatError((std::stringstream() << "file '" << argv[1] << "' not found!").str());
+        formatError("unable to listen on '" + socketPath + "'");
         return 1;
     }
 
-    while (!in.eof())
+    BoundedQueue<int> connections(4 * jobs);
+    std::vector<std::thread> workers;
+    for (unsigned j = 0; j < jobs; j++)
     {
-        std::string line;
-        std::getline(in, line);
+        workers.emplace_back([&]()
+        {
+            int fd;
+            while (connections.pop(fd))
+            {
+                serveRequest(fd);
+            }
+        });
+    }
 
-        // Filter out any comments
-        uint32_t startComment = line.find(";");
-        if (startComment != std::string::npos)
+    while (true)
+    {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd >= 0)
         {
-            line = line.substr(0, line.find(";"));
+            // Bound how long an idle or stalled client can hold a worker
+            timeval timeout = {REQUEST_TIMEOUT_SECONDS, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            connections.push(fd);
         }
+    }
+}
 
-        std::smatch matches;
-        if (std::regex_search(line, matches, EMPTY_LINE))
+/** Entrypoint for the assembler.  The first parameter (optional) is a mips assembly file to
+ *  read.  If no parameter is specified, read assembly from stdin.  Prints machine code to stdout.
+ *  If invalid assembly is found, prints an error to stderr, stops reading assembly, and return a
+ *  non-0 value.
+ *
+ * With `-j N` (N > 1), lines are assembled by N worker threads; see assembleParallel.
+ *
+ * With `--daemon SOCKET`, stays resident and serves requests from asm-client; see runDaemon.
+ *
+ * With `--cache FILE`, reuses the machine code of lines assembled by earlier runs; see AssemblyCache.
+ *
+ * With `--stats`, or with ASM_STATS set, prints timings and counters as JSON to stderr; see Stats.
+ *
+ * If the file is not found, print an error and returns a non-0 value.
+ *
+ * @return 0 on success, non-0 on error
+ */
+int main(int argc, char *argv[])
+{
+    unsigned jobs = 1;
+    bool jobsGiven = false;
+    std::string socketPath;
+    std::string cachePath;
+    bool statsFlag = false;
+    bool badOption = false;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--stats")
         {
+            statsFlag = true;
             continue;
         }
-
-        if (!parseLine(line))
+        else if (arg == "--daemon" || arg == "--cache" || arg == "-j")
         {
-            return 1;
+            // An option missing its value is an error, not the input file
+            if (i + 1 == argc)
+            {
+                badOption = true;
+                break;
+            }
+        }
+        if (arg == "--daemon")
+        {
+            socketPath = argv[++i];
+        }
+        else if (arg == "--cache")
+        {
+            cachePath = argv[++i];
         }
+        else if (arg.starts_with("-j"))
+        {
+            std::string count = arg.size() > 2 ? arg.substr(2) : argv[++i];
+            auto [end, error] = std::from_chars(count.data(), count.data() + count.size(), jobs);
+            if (error != std::errc() || end != count.data() + count.size() || jobs == 0)
+            {
+                std::cerr << "ERROR: invalid job count '" << count << "'" << std::endl;
+                badOption = true;
+                break;
+            }
+            jobsGiven = true;
+        }
+        else
+        {
+            args.push_back(arg);
+        }
+    }
+
+    if (badOption || args.size() > 1 || (!socketPath.empty() && (!args.empty() || !cachePath.empty())))
+    {
+        std::cerr << "Usage:" << std::endl
+                  << "\tasm [-j N] [--cache $CACHE] [--stats] [$FILE]" << std::endl
+                  << "\tasm [-j N] --daemon $SOCKET" << std::endl
+                  << std::endl
+                  << "If $FILE is unspecified or if $FILE is `-`, read the assembly from standard "
+                  << "in. Otherwise, read the assembly from $FILE." << std::endl
+                  << "With -j N, assemble using N worker threads." << std::endl
+                  << "With --cache, reuse machine code for lines cached in $CACHE by earlier runs." << std::endl
+                  << "With --stats (or ASM_STATS set), print timings and counters as JSON to "
+                  << "standard error." << std::endl
+                  << "With --daemon, serve asm-client requests on the Unix socket $SOCKET using N "
+                  << "worker threads." << std::endl;
+        return 1;
+    }
+
+    if (!socketPath.empty())
+    {
+        return runDaemon(socketPath, jobsGiven ? jobs : std::max(1u, std::thread::hardware_concurrency()));
+    }
+
+    Stats stats("asm", PHASE_NAMES, PHASE_COUNT, Stats::requested(statsFlag));
+    Stats::Time time = stats.now();
+    input::Reader in(args.empty() ? "-" : args[0]);
+    if (!in.ok())
+    {
+        formatError((std::stringstream() << "file '" << args[0] << "' not found!").str());
+        return 1;
+    }
+
+    std::unique_ptr<AssemblyCache> cache;
+    if (!cachePath.empty())
+    {
+        cache = std::make_unique<AssemblyCache>(cachePath);
+        lineCache = cache.get();
     }
+    stats.add(READ, time);
 
-    return 0;
+    int result;
+    if (jobs > 1)
+    {
+        time = stats.now();
+        result = assembleParallel(in, jobs, stats);
+        stats.add(ASSEMBLE, time);
+    }
+    else if (!stats.enabled())
+    {
+        result = assembleStream(in, std::cout, stats);
+    }
+    else
+    {
+        // Count the bytes written on their way to stdout
+        CountingBuffer counted(std::cout.rdbuf());
+        std::ostream out(&counted);
+        result = assembleStream(in, out, stats);
+        stats.count("bytes_out", counted.bytes);
+        stats.count("instructions", counted.bytes / 4);
+    }
+    if (cache)
+    {
+        stats.count("cache_hits", cache->hitCount());
+        stats.count("cache_misses", cache->missCount());
+    }
+    return result;
 }
@@ -1,58 +1,161 @@
+#include <cstdint>
 #include <iostream>
-#include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
 #include <set>
 
+#include "asm-input.h"
+#include "stats.h"
+
 const std::string ALPHABET    = ".ALPHABET";
 const std::string STATES      = ".STATES";
 const std::string TRANSITIONS = ".TRANSITIONS";
 const std::string INPUT       = ".INPUT";
 const std::string EMPTY       = ".EMPTY";
 
-bool isChar(std::string s) {
+// Phases reported by --stats
+enum Phase { READ, RUN, WRITE, PHASE_COUNT };
+const char* const PHASE_NAMES[PHASE_COUNT] = {"read", "run", "write"};
+
+// Symbols that cannot be written directly, since whitespace separates symbols
+// in the spec: \s is a space, \t a tab, \r a carriage return, \n a newline
+// and \\ a backslash.  An escape is a single symbol, and can end a range.
+bool readSymbol(std::string_view s, size_t& i, char& c) {
+  if (i >= s.length()) {
+    return false;
+  }
+  if (s[i] != '\\' || i + 1 >= s.length()) {
+    c = s[i++];
+    return true;
+  }
+  switch (s[i + 1]) {
+    case 's': c = ' '; break;
+    case 't': c = '\t'; break;
+    case 'r': c = '\r'; break;
+    case 'n': c = '\n'; break;
+    case '\\': c = '\\'; break;
+    default: return false;
+  }
+  i += 2;
+  return true;
+}
+
+// The symbols written as `s`: a single symbol or a range, else nothing
+std::string symbolsOf(std::string_view s) {
+  size_t i = 0;
+  char first, last;
+  if (!readSymbol(s, i, first)) {
+    return "";
+  }
+  if (i == s.length()) {
+    return std::string(1, first);
+  }
+  if (s[i] != '-' || !readSymbol(s, ++i, last) || i != s.length()) {
+    return "";
+  }
+  std::string symbols;
+  for (int c = (unsigned char)first; c <= (unsigned char)last; ++c) {
+    symbols += (char)c;
+  }
+  return symbols;
+}
+
+bool isChar(std::string_view s) {
   return s.length() == 1;
 }
-bool isRange(std::string s) {
-  return s.length() == 3 && s[1] == '-';
+
+// Writes the DFA as a C++ header for a table-driven scanner: states are
+// numbered in .STATES order (0 is initial), and <NAME>_TRANSITIONS[state][byte]
+// is the next state, or -1 where there is no transition.
+void printTable(const std::string& name, const std::vector<std::string>& states,
+                const std::set<std::string>& acceptingStates,
+                const std::map<std::pair<std::string, char>, std::string>& transitions) {
+  std::map<std::string, int> number;
+  for (size_t i = 0; i < states.size(); ++i) {
+    number[states[i]] = i;
+  }
+  std::ostream& out = std::cout;
+  out << "// Generated by `dfa --table " << name << "`; do not edit.\n"
+      << "#ifndef " << name << "_H\n#define " << name << "_H\n\n#include <cstdint>\n\n"
+      << "const int " << name << "_STATE_COUNT = " << states.size() << ";\n\n"
+      << "const char *const " << name << "_STATE_NAMES[" << name << "_STATE_COUNT] = {\n";
+  for (const std::string& state : states) {
+    out << "    \"" << state << "\",\n";
+  }
+  out << "};\n\nconst bool " << name << "_ACCEPTING[" << name << "_STATE_COUNT] = {\n";
+  for (const std::string& state : states) {
+    out << "    " << (acceptingStates.count(state) ? "true" : "false") << ",\n";
+  }
+  out << "};\n\nconst int16_t " << name << "_TRANSITIONS[" << name << "_STATE_COUNT][256] = {\n";
+  for (const std::string& state : states) {
+    out << "    {";
+    for (int c = 0; c < 256; ++c) {
+      auto next = transitions.find({state, (char)c});
+      int to = -1;
+      if (next != transitions.end() && number.count(next->second)) {
+        to = number[next->second];
+      }
+      out << (c % 32 == 0 ? "\n        " : " ") << to << ",";
+    }
+    out << "\n    },\n";
+  }
+  out << "};\n\n#endif\n";
 }
 
 // Locations in the program that you should modify to store the
 // DFA information have been marked with four-slash comments:
 //// (Four-slash comment)
 
-int main() {
-  std::istream& in = std::cin;
-  std::string s;
-  
+int main(int argc, char* argv[]) {
+  std::string_view s;
+
+  // With --table NAME, print the DFA as a C++ header instead of running it.
+  // With --stats (or ASM_STATS set), print timings and counters as JSON to stderr.
+  std::string tableName;
+  bool statsFlag = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--table" && i + 1 < argc) {
+      tableName = argv[++i];
+    } else if (arg == "--stats") {
+      statsFlag = true;
+    } else {
+      std::cerr << "Usage:" << std::endl
+                << "\tdfa [--table NAME] [--stats] < SPEC" << std::endl;
+      return 1;
+    }
+  }
+  Stats stats("dfa", PHASE_NAMES, PHASE_COUNT, Stats::requested(statsFlag));
+  Stats::Time time = stats.now();
+  // Words and lines are views into the input, which is mapped when it is a
+  // file and read in large blocks otherwise
+  input::Reader in("-");
+
   // Data structures to store DFA
   std::set<char> alphabet;
   std::string initialState;
   std::set<std::string> acceptingStates;
+  std::vector<std::string> states;
   std::map<std::pair<std::string, char>, std::string> transitions;
 
-  std::getline(in, s); // Alphabet section (skip header)
+  in.nextLine(s); // Alphabet section (skip header)
   // Read characters or ranges separated by whitespace
-  while(in >> s) {
+  while(in.nextWord(s)) {
     if (s == STATES) { 
       break; 
     } else {
-      if (isChar(s)) {
-        //// Variable 's[0]' is an alphabet symbol
-        alphabet.insert(s[0]);
-      } else if (isRange(s)) {
-        for(char c = s[0]; c <= s[2]; ++c) {
-          //// Variable 'c' is an alphabet symbol
-          alphabet.insert(c);
-        }
-      } 
+      for (char c : symbolsOf(s)) {
+        //// Variable 'c' is an alphabet symbol
+        alphabet.insert(c);
+      }
     }
   }
 
-  std::getline(in, s); // States section (skip header)
+  in.nextLine(s); // States section (skip header)
   // Read states separated by whitespace
-  while(in >> s) {
+  while(in.nextWord(s)) {
     if (s == TRANSITIONS) { 
       break; 
     } else {
@@ -60,9 +163,10 @@ int main() {
       bool accepting = false;
       if (s.back() == '!' && !isChar(s)) {
         accepting = true;
-        s.pop_back();
+        s.remove_suffix(1);
       }
       //// Variable 's' contains the name of a state
+      states.emplace_back(s);
       if (initial) {
         //// The state is initial
         initialState = s;
@@ -70,36 +174,32 @@ int main() {
       }
       if (accepting) {
         //// The state is accepting
-        acceptingStates.insert(s);
+        acceptingStates.emplace(s);
       }
     }
   }
 
-  std::getline(in, s); // Transitions section (skip header)
+  in.nextLine(s); // Transitions section (skip header)
   // Read transitions line-by-line
-  while(std::getline(in, s)) {
+  while(in.nextLine(s)) {
     if (s == INPUT) { 
       // Note: Since we're reading line by line, once we encounter the
       // input header, we will already be on the line after the header
       break; 
     } else {
       std::string fromState, symbols, toState;
-      std::istringstream line(s);
-      std::vector<std::string> lineVec;
-      while(line >> s) {
+      input::Reader line(s.data(), s.size());
+      std::vector<std::string_view> lineVec;
+      while(line.nextWord(s)) {
         lineVec.push_back(s);
       }
+      if (lineVec.empty()) {
+        continue; // blank line
+      }
       fromState = lineVec.front();
       toState = lineVec.back();
-      for(int i = 1; i < lineVec.size()-1; ++i) {
-        std::string s = lineVec[i];
-        if (isChar(s)) {
-          symbols += s;
-        } else if (isRange(s)) {
-          for(char c = s[0]; c <= s[2]; ++c) {
-            symbols += c;
-          }
-        }
+      for(size_t i = 1; i + 1 < lineVec.size(); ++i) {
+        symbols += symbolsOf(lineVec[i]);
       }
       for ( char c : symbols ) {
         //// There is a transition from 'fromState' to 'toState' on 'c'
@@ -108,8 +208,21 @@ int main() {
     }
   }
 
+  time = stats.add(READ, time);
+  stats.count("states", states.size());
+  stats.count("transitions", transitions.size());
+
+  if (!tableName.empty()) {
+    printTable(tableName, states, acceptingStates, transitions);
+    stats.add(WRITE, time);
+    return 0;
+  }
+
+  uint64_t inputs = 0, accepts = 0, steps = 0;
+
   // Input section (already skipped header)
-  while (in >> s) {
+  std::string out;
+  while (in.nextWord(s)) {
     //// Variable 's' contains an input string for the DFA
     // Handling empty string
     if (s == EMPTY) {
@@ -121,6 +234,7 @@ int main() {
     
     // Process each character in the input string store it as pair in transition
     for (char c : s) {
+      ++steps;
       auto key = std::make_pair(currentState, c);
       if (transitions.find(key) != transitions.end()) {
         currentState = transitions[key];
@@ -131,11 +245,25 @@ int main() {
       }
     }
     
+    ++inputs;
     // Check if we ended in an accepting state
+    out += s.empty() ? std::string_view(EMPTY) : s;
     if (accepted && acceptingStates.find(currentState) != acceptingStates.end()) {
-      std::cout << (s.empty() ? EMPTY : s) << " true" << std::endl;
+      ++accepts;
+      out += " true\n";
     } else {
-      std::cout << (s.empty() ? EMPTY : s) << " false" << std::endl;
+      out += " false\n";
+    }
+    // Written in large blocks rather than flushed per line
+    if (out.size() >= 1 << 16) {
+      std::cout.write(out.data(), out.size());
+      out.clear();
     }
   }
+  std::cout.write(out.data(), out.size());
+  std::cout.flush();
+  stats.add(RUN, time);
+  stats.count("inputs", inputs);
+  stats.count("accepted", accepts);
+  stats.count("dfa_steps", steps);
 }
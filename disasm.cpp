@@ -0,0 +1,410 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Prints an error to stderr with an "ERROR: " prefix, and newline suffix.
+ *
+ * @param message The error to print
+ */
+void formatError(const std::string &message)
+{
+    std::cerr << "ERROR: " << message << std::endl;
+}
+
+/** How the operand fields of an instruction are laid out and printed */
+enum Format
+{
+    R3,     // rd, rn, rm            (rm may be xzr)
+    CMP,    // rn, rm                (rd is fixed to 31)
+    R1,     // rn
+    WIDE,   // rd, imm16, lsl hw * 16
+    MEM,    // rt, [rn, simm9]
+    LIT,    // rt, simm19 * 4
+    B26,    // simm26 * 4
+    B19     // simm19 * 4
+};
+
+struct Opcode
+{
+    uint32_t mask;
+    uint32_t match;
+    Format format;
+    const char *mnemonic;
+};
+
+/** Every instruction compileLine can emit.  An instruction word w is `mnemonic` iff
+ *  (w & mask) == match; the bits outside the mask are operand fields. */
+const Opcode OPCODES[] = {
+    {0xFFE0FC00u, 0x8B206000u, R3, "add"},
+    {0xFFE0FC00u, 0xCB206000u, R3, "sub"},
+    {0xFFE0FC00u, 0x9B007C00u, R3, "mul"},
+    {0xFFE0FC00u, 0x9B407C00u, R3, "smulh"},
+    {0xFFE0FC00u, 0x9BC07C00u, R3, "umulh"},
+    {0xFFE0FC00u, 0x9AC00C00u, R3, "sdiv"},
+    {0xFFE0FC00u, 0x9AC00800u, R3, "udiv"},
+    {0xFFE0FC1Fu, 0xEB20601Fu, CMP, "cmp"},
+    {0xFFFFFC1Fu, 0xD61F0000u, R1, "br"},
+    {0xFFFFFC1Fu, 0xD63F0000u, R1, "blr"},
+    {0xFF800000u, 0xD2800000u, WIDE, "movz"},
+    {0xFF800000u, 0xF2800000u, WIDE, "movk"},
+    {0xFF800000u, 0x92800000u, WIDE, "movn"},
+    {0xFFE00C00u, 0xF8400000u, MEM, "ldur"},
+    {0xFFE00C00u, 0xF8000000u, MEM, "stur"},
+    {0xFF000000u, 0x58000000u, LIT, "ldr"},
+    {0xFC000000u, 0x14000000u, B26, "b"},
+    {0xFF00001Fu, 0x54000000u, B19, "b.eq"},
+    {0xFF00001Fu, 0x54000001u, B19, "b.ne"},
+    {0xFF00001Fu, 0x54000002u, B19, "b.hs"},
+    {0xFF00001Fu, 0x54000003u, B19, "b.lo"},
+    {0xFF00001Fu, 0x54000008u, B19, "b.hi"},
+    {0xFF00001Fu, 0x54000009u, B19, "b.ls"},
+    {0xFF00001Fu, 0x5400000Au, B19, "b.ge"},
+    {0xFF00001Fu, 0x5400000Bu, B19, "b.lt"},
+    {0xFF00001Fu, 0x5400000Cu, B19, "b.gt"},
+    {0xFF00001Fu, 0x5400000Du, B19, "b.le"},
+};
+
+const size_t OPCODE_COUNT = sizeof(OPCODES) / sizeof(OPCODES[0]);
+
+/** Candidate opcodes for each value of the top byte of an instruction word, so that decoding tests
+ *  only the handful of masks that can possibly match. */
+struct DecodeTable
+{
+    uint8_t start[257];
+    uint8_t candidates[256 * OPCODE_COUNT];
+
+    DecodeTable()
+    {
+        size_t n = 0;
+        for (uint32_t top = 0; top < 256; top++)
+        {
+            start[top] = n;
+            for (size_t i = 0; i < OPCODE_COUNT; i++)
+            {
+                uint32_t topMask = OPCODES[i].mask >> 24;
+                if ((top & topMask) == (OPCODES[i].match >> 24))
+                {
+                    candidates[n++] = i;
+                }
+            }
+        }
+        start[256] = n;
+    }
+
+    /** Returns the opcode for a word, or nullptr if it is not one the assembler emits */
+    const Opcode *decode(uint32_t word) const
+    {
+        uint32_t top = word >> 24;
+        for (size_t i = start[top]; i < start[top + 1]; i++)
+        {
+            const Opcode &op = OPCODES[candidates[i]];
+            if ((word & op.mask) == op.match)
+            {
+                return &op;
+            }
+        }
+        return nullptr;
+    }
+};
+
+/** Sign-extends the low `bits` bits of value */
+static int64_t signExtend(uint32_t value, int bits)
+{
+    return static_cast<int64_t>(static_cast<int32_t>(value << (32 - bits)) >> (32 - bits));
+}
+
+/** Buffered writer for stdout that formats directly into its buffer */
+class Output
+{
+public:
+    Output() : buffer(1 << 20) {}
+    ~Output() { flush(); }
+
+    void flush()
+    {
+        size_t written = 0;
+        while (written < length)
+        {
+            ssize_t n = write(STDOUT_FILENO, buffer.data() + written, length - written);
+            if (n <= 0)
+            {
+                break;
+            }
+            written += n;
+        }
+        length = 0;
+    }
+
+    /** Makes room for at least one more line of output */
+    void reserve()
+    {
+        if (buffer.size() - length < 128)
+        {
+            flush();
+        }
+    }
+
+    void text(const char *s)
+    {
+        size_t n = strlen(s);
+        memcpy(buffer.data() + length, s, n);
+        length += n;
+    }
+
+    /** Writes a string whose length is known at compile time */
+    template <size_t N>
+    void literal(const char (&s)[N])
+    {
+        memcpy(buffer.data() + length, s, N - 1);
+        length += N - 1;
+    }
+
+    void number(int64_t value)
+    {
+        char digits[24];
+        size_t n = 0;
+        uint64_t magnitude = value < 0 ? 0 - static_cast<uint64_t>(value) : value;
+        do
+        {
+            digits[n++] = '0' + magnitude % 10;
+            magnitude /= 10;
+        } while (magnitude != 0);
+        if (value < 0)
+        {
+            buffer[length++] = '-';
+        }
+        while (n > 0)
+        {
+            buffer[length++] = digits[--n];
+        }
+    }
+
+    void hex(uint64_t value, int digits)
+    {
+        static const char HEX[] = "0123456789abcdef";
+        buffer[length++] = '0';
+        buffer[length++] = 'x';
+        for (int shift = (digits - 1) * 4; shift >= 0; shift -= 4)
+        {
+            buffer[length++] = HEX[(value >> shift) & 0xF];
+        }
+    }
+
+    /** Register 31 prints as xzr where the assembler allows it and as sp elsewhere */
+    void reg(uint32_t r, bool zeroable)
+    {
+        static const char NAMES[32][4] = {
+            "x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7", "x8", "x9", "x10",
+            "x11", "x12", "x13", "x14", "x15", "x16", "x17", "x18", "x19", "x20", "x21",
+            "x22", "x23", "x24", "x25", "x26", "x27", "x28", "x29", "x30", "sp"};
+        const char *name = r == 31 && zeroable ? "xzr" : NAMES[r];
+        // Every name fits in 4 bytes including the terminator, so copy all 4 and advance by the length
+        memcpy(buffer.data() + length, name, 4);
+        length += name[2] == '\0' ? 2 : 3;
+    }
+
+private:
+    std::vector<char> buffer;
+    size_t length = 0;
+};
+
+/** Prints one decoded instruction in the syntax the assembler accepts */
+static void printInstruction(Output &out, const Opcode &op, uint32_t word)
+{
+    uint32_t rd = word & 31u;
+    uint32_t rn = (word >> 5) & 31u;
+    uint32_t rm = (word >> 16) & 31u;
+
+    out.text(op.mnemonic);
+    out.literal(" ");
+    switch (op.format)
+    {
+    case R3:
+        out.reg(rd, false);
+        out.literal(", ");
+        out.reg(rn, false);
+        out.literal(", ");
+        out.reg(rm, true);
+        break;
+    case CMP:
+        out.reg(rn, false);
+        out.literal(", ");
+        out.reg(rm, true);
+        break;
+    case R1:
+        out.reg(rn, false);
+        break;
+    case WIDE:
+        out.reg(rd, true);
+        out.literal(", ");
+        out.hex((word >> 5) & 0xFFFFu, 4);
+        if (((word >> 21) & 3u) != 0)
+        {
+            out.literal(", lsl ");
+            out.number(((word >> 21) & 3u) * 16);
+        }
+        break;
+    case MEM:
+        out.reg(rd, false);
+        out.literal(", [");
+        out.reg(rn, false);
+        out.literal(", ");
+        out.number(signExtend((word >> 12) & 0x1FFu, 9));
+        out.literal("]");
+        break;
+    case LIT:
+        out.reg(rd, false);
+        out.literal(", ");
+        out.number(signExtend((word >> 5) & 0x7FFFFu, 19) * 4);
+        break;
+    case B26:
+        out.number(signExtend(word & 0x3FFFFFFu, 26) * 4);
+        break;
+    case B19:
+        out.number(signExtend((word >> 5) & 0x7FFFFu, 19) * 4);
+        break;
+    }
+}
+
+/** Reads a little-endian 32-bit word */
+static uint32_t load32(const unsigned char *p)
+{
+    return static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 | static_cast<uint32_t>(p[2]) << 16 |
+           static_cast<uint32_t>(p[3]) << 24;
+}
+
+/** Disassembles a machine code image.  Words that are not instructions the assembler emits are
+ *  printed as `.8byte` together with the following word, so the output assembles back to the same
+ *  bytes.  The only exception is an unknown final word, which has no partner and is printed as a
+ *  comment.
+ *
+ * @return true if the image was a whole number of words
+ */
+bool disassemble(const unsigned char *code, size_t size, bool addresses, Output &out)
+{
+    static const DecodeTable table;
+
+    size_t offset = 0;
+    while (offset + 4 <= size)
+    {
+        out.reserve();
+        uint32_t word = load32(code + offset);
+        const Opcode *op = table.decode(word);
+        size_t start = offset;
+        if (op != nullptr)
+        {
+            printInstruction(out, *op, word);
+            offset += 4;
+        }
+        else if (offset + 8 <= size)
+        {
+            out.literal(".8byte ");
+            out.hex(static_cast<uint64_t>(load32(code + offset + 4)) << 32 | word, 16);
+            offset += 8;
+        }
+        else
+        {
+            out.literal("// .word ");
+            out.hex(word, 8);
+            offset += 4;
+        }
+        if (addresses)
+        {
+            out.literal(" // ");
+            out.hex(start, 8);
+        }
+        out.literal("\n");
+    }
+    return offset == size;
+}
+
+/** Entrypoint for the disassembler.  Reads machine code produced by `asm` or `asm-tokenizer` from
+ *  FILE (or standard in) and prints assembly that assembles back to the same bytes.
+ *
+ * @return 0 on success, non-0 on error
+ */
+int main(int argc, char *argv[])
+{
+    bool addresses = false;
+    std::string path = "-";
+    int files = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::string(argv[i]) == "-a")
+        {
+            addresses = true;
+        }
+        else
+        {
+            path = argv[i];
+            files++;
+        }
+    }
+    if (files > 1)
+    {
+        std::cerr << "Usage:" << std::endl
+                  << "\tdisasm [-a] [FILE]" << std::endl
+                  << std::endl
+                  << "If FILE is unspecified or if FILE is `-`, read machine code from standard "
+                  << "in. Otherwise, read machine code from FILE." << std::endl
+                  << "With -a, annotate each line with its offset." << std::endl;
+        return 1;
+    }
+
+    int fd = STDIN_FILENO;
+    if (path != "-")
+    {
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            formatError("File '" + path + "' not found!");
+            return 1;
+        }
+    }
+
+    // Map regular files; fall back to reading pipes into memory
+    const unsigned char *code = nullptr;
+    size_t size = 0;
+    std::vector<unsigned char> data;
+    struct stat st;
+    void *mapped = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        size = st.st_size;
+        mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (mapped != MAP_FAILED)
+    {
+        madvise(mapped, size, MADV_SEQUENTIAL);
+        code = static_cast<const unsigned char *>(mapped);
+    }
+    else
+    {
+        unsigned char block[1 << 16];
+        ssize_t n;
+        while ((n = read(fd, block, sizeof(block))) > 0)
+        {
+            data.insert(data.end(), block, block + n);
+        }
+        code = data.data();
+        size = data.size();
+    }
+
+    Output out;
+    bool whole = disassemble(code, size, addresses, out);
+    out.flush();
+    if (!whole)
+    {
+        formatError("Input is not a whole number of 4-byte words");
+        return 1;
+    }
+    return 0;
+}
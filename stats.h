@@ -0,0 +1,193 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/resource.h>
+#include <time.h>
+
+/** Run statistics shared by asm, asm-tokenizer and dfa, for telemetry.  Enabled by `--stats` or by
+ *  setting the ASM_STATS environment variable; when enabled, one JSON object is printed to stderr
+ *  when the Stats goes out of scope:
+ *
+ *      {"tool":"asm","phases":{"read":{"wall":0.01,"cpu":0.01},...},"counters":{"lines":10,...},
+ *       "allocations":42,"peak_rss_kb":3520}
+ *
+ *  Phases are the tool's own (see each tool's PHASE_NAMES); only phases the run went through are
+ *  listed.  CPU time is for the whole process, so it exceeds wall time when threads run in
+ *  parallel.  When disabled, timing calls cost a branch and counters are not recorded.
+ *
+ *  Allocations are counted by replacing the global operator new, so this header must be included by
+ *  exactly one translation unit of a program.
+ */
+namespace stats_detail
+{
+inline std::atomic<uint64_t> allocations{0};
+}
+
+// Neither side is inlined into callers, where GCC would pair malloc() with operator delete and warn
+__attribute__((noinline)) void *operator new(std::size_t size)
+{
+    stats_detail::allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+class Stats
+{
+public:
+    /** A point in time on both clocks, as returned by now() */
+    struct Time
+    {
+        std::chrono::steady_clock::time_point wall;
+        double cpu = 0;
+    };
+
+    /** Whether stats were asked for, by `--stats` (passed as `flag`) or by ASM_STATS */
+    static bool requested(bool flag)
+    {
+        return flag || std::getenv("ASM_STATS") != nullptr;
+    }
+
+    /**
+     * @param tool The name reported in the output
+     * @param phaseNames Names of the tool's phases, indexed by its Phase enum
+     */
+    Stats(const char *tool, const char *const *phaseNames, int phaseCount, bool enabled)
+        : tool(tool), phaseNames(phaseNames), phases(phaseCount), on(enabled)
+    {
+    }
+
+    ~Stats()
+    {
+        if (on)
+        {
+            print();
+        }
+    }
+
+    Stats(const Stats &) = delete;
+    Stats &operator=(const Stats &) = delete;
+
+    bool enabled() const { return on; }
+
+    /** Heap allocations by the whole process so far, whether or not stats are enabled */
+    static uint64_t allocations()
+    {
+        return stats_detail::allocations.load(std::memory_order_relaxed);
+    }
+
+    Time now() const
+    {
+        return on ? Time{std::chrono::steady_clock::now(), cpuSeconds()} : Time();
+    }
+
+    /** Charges the time since `start` to `phase` and returns the current time */
+    Time add(int phase, Time start)
+    {
+        if (!on)
+        {
+            return start;
+        }
+        Time end = now();
+        phases[phase].wall += std::chrono::duration<double>(end.wall - start.wall).count();
+        phases[phase].cpu += end.cpu - start.cpu;
+        phases[phase].used = true;
+        return end;
+    }
+
+    /** Adds `n` to the named counter.  Not thread-safe: threads should count locally and report
+     *  their totals from one thread. */
+    void count(const char *name, uint64_t n)
+    {
+        if (!on)
+        {
+            return;
+        }
+        for (auto &counter : counters)
+        {
+            if (counter.first == name)
+            {
+                counter.second += n;
+                return;
+            }
+        }
+        counters.emplace_back(name, n);
+    }
+
+private:
+    struct Phase
+    {
+        double wall = 0;
+        double cpu = 0;
+        bool used = false;
+    };
+
+    static double cpuSeconds()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    /** Writes the JSON object in one call, so it is not interleaved with other output */
+    void print() const
+    {
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        std::ostringstream json;
+        json << "{\"tool\":\"" << tool << "\",\"phases\":{";
+        const char *separator = "";
+        for (size_t phase = 0; phase < phases.size(); phase++)
+        {
+            if (phases[phase].used)
+            {
+                json << separator << "\"" << phaseNames[phase] << "\":{\"wall\":" << phases[phase].wall
+                     << ",\"cpu\":" << phases[phase].cpu << "}";
+                separator = ",";
+            }
+        }
+        json << "},\"counters\":{";
+        separator = "";
+        for (const auto &counter : counters)
+        {
+            json << separator << "\"" << counter.first << "\":" << counter.second;
+            separator = ",";
+        }
+        json << "},\"allocations\":" << allocations()
+             << ",\"peak_rss_kb\":" << usage.ru_maxrss << "}\n";
+        std::string text = json.str();
+        std::cerr.write(text.data(), text.size());
+        std::cerr.flush();
+    }
+
+    const char *tool;
+    const char *const *phaseNames;
+    std::vector<Phase> phases;
+    bool on;
+    std::vector<std::pair<std::string, uint64_t>> counters;
+};
+
+#endif